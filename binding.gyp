@@ -4,10 +4,13 @@
       "target_name": "binding",
       "sources": [
         "src/binding.cpp",
+        "src/decoder.cpp",
         "src/iterator.cpp",
         "src/store.cpp",
+        "src/writer.cpp",
         "deps/murmur3/murmur3.c",
-        "deps/paldb/src/reader.c"
+        "deps/paldb/src/reader.c",
+        "deps/paldb/src/writer.c"
       ],
       "include_dirs" : [
         "<!(node -e \"require('nan')\")"
@@ -5,25 +5,99 @@
 
 typedef struct pal_reader pal_reader_t;
 
+typedef struct pal_writer pal_writer_t;
+
 typedef struct pal_statistics {
   int64_t timestamp;
+  int32_t num_keys;
   int32_t num_values;
   int32_t index_size;
   int64_t data_size;
 } pal_statistics_t;
 
+// Number of buckets in the probe length histogram.
+#define PAL_PROBE_BUCKETS 16
+
+// Lookup counters (see `pal_enable_metrics`).
+typedef struct pal_metrics {
+  int64_t num_hits;
+  int64_t num_misses;
+  int64_t num_filtered; // Misses answered by a membership filter (which don't
+                        // inspect any slots).
+  int64_t num_block_hits; // Compressed blocks found in the block cache.
+  int64_t num_block_misses; // Compressed blocks decompressed.
+  // Lookups by number of slots inspected: `probe_lengths[i]` counts lookups
+  // which inspected `i + 1` slots, the last bucket also counts longer ones.
+  int64_t probe_lengths[PAL_PROBE_BUCKETS];
+} pal_metrics_t;
+
+// Index layout of a single partition (see `pal_partition_statistics`).
+typedef struct pal_partition_statistics {
+  int32_t key_size;
+  int32_t num_keys;
+  int32_t num_slots;
+  int32_t slot_size;
+  double load_factor;
+  double mean_displacement; // Slots between a key's home slot and its own.
+  int32_t max_displacement;
+  int32_t filter_size; // Membership filter size in bytes, 0 if there is none.
+} pal_partition_statistics_t;
+
+// Contiguous range of slots within a partition (end exclusive).
+typedef struct pal_range {
+  int32_t key_size;
+  int32_t start_slot;
+  int32_t end_slot;
+} pal_range_t;
+
 // Opaque iterator (with a bit of padding).
 typedef struct {
-  char data[48];
+  char data[80];
 } pal_iterator_t;
 
+// Writer options (zero-initialized fields fall back to their defaults).
+typedef struct pal_writer_options {
+  double load_factor; // Ratio of keys to slots in each index, defaults to 0.6
+                      // (0.9 for bucketized indices).
+  char no_distinct; // Allow overwriting (and deleting) keys.
+  char bucketized; // Write cache line aligned bucketized indices (in a
+                   // `VERSION_2` store, which PalDB itself can't read).
+  int32_t filter_bits; // Membership filter bits per key, 0 (the default) to
+                       // write no filters. 10 gives a ~1% false positive rate.
+  int32_t block_size; // Compress values in blocks of about this many bytes
+                      // (at most 65536, in a `VERSION_3` or `VERSION_4`
+                      // store), 0 (the default) to store them as is.
+  char ordered; // Also write a directory of all keys in byte order, for prefix
+                // and bound iterators (8 bytes per key, in a section which
+                // other readers skip).
+  int64_t value_cache_size; // Bytes of distinct values remembered to
+                            // deduplicate later identical ones (within each
+                            // partition), defaults to 16 MiB. Negative to
+                            // disable deduplication.
+  int64_t memory_budget; // Bytes of keys and indices held in memory, 0 (the
+                         // default) for no limit. Items are then spilled to
+                         // temporary files and indices built in chunks, into
+                         // identical stores. Incompatible with `bucketized`,
+                         // `ordered`, and deletions.
+  int32_t num_threads; // Threads building indices when the writer is closed,
+                       // defaults to 1. Partitions are built concurrently,
+                       // and so are slot ranges of large indices (into
+                       // identical stores). Ignored with `memory_budget`.
+  char *metadata; // Copied, can be freed after `pal_writer_init` returns.
+  int32_t metadata_len;
+  const char *tmp_dir; // Where to buffer values, defaults to `tmpfile`'s.
+} pal_writer_options_t;
+
 // Error codes (to help disambiguate instantiation errors).
 enum pal_error {
   NO_FILE,
   STAT_FAIL,
   ALLOC_FAIL,
   MMAP_FAIL,
-  INVALID_DATA
+  INVALID_DATA,
+  WRITE_FAIL,
+  DUPLICATE_KEY,
+  COMPRESSED_STORE // Values can't be referenced in place, see `pal_read`.
 };
 
 // Exposed error global.
@@ -46,12 +120,54 @@ pal_reader_t *pal_init(const char *path);
  */
 void pal_statistics(pal_reader_t *reader, pal_statistics_t *stats);
 
+/**
+ * Get layout statistics for each of the store's partitions.
+ *
+ * @param reader An active reader.
+ * @param n The number of statistics which fit in `stats`.
+ * @param stats Where to store the statistics (ordered by key size), can be
+ * NULL to only count partitions.
+ *
+ * Displacements are computed by rehashing every key in the store, so this is
+ * about as expensive as a full iteration. Returns the number of partitions.
+ *
+ */
+int32_t pal_partition_statistics(pal_reader_t *reader, int32_t n, pal_partition_statistics_t *stats);
+
+/**
+ * Turn lookup counters on or off.
+ *
+ * Counters are off by default and then cost nothing: enabling them swaps
+ * each partition's probing loop for an instrumented one (which is also
+ * slightly slower, since it isn't specialized by key size). Counts are
+ * approximate if lookups are made from several threads concurrently.
+ *
+ */
+void pal_enable_metrics(pal_reader_t *reader, char enabled);
+
+/**
+ * Get lookup counters, accumulated while they were enabled.
+ *
+ */
+void pal_metrics(pal_reader_t *reader, pal_metrics_t *metrics);
+
 /**
  * Get store metadata.
  *
  */
 void pal_metadata(pal_reader_t *reader, char **metadata, int32_t *metadata_len);
 
+/**
+ * Fault in the pages lookups touch first (indices, membership filters, and
+ * block tables), so that a freshly opened store's first lookups don't each
+ * wait on the disk. Values are left alone.
+ *
+ * Blocks until they are all read, it is meant to be called off the hot path
+ * (e.g. before swapping a store in, see the Node package's `Store#swap`).
+ *
+ */
+void pal_warm(pal_reader_t *reader);
+
 /**
  * Fetch bytes corresponding to a given key.
  *
@@ -61,27 +177,218 @@ void pal_metadata(pal_reader_t *reader, char **metadata, int32_t *metadata_len);
  * @param value Where to store the pointer to the returned value.
  * @param value_len Value length.
  *
- * Returns 1 if found, 0 otherwise.
+ * Returns 1 if found, 0 otherwise. Values of compressed stores (see
+ * `pal_compressed`) can't be referenced in place, their lookups always return
+ * -1 (with PAL_ERRNO set to COMPRESSED_STORE): use `pal_read` instead.
  *
  */
-char pal_get(pal_reader_t *reader, char *key, int32_t key_len, char **value, int64_t *value_len);
+int pal_get(pal_reader_t *reader, char *key, int32_t key_len, char **value, int64_t *value_len);
+
+/**
+ * Hash a key, equivalent to PalDB's implementation.
+ *
+ * The result is non-negative and can be passed to the `*_hashed` functions to
+ * avoid hashing the same key multiple times.
+ *
+ */
+int32_t pal_hash(char *key, int32_t key_len);
+
+/**
+ * Shard (between 0 and `num_shards - 1`) a key belongs to, given its hash.
+ *
+ * Keys of a sharded store are spread across several store files by this
+ * function, which remixes the hash so that shards don't correlate with the
+ * slots keys occupy within each one's index.
+ *
+ */
+int32_t pal_shard(int32_t hash, int32_t num_shards);
+
+/**
+ * Same as `pal_get`, using a precomputed hash (see `pal_hash`).
+ *
+ */
+int pal_get_hashed(pal_reader_t *reader, char *key, int32_t key_len, int32_t hash, char **value, int64_t *value_len);
+
+/**
+ * Copy the value corresponding to a key.
+ *
+ * @param reader An active reader.
+ * @param key The key to look up.
+ * @param key_len The length of the key.
+ * @param hash The key's hash (see `pal_hash`).
+ * @param buf Where to copy the value.
+ * @param buf_len Size of `buf`. The value is only copied if it fits.
+ *
+ * Works on all stores, decompressing blocks of compressed stores as needed
+ * (recently used blocks are kept in a cache, see `pal_set_cache_size`). Safe
+ * to call from several threads concurrently.
+ *
+ * Returns the value's length, -1 if the key is missing, -2 if the value
+ * couldn't be read (see PAL_ERRNO).
+ *
+ */
+int64_t pal_read(pal_reader_t *reader, char *key, int32_t key_len, int32_t hash, char *buf, int64_t buf_len);
+
+/**
+ * Whether a store's values are compressed (see `pal_read`).
+ *
+ */
+char pal_compressed(pal_reader_t *reader);
+
+/**
+ * Bound the memory used to cache decompressed blocks (64 MiB by default).
+ *
+ * No-op for stores which aren't compressed.
+ *
+ */
+void pal_set_cache_size(pal_reader_t *reader, int64_t cache_size);
+
+/**
+ * Fetch bytes corresponding to several keys.
+ *
+ * @param reader An active reader.
+ * @param n The number of keys.
+ * @param keys The keys to look up.
+ * @param key_lens The length of each key.
+ * @param hashes Each key's hash (see `pal_hash`), can be NULL.
+ * @param values Where to store the pointer to each returned value.
+ * @param value_lens Each value's length, -1 if the key is missing.
+ *
+ * Equivalent to calling `pal_get` on each key, but faster for large stores
+ * since memory accesses for different keys are interleaved.
+ *
+ * Returns the number of keys found. As with `pal_get`, compressed stores can't
+ * be read: -1 is returned (with PAL_ERRNO set to COMPRESSED_STORE) and each
+ * value's length set to -2.
+ *
+ */
+int32_t pal_get_batch(pal_reader_t *reader, int32_t n, char **keys, int32_t *key_lens, int32_t *hashes, char **values, int64_t *value_lens);
 
 /**
  * Create iterator of keys and values.
  *
- * The reader mustn't be destroyed during the lifetime of its iterators.
+ * The reader mustn't be destroyed during the lifetime of its iterators. On
+ * compressed stores, iterators hold a copy of their last value: they must be
+ * released with `pal_iterator_destroy` (before being reset again).
  *
  */
 void pal_iterator_reset(pal_iterator_t *iterator, pal_reader_t *reader);
 
+/**
+ * Create iterator of keys and values in data order.
+ *
+ * Entries are returned one partition at a time, each sorted by data offset
+ * (index order jumps around the data section, which turns a full scan of a
+ * store larger than memory into random reads). Each partition's entries are
+ * gathered when the iterator reaches it (16 bytes per key) and the data ahead
+ * is hinted to the kernel as the iterator progresses (allocation failures
+ * are reported as errors by `pal_iterator_next`). Sequential iterators must be
+ * released with `pal_iterator_destroy`.
+ *
+ */
+void pal_iterator_reset_sequential(pal_iterator_t *iterator, pal_reader_t *reader);
+
+/**
+ * Split a store's entries into disjoint ranges.
+ *
+ * @param reader An active reader.
+ * @param n Target number of ranges. Ranges never span partitions, so there
+ * can be up to one more per non-empty partition.
+ * @param ranges Where to store the ranges, can be NULL to only count them.
+ *
+ * Ranges are of roughly equal number of slots. Returns the number of ranges.
+ *
+ */
+int32_t pal_ranges(pal_reader_t *reader, int32_t n, pal_range_t *ranges);
+
+/**
+ * Create iterator over a range of entries (see `pal_ranges`).
+ *
+ * Iterators over different ranges can safely be used concurrently. Returns 0
+ * on success, -1 if the range is invalid.
+ *
+ */
+int pal_iterator_reset_range(pal_iterator_t *iterator, pal_reader_t *reader, pal_range_t *range);
+
+/**
+ * Whether a store has a key directory (see the `ordered` writer option).
+ *
+ */
+char pal_ordered(pal_reader_t *reader);
+
+/**
+ * Create iterator over the keys starting with a given prefix, in byte order.
+ *
+ * @param iterator The iterator to reset.
+ * @param reader An active reader, with a key directory (see `pal_ordered`).
+ * @param prefix The prefix's bytes (not referenced after this returns).
+ * @param prefix_len The length of the prefix, 0 to iterate over all keys.
+ *
+ * The directory is binary searched, so only the matching keys' slots and
+ * values are read. Keys compare as unsigned bytes, shorter keys first when one
+ * is a prefix of the other. Returns 0 on success, -1 if the store has no
+ * directory or it is invalid.
+ *
+ */
+int pal_iterator_reset_prefix(pal_iterator_t *iterator, pal_reader_t *reader, char *prefix, int32_t prefix_len);
+
+/**
+ * Same as `pal_iterator_reset_prefix`, over the keys between two bounds.
+ *
+ * @param iterator The iterator to reset.
+ * @param reader An active reader, with a key directory.
+ * @param start Inclusive lower bound, NULL for none.
+ * @param start_len Its length.
+ * @param end Exclusive upper bound, NULL for none.
+ * @param end_len Its length.
+ *
+ */
+int pal_iterator_reset_bounds(pal_iterator_t *iterator, pal_reader_t *reader, char *start, int32_t start_len, char *end, int32_t end_len);
+
 /**
  * Get next key and value from iterator.
  *
  * Returns 1 if value (and populates the arguments appropriately), 0 if
- * nothing.
+ * nothing, -1 on error (e.g. if a compressed value couldn't be read, see
+ * PAL_ERRNO), after which the iterator shouldn't be used further. Values of
+ * compressed stores are only valid until the next call.
  *
  */
-char pal_iterator_next(pal_iterator_t *iterator, char **key, int32_t *key_len, char **value, int64_t *value_len);
+int pal_iterator_next(pal_iterator_t *iterator, char **key, int32_t *key_len, char **value, int64_t *value_len);
+
+/**
+ * Get next key from iterator, without reading its value.
+ *
+ * @param iterator An iterator.
+ * @param key Where to store the pointer to the key.
+ * @param key_len Key length.
+ * @param value_len Where to store the value's length, can be NULL.
+ *
+ * Only the index (and key directory) is read when `value_len` is NULL, the
+ * data section is left alone. Otherwise only each value's length prefix is
+ * read, except in compressed stores where its block is decompressed (through
+ * the block cache). Returns 1 if key, 0 if nothing, -1 on error (as for
+ * `pal_iterator_next`).
+ *
+ */
+int pal_iterator_next_key(pal_iterator_t *iterator, char **key, int32_t *key_len, int64_t *value_len);
+
+/**
+ * Count an iterator's remaining entries, exhausting it.
+ *
+ * Ordered iterators answer from the key directory and full iterators from
+ * partition headers, without reading any keys. Range iterators scan their
+ * slots (still without reading values).
+ *
+ */
+int32_t pal_iterator_count(pal_iterator_t *iterator);
+
+/**
+ * Release an iterator's value copy and sorted entries (a no-op unless its
+ * store is compressed or it is sequential).
+ *
+ */
+void pal_iterator_destroy(pal_iterator_t *iterator);
 
 /**
  * Close a reader, freeing all associated memory.
@@ -89,4 +396,56 @@ char pal_iterator_next(pal_iterator_t *iterator, char **key, int32_t *key_len, c
  */
 void pal_destroy(pal_reader_t *reader);
 
+/**
+ * Create a store writer.
+ *
+ * @param path Path where the store will be written (on close).
+ * @param opts Options, can be NULL.
+ *
+ * Returns NULL on failure (see PAL_ERRNO). Values are buffered to temporary
+ * files until the writer is closed, keys and offsets are kept in memory (up
+ * to `memory_budget` bytes if set).
+ *
+ */
+pal_writer_t *pal_writer_init(const char *path, const pal_writer_options_t *opts);
+
+/**
+ * Add an entry to the store.
+ *
+ * @param writer An open writer.
+ * @param key The key's bytes (copied).
+ * @param key_len The length of the key, must be positive.
+ * @param value The value's bytes, or NULL to delete the key (only meaningful
+ * with the `no_distinct` option, and not supported with `memory_budget`).
+ * @param value_len Value length.
+ *
+ * Returns 0 on success, -1 otherwise (see PAL_ERRNO).
+ *
+ */
+int pal_writer_put(pal_writer_t *writer, char *key, int32_t key_len, char *value, int64_t value_len);
+
+/**
+ * Same as `pal_writer_put`, using a precomputed hash (see `pal_hash`).
+ *
+ */
+int pal_writer_put_hashed(pal_writer_t *writer, char *key, int32_t key_len, int32_t hash, char *value, int64_t value_len);
+
+/**
+ * Build all indices and write the store file.
+ *
+ * @param writer An open writer. No more entries can be added afterwards.
+ * @param stats Populated with the written store's statistics, can be NULL.
+ *
+ * Returns 0 on success, -1 otherwise (see PAL_ERRNO; a duplicate key will
+ * cause a `DUPLICATE_KEY` error unless `no_distinct` was set).
+ *
+ */
+int pal_writer_close(pal_writer_t *writer, pal_statistics_t *stats);
+
+/**
+ * Free all memory associated with a writer (closed or not).
+ *
+ */
+void pal_writer_destroy(pal_writer_t *writer);
+
 #endif
@@ -0,0 +1,93 @@
+#ifndef PALDB_BUCKETS_H_
+#define PALDB_BUCKETS_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Bucketized index helpers, shared by the reader and writer.
+ *
+ * In `VERSION_2` stores, each partition's index starts with a line describing
+ * its buckets' layout (number of slots per bucket, then offset width in
+ * bytes), followed by the buckets themselves. Buckets are a multiple of the
+ * line size and the index section is line aligned within the file, so every
+ * bucket starts on a cache line. A bucket contains:
+ *
+ * + A one byte tag per slot (0 if the slot is empty).
+ * + Each slot's data offset, fixed-width and little-endian.
+ * + Each slot's key.
+ *
+ * Keys are stored in one of two buckets: their home bucket (chosen from their
+ * hash exactly like `VERSION_1` home slots) or an alternate bucket (chosen
+ * from a remix of their hash). Keys only go to their alternate bucket when
+ * their home bucket is full, so lookups inspect at most two buckets and
+ * misses usually stop after one.
+ *
+ */
+
+#define PAL_LINE_SIZE 64
+#define PAL_MIN_BUCKET_SLOTS 4
+#define PAL_MAX_BUCKET_SLOTS 16 // Tags must fit in a single SSE2 register.
+
+/**
+ * Murmur3's finalizer, used to derive a key's alternate bucket and tag.
+ *
+ */
+static inline uint32_t pal_remix(int32_t hash) {
+  uint32_t h = hash;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+/**
+ * Index of a key's alternate bucket.
+ *
+ */
+static inline int32_t pal_alternate_bucket(uint32_t mix, int32_t num_buckets) {
+  return ((uint64_t) mix * num_buckets) >> 32; // Avoids a division.
+}
+
+/**
+ * Non-zero tag of a key, uncorrelated with both of its buckets.
+ *
+ */
+static inline uint8_t pal_tag(uint32_t mix) {
+  uint8_t tag = (mix * 0x9e3779b1) >> 24;
+  return tag ? tag : 1;
+}
+
+/**
+ * Read a fixed-width little-endian offset.
+ *
+ */
+static inline int64_t pal_read_offset(const char *addr, int32_t width) {
+  const unsigned char *bytes = (const unsigned char *) addr;
+  int64_t offset = 0;
+  int32_t i;
+  for (i = width - 1; i >= 0; i--) {
+    offset = (offset << 8) | bytes[i];
+  }
+  return offset;
+}
+
+/**
+ * Same as `pal_read_offset`, using a single 8-byte load when possible. The
+ * caller must ensure that all 8 bytes are readable (true of all offsets in a
+ * bucket as long as its keys and offset width span at least 8 bytes).
+ *
+ */
+static inline int64_t pal_read_bucket_offset(const char *addr, int32_t width) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  uint64_t offset;
+  memcpy(&offset, addr, 8); // Single unaligned load.
+  return width == 8 ? (int64_t) offset : (int64_t) (offset & ((1ull << (8 * width)) - 1));
+#else
+  return pal_read_offset(addr, width);
+#endif
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef PALDB_FILTERS_H_
+#define PALDB_FILTERS_H_
+
+#include <stdint.h>
+
+/**
+ * Membership filter helpers, shared by the reader and writer.
+ *
+ * Partitions can have a split block Bloom filter: an array of 32 byte blocks,
+ * each made of eight 32-bit lanes. A key's hash selects a single block, then
+ * sets (or tests) one bit in each of its lanes. Lookups therefore touch a
+ * single cache line of the filter, and around 10 bits per key give a ~1%
+ * false positive rate. Lanes are stored byte by byte, so the format doesn't
+ * depend on endianness.
+ *
+ * Filters are written between the store's header and its indices, which
+ * readers unaware of them skip (index offsets are explicit).
+ *
+ */
+
+#define PAL_FILTER_BLOCK_SIZE 32
+#define PAL_FILTER_LANES 8
+#define PAL_MAX_FILTER_BITS 64 // Per key, more doesn't lower false positives.
+
+/**
+ * Index of the block holding a key's bits.
+ *
+ */
+static inline int32_t pal_filter_block(int32_t hash, int32_t num_blocks) {
+  return ((uint64_t) (hash & 0x7fffffff) * num_blocks) >> 31;
+}
+
+/**
+ * Bit set within a lane, from a remix of the key's hash (see `pal_remix`).
+ *
+ */
+static inline uint32_t pal_filter_bit(uint32_t mix, int32_t lane) {
+  static const uint32_t salts[PAL_FILTER_LANES] = {
+    0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+    0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31
+  };
+  return (mix * salts[lane]) >> 27;
+}
+
+static inline void pal_filter_add(char *block, uint32_t mix) {
+  int32_t i;
+  for (i = 0; i < PAL_FILTER_LANES; i++) {
+    uint32_t bit = pal_filter_bit(mix, i);
+    block[4 * i + (bit >> 3)] |= 1 << (bit & 7);
+  }
+}
+
+/**
+ * Returns 0 if the key is definitely missing, 1 if it might be present.
+ *
+ */
+static inline int pal_filter_contains(const char *block, uint32_t mix) {
+  int32_t i;
+  for (i = 0; i < PAL_FILTER_LANES; i++) {
+    uint32_t bit = pal_filter_bit(mix, i);
+    if (!(block[4 * i + (bit >> 3)] & (1 << (bit & 7)))) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+#endif
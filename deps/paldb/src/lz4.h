@@ -0,0 +1,194 @@
+#ifndef PALDB_LZ4_H_
+#define PALDB_LZ4_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * Minimal codec for the LZ4 block format, used to compress data blocks.
+ *
+ * A compressed block is a sequence of tokens, each made of a literal run
+ * followed by a back-reference (a 2-byte little-endian distance and a length,
+ * at least 4). The last token only has literals. Any LZ4 block decoder can
+ * decompress this compressor's output and vice versa.
+ *
+ * The compressor is greedy (single hash table of 4-byte sequences), which
+ * compresses a bit less than the reference implementation but is simple and
+ * fast. The decompressor checks all bounds, so corrupt blocks are rejected
+ * rather than read or written past their buffers.
+ *
+ */
+
+#define PAL_LZ4_HASH_BITS 12
+#define PAL_LZ4_MIN_MATCH 4
+#define PAL_LZ4_LAST_LITERALS 5 // Blocks must end with this many literals.
+#define PAL_LZ4_MATCH_LIMIT 12 // No match may start in the last bytes.
+#define PAL_LZ4_MAX_DISTANCE 65535
+
+/**
+ * Maximum size of a compressed block (for incompressible input).
+ *
+ */
+static inline int32_t pal_lz4_bound(int32_t size) {
+  return size + size / 255 + 16;
+}
+
+static inline uint32_t pal_lz4_read32(const unsigned char *addr) {
+  uint32_t val;
+  memcpy(&val, addr, 4);
+  return val;
+}
+
+static inline unsigned char *pal_lz4_write_length(unsigned char *dst, int32_t len) {
+  while (len >= 255) {
+    *dst++ = 255;
+    len -= 255;
+  }
+  *dst++ = len;
+  return dst;
+}
+
+static inline unsigned char *pal_lz4_write_literals(unsigned char *dst, const unsigned char *src, int32_t len, unsigned char **token) {
+  *token = dst++;
+  **token = (len < 15 ? len : 15) << 4;
+  if (len >= 15) {
+    dst = pal_lz4_write_length(dst, len - 15);
+  }
+  memcpy(dst, src, len);
+  return dst + len;
+}
+
+/**
+ * Compress a block.
+ *
+ * @param dst Destination, must be at least `pal_lz4_bound(src_len)` long.
+ *
+ * Returns the compressed size.
+ *
+ */
+static inline int32_t pal_lz4_compress(const char *src, int32_t src_len, char *dst) {
+  int32_t table[1 << PAL_LZ4_HASH_BITS]; // Last position of each sequence.
+  const unsigned char *start = (const unsigned char *) src;
+  const unsigned char *end = start + src_len;
+  const unsigned char *ip = start;
+  const unsigned char *anchor = start; // Start of pending literals.
+  unsigned char *op = (unsigned char *) dst;
+  unsigned char *token;
+
+  if (src_len > PAL_LZ4_MATCH_LIMIT) {
+    memset(table, 0xff, sizeof table);
+    const unsigned char *match_limit = end - PAL_LZ4_MATCH_LIMIT;
+    const unsigned char *match_end = end - PAL_LZ4_LAST_LITERALS;
+    while (ip < match_limit) {
+      uint32_t seq = pal_lz4_read32(ip);
+      uint32_t hash = (seq * 2654435761u) >> (32 - PAL_LZ4_HASH_BITS);
+      int32_t ref = table[hash];
+      table[hash] = ip - start;
+      if (
+        ref < 0 ||
+        ip - start - ref > PAL_LZ4_MAX_DISTANCE ||
+        pal_lz4_read32(start + ref) != seq
+      ) {
+        ip++;
+        continue;
+      }
+
+      const unsigned char *match = start + ref;
+      const unsigned char *cursor = ip + PAL_LZ4_MIN_MATCH;
+      match += PAL_LZ4_MIN_MATCH;
+      while (cursor < match_end && *cursor == *match) {
+        cursor++;
+        match++;
+      }
+      int32_t distance = cursor - match;
+      int32_t match_len = cursor - ip - PAL_LZ4_MIN_MATCH;
+      op = pal_lz4_write_literals(op, anchor, ip - anchor, &token);
+      *op++ = distance & 0xff;
+      *op++ = distance >> 8;
+      *token |= match_len < 15 ? match_len : 15;
+      if (match_len >= 15) {
+        op = pal_lz4_write_length(op, match_len - 15);
+      }
+      ip = anchor = cursor;
+    }
+  }
+
+  op = pal_lz4_write_literals(op, anchor, end - anchor, &token);
+  return op - (unsigned char *) dst;
+}
+
+/**
+ * Read a token's extended length.
+ *
+ * Returns -1 if the input ends first.
+ *
+ */
+static inline int pal_lz4_read_length(const unsigned char **ip, const unsigned char *end, size_t *len) {
+  unsigned char b;
+  do {
+    if (*ip >= end) {
+      return -1;
+    }
+    b = *(*ip)++;
+    *len += b;
+  } while (b == 255);
+  return 0;
+}
+
+/**
+ * Decompress a block.
+ *
+ * Returns the decompressed size, -1 if the block is invalid or doesn't fit in
+ * `dst_len` bytes.
+ *
+ */
+static inline int32_t pal_lz4_decompress(const char *src, int32_t src_len, char *dst, int32_t dst_len) {
+  const unsigned char *ip = (const unsigned char *) src;
+  const unsigned char *end = ip + src_len;
+  unsigned char *start = (unsigned char *) dst;
+  unsigned char *op = start;
+  unsigned char *op_end = start + dst_len;
+
+  while (ip < end) {
+    unsigned char token = *ip++;
+    size_t len = token >> 4;
+    if (len == 15 && pal_lz4_read_length(&ip, end, &len)) {
+      return -1;
+    }
+    if ((size_t) (end - ip) < len || (size_t) (op_end - op) < len) {
+      return -1;
+    }
+    memcpy(op, ip, len);
+    op += len;
+    ip += len;
+    if (ip == end) {
+      break; // Last token, literals only.
+    }
+
+    if (end - ip < 2) {
+      return -1;
+    }
+    size_t distance = ip[0] | (ip[1] << 8);
+    ip += 2;
+    len = token & 15;
+    if (len == 15 && pal_lz4_read_length(&ip, end, &len)) {
+      return -1;
+    }
+    len += PAL_LZ4_MIN_MATCH;
+    if (!distance || distance > (size_t) (op - start) || (size_t) (op_end - op) < len) {
+      return -1;
+    }
+    const unsigned char *match = op - distance;
+    if (distance >= len) {
+      memcpy(op, match, len);
+      op += len;
+    } else {
+      while (len--) {
+        *op++ = *match++; // Overlapping, repeats the last `distance` bytes.
+      }
+    }
+  }
+  return op - start;
+}
+
+#endif
@@ -1,48 +1,134 @@
+#define _POSIX_C_SOURCE 200809L // For `posix_madvise`.
+
 #include "../include/paldb.h"
 #include "../../murmur3/murmur3.h"
+#include "buckets.h"
+#include "filters.h"
+#include "lz4.h"
 #include <arpa/inet.h>
 #include <assert.h>
-#include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef __GNUC__
+#define PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define PREFETCH(addr)
+#endif
+
+#define BATCH_WIDTH 16 // Number of lookups interleaved by `pal_get_batch`.
+#define SHARD_SEED 0x5f356495
+#define CACHE_SHARDS 16 // Independently locked parts of the block cache.
+#define CACHE_BUCKETS 1024 // Hash chains per shard.
+#define DEFAULT_CACHE_SIZE (64 << 20)
+#define WARM_STRIDE 4096 // Bytes between the reads of `pal_warm` (a page).
+#define READAHEAD_SIZE (8 << 20) // Data hinted ahead of sequential iterators.
+
 enum pal_error PAL_ERRNO;
 
 // Data structures.
 
+struct pal_partition;
+
+// Index probing loop, specialized by key size and format (see `probe`).
+typedef int64_t (*pal_probe_t)(struct pal_partition *p, char *key, int32_t key_len, int32_t hash, int32_t index_offset);
+
 struct pal_partition {
+  int32_t key_size;
   int32_t num_keys;
-  int32_t num_slots;
-  int32_t slot_size;
+  int32_t num_slots; // Number of buckets for bucketized indices.
+  int32_t slot_size; // Bucket size for bucketized indices.
   int32_t index_offset;
   int32_t index_size;
+  int32_t bucket_slots; // Only for bucketized indices, 0 otherwise.
+  int32_t offset_width; // Likewise.
+  int32_t keys_offset; // Likewise, offset of keys within each bucket.
+  int32_t filter_blocks;
+  int32_t num_blocks; // Only for compressed data, 0 otherwise.
   int64_t data_offset;
+  int64_t data_size; // Bytes from `data` to the end of the data section.
   char *index;
+  char *data; // Starts with the block table for compressed data.
+  char *filter; // Membership filter, NULL if there is none.
+  pal_probe_t probe;
+  pal_metrics_t *metrics; // Only used by the instrumented probing loop.
+};
+
+// Decompressed block, in its shard's hash chain and LRU list.
+struct pal_cached_block {
+  struct pal_partition *partition;
+  int32_t index;
+  int32_t size;
   char *data;
+  uint32_t bucket;
+  struct pal_cached_block *next; // In hash chain.
+  struct pal_cached_block *newer;
+  struct pal_cached_block *older;
+};
+
+struct pal_cache_shard {
+  pthread_mutex_t lock;
+  int64_t size; // Decompressed bytes.
+  struct pal_cached_block *buckets[CACHE_BUCKETS];
+  struct pal_cached_block lru; // Sentinel: its `newer` block is the oldest,
+                               // its `older` one the newest.
 };
 
 struct pal_reader {
+  int32_t version;
+  char compressed;
   int64_t timestamp;
   int32_t num_values;
   int32_t max_key_size;
   struct pal_partition **partitions; // Array indexed by key length.
+  struct pal_partition *partition_block; // Backing memory for the above.
   int32_t metadata_size;
   int64_t index_size;
   int64_t data_size;
+  char *addr; // Entire file's mapping.
+  int64_t size;
   char *metadata;
   char *index;
   char *data;
+  char *directory; // Key directory, NULL if there is none.
+  int32_t directory_size; // Number of keys in the directory.
+  char metrics_enabled;
+  pal_metrics_t metrics;
+  int64_t cache_size; // Per shard.
+  struct pal_cache_shard *cache; // Only for compressed data.
+};
 
+// Entry of a partition, sorted by data offset for sequential iterators.
+struct pal_sequential_entry {
+  char *key;
+  int64_t data_offset;
 };
 
 struct pal_iterator {
   pal_reader_t *reader;
   int32_t key_size;
   int32_t num_keys; // Current count of keys for this size.
+  int32_t bucket_slot; // Next slot within the current bucket.
   int32_t index_offset;
+  int32_t end_index_offset; // Only for range iterators, -1 otherwise.
+  int32_t entry; // Next directory entry, only for ordered iterators.
+  int32_t end_entry; // Only for ordered iterators, -1 otherwise.
+  char sequential;
+  char *value; // Copy of the last value, only for compressed data.
+  int64_t value_capacity;
+  struct pal_sequential_entry *entries; // Current partition's, only for
+                                        // sequential iterators.
+  int64_t readahead; // End of the data hinted so far (relative to the
+                     // partition's data), likewise.
 };
 
 // Helpers.
@@ -60,53 +146,55 @@ static int64_t fsize(int fd) {
 }
 
 /**
- * Find byte mark and assert correct version.
+ * Find byte mark and assert supported version (`VERSION_1`, `VERSION_2` for
+ * bucketized indices, `VERSION_3` and `VERSION_4` for the same with
+ * compressed data).
+ *
+ * Returns the address right after the mark, NULL if it wasn't found.
  *
  */
-static int read_version(FILE *file) {
-  char bytes[] = {'V', 'E', 'R', 'S', 'I', 'O', 'N', '_', '1'};
-  int i = 0;
-  int c;
-  while ((c = fgetc(file)) != EOF) {
-    if (c == bytes[i]) {
-      i++;
-      if (i == 9) {
-        return 0;
-      }
-    } else {
-      i = 0; // No repeated characters, so no need to backtrack.
+static char *find_version(char *addr, char *end, int32_t *version) {
+  while ((addr = memchr(addr, 'V', end - addr)) != NULL) {
+    if (
+      end - addr >= 9 &&
+      !memcmp(addr, "VERSION_", 8) &&
+      addr[8] >= '1' &&
+      addr[8] <= '4'
+    ) {
+      *version = addr[8] - '0';
+      return addr + 9;
     }
+    addr++;
   }
-  return -1;
+  return NULL;
 }
 
 /**
- * Read 32-bit integer from a file (serialized as big-endian).
+ * Read 32-bit integer from memory (serialized as big-endian), advancing the
+ * cursor.
  *
  */
-static char read_int32(FILE *file, int32_t *val) {
-  if (fread(val, 1, 4, file) < 4) {
+static char read_int32(char **cursor, char *end, int32_t *val) {
+  if (end - *cursor < 4) {
     return -1;
   }
+  memcpy(val, *cursor, 4);
   *val = ntohl(*val); // Also works for signed.
+  *cursor += 4;
   return 0;
 }
 
 /**
- * Read 64-bit integer from a file (serialized as big-endian).
+ * Read 64-bit integer from memory (serialized as big-endian), advancing the
+ * cursor.
  *
  */
-static char read_int64(FILE *file, int64_t *val) {
-  if (fread(val, 1, 8, file) < 8) {
+static char read_int64(char **cursor, char *end, int64_t *val) {
+  int32_t high, low;
+  if (read_int32(cursor, end, &high) || read_int32(cursor, end, &low)) {
     return -1;
   }
-  int num = 48;
-  if (*((char *) &num) == num) {
-    // Little endian host byte order.
-    int32_t high = htonl((int32_t) (*val >> 32));
-    int32_t low = htonl((int32_t) (*val & 0xffffffffll));
-    *val = ((int64_t) low << 32) | high;
-  }
+  *val = (int64_t) ((uint64_t) (uint32_t) high << 32 | (uint32_t) low);
   return 0;
 }
 
@@ -122,276 +210,901 @@ static inline char *unpack_int64(char *addr, int64_t *dst) {
   char b;
   do {
     b = *addr++;
-    *dst |= (b & 0x7f) << k;
+    *dst |= (int64_t) (b & 0x7f) << k;
     k += 7;
   } while (b & 0x80);
   return addr;
 }
 
 /**
- * Unaligned, read-only, version of `mmap`.
+ * Partition for a given key length, NULL if there is none.
  *
- * Depending on the alignments of the offset and total length, we might request
- * extra bytes (up to two extra pages).
+ */
+static inline struct pal_partition *get_partition(pal_reader_t *reader, int32_t key_len) {
+  if (key_len > reader->max_key_size) {
+    return NULL;
+  }
+  return reader->partitions[key_len];
+}
+
+/**
+ * Record a lookup for a key size without partition (the probing loop isn't
+ * reached in this case, so instrumentation can't catch it).
  *
  */
-static char *unaligned_mmap(size_t len, int fd, off_t offset) {
-  int ps = getpagesize();
-  off_t aligned_offset = offset / ps * ps; // Align offset to page size.
-  len = len / ps * ps + 2 * ps; // Add padding appropriately.
-  char *addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, aligned_offset);
-  if (addr == MAP_FAILED) {
-    return MAP_FAILED;
+static void count_missing_partition(pal_reader_t *reader) {
+  if (reader->metrics_enabled) {
+    reader->metrics.num_misses++;
   }
-  return addr + (offset % ps);
 }
 
 /**
- * Corresponding unaligned version of `munmap`.
+ * Block of a partition's membership filter holding a key's bits.
  *
  */
-static int unaligned_munmap(char *addr, int64_t size) {
-  int ps = getpagesize();
-  int offset = (uintptr_t) addr % ps;
-  char *aligned_addr = offset ? addr - offset : addr;
-  int64_t aligned_size = size / ps * ps + 2 * ps;
-  return munmap(aligned_addr, aligned_size);
+static inline char *filter_block(struct pal_partition *p, int32_t hash) {
+  return p->filter + (int64_t) pal_filter_block(hash, p->filter_blocks) * PAL_FILTER_BLOCK_SIZE;
 }
 
 /**
- * Release mapped pages.
+ * Whether a key might be in a partition, according to its membership filter
+ * (if any). Negative answers are counted as misses.
  *
  */
-static void munmap_reader(pal_reader_t *reader) {
-  if (reader->metadata != MAP_FAILED) {
-    assert(!unaligned_munmap(reader->metadata, reader->metadata_size));
-    reader->metadata = MAP_FAILED;
+static inline int filter_contains(pal_reader_t *reader, struct pal_partition *p, int32_t hash) {
+  if (p->filter == NULL) {
+    return 1;
   }
-  if (reader->index != MAP_FAILED) {
-    assert(!unaligned_munmap(reader->index, reader->index_size));
-    reader->index = MAP_FAILED;
+  if (pal_filter_contains(filter_block(p, hash), pal_remix(hash))) {
+    return 1;
   }
-  if (reader->data != MAP_FAILED) {
-    assert(!unaligned_munmap(reader->data, reader->data_size));
-    reader->data = MAP_FAILED;
+  if (reader->metrics_enabled) {
+    reader->metrics.num_misses++;
+    reader->metrics.num_filtered++;
   }
+  return 0;
 }
 
 /**
- * Free all partitions up to n.
+ * Offset (within its partition's index) of the home slot for a key's hash.
  *
  */
-static void free_reader_partitions(pal_reader_t *reader) {
-  int i;
-  for (i = 0; i <= reader->max_key_size; i++) {
-    struct pal_partition *partition = reader->partitions[i];
-    if (partition != NULL) {
-      free(partition);
+static inline int32_t home_offset(struct pal_partition *p, int32_t hash) {
+  return p->slot_size * ((hash & 0x7fffffff) % p->num_slots);
+}
+
+// Key comparison.
+
+static inline int equals_any(const char *slot, const char *key, int32_t key_len) {
+  return !memcmp(slot, key, key_len);
+}
+
+/**
+ * Linear index probing loop. Key size specialized variants didn't measurably
+ * speed up this loop or the bucketized one below (see the README).
+ *
+ */
+static int64_t probe_any(struct pal_partition *p, char *key, int32_t key_len, int32_t hash, int32_t index_offset) {
+  (void) hash;
+  int32_t attempts = p->num_slots;
+  while (attempts--) {
+    // Single step linear probing.
+    char *slot = p->index + index_offset;
+    int64_t data_offset;
+    unpack_int64(slot + key_len, &data_offset);
+    if (!data_offset) {
+      // Offset 0 is reserved, the key is missing.
+      return 0;
+    }
+    if (!memcmp(slot, key, key_len)) {
+      // Found a matching key.
+      return data_offset;
+    }
+    index_offset += p->slot_size;
+    if (index_offset == p->index_size) {
+      index_offset = 0;
     }
   }
+  return 0;
 }
 
-// Public API.
+/**
+ * Record a lookup's outcome, for instrumented probing loops.
+ *
+ */
+static void count_lookup(pal_metrics_t *metrics, int64_t data_offset, int32_t num_probes) {
+  if (data_offset) {
+    metrics->num_hits++;
+  } else {
+    metrics->num_misses++;
+  }
+  if (num_probes > PAL_PROBE_BUCKETS) {
+    num_probes = PAL_PROBE_BUCKETS;
+  }
+  metrics->probe_lengths[num_probes - 1]++;
+}
 
 /**
- * Format of a file is:
+ * Instrumented probing loop, used instead of the above when metrics are
+ * enabled.
  *
- * n_bytes  description
+ */
+static int64_t probe_counted(struct pal_partition *p, char *key, int32_t key_len, int32_t hash, int32_t index_offset) {
+  (void) hash;
+  int64_t data_offset = 0;
+  int32_t num_probes = 0;
+  while (num_probes < p->num_slots) {
+    char *slot = p->index + index_offset;
+    num_probes++;
+    if (!slot[key_len]) {
+      break;
+    }
+    if (equals_any(slot, key, key_len)) {
+      unpack_int64(slot + key_len, &data_offset);
+      break;
+    }
+    index_offset += p->slot_size;
+    if (index_offset == p->index_size) {
+      index_offset = 0;
+    }
+  }
+
+  count_lookup(p->metrics, data_offset, num_probes);
+  return data_offset;
+}
+
+// Bucketized index lookups (see `buckets.h`).
+
+/**
+ * Bitmask of a bucket's slots with the given tag.
  *
- * varies   Leading data, ignored.
- * varies   Version utf-8 encoded with short length prefix (found by searching
- *          for `VERSION`).
- * 8        Creation timestamp.
- * 4        Key count.
- * 4        Key lengths count (i.e. number of partitions).
- * 4        Maximum key length.
- * // Repeated for each partition:
- * 4        Partition key length.
- * 4        Partition key count.
- * 4        Partition slot count (i.e. bucket count).
- * 4        Partition slot size (i.e. key size + maximum packed offset length).
- * 4        Partition index offset.
- * 8        Partition data offset.
- * // End of partition repeat.
- * 4        Length of serializer bytes.
- * varies   Serializers. (Used as metadata here.)
- * 4        Index offset.
- * 8        Data offset.
+ */
+static inline uint32_t match_tags(const char *bucket, uint8_t tag, int32_t bucket_slots) {
+  uint32_t mask = (1u << bucket_slots) - 1;
+#ifdef __SSE2__
+  // Buckets are at least a line long, so this load stays within the index.
+  __m128i tags = _mm_loadu_si128((const __m128i *) bucket);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8(tag))) & mask;
+#else
+  uint32_t matches = 0;
+  int32_t i;
+  for (i = 0; i < bucket_slots; i++) {
+    if ((uint8_t) bucket[i] == tag) {
+      matches |= 1u << i;
+    }
+  }
+  return matches & mask;
+#endif
+}
+
+/**
+ * Find a key's data offset within a single bucket, 0 if it is missing.
  *
  */
-pal_reader_t *pal_init(const char *path) {
-  FILE *file = fopen(path, "rb");
-  if (file == NULL) {
-    PAL_ERRNO = NO_FILE;
-    goto file_error;
+static inline int64_t probe_bucket(struct pal_partition *p, char *bucket, char *key, int32_t key_len, uint8_t tag) {
+  uint32_t matches = match_tags(bucket, tag, p->bucket_slots);
+  int32_t i;
+  for (i = 0; matches; i++, matches >>= 1) {
+    if ((matches & 1) && equals_any(bucket + p->keys_offset + i * key_len, key, key_len)) {
+      return pal_read_bucket_offset(
+        bucket + p->bucket_slots + i * p->offset_width,
+        p->offset_width
+      );
+    }
   }
+  return 0;
+}
 
-  pal_reader_t *r = malloc(sizeof *r);
-  if (r == NULL) {
-    PAL_ERRNO = ALLOC_FAIL;
-    goto reader_error;
+/**
+ * Find a key's data offset in its home bucket (at the given index offset),
+ * then in its alternate bucket. The latter is skipped if the home bucket has
+ * room left, since keys only overflow from full buckets.
+ *
+ * Returns 0 if the key is missing, and sets the number of buckets inspected.
+ *
+ */
+static inline int64_t probe_buckets_with(struct pal_partition *p, char *key, int32_t key_len, int32_t hash, int32_t index_offset, int32_t *num_probes) {
+  uint32_t mix = pal_remix(hash);
+  uint8_t tag = pal_tag(mix);
+  char *bucket = p->index + index_offset;
+  char *alternate = p->index + (int64_t) pal_alternate_bucket(mix, p->num_slots) * p->slot_size;
+  int64_t data_offset = probe_bucket(p, bucket, key, key_len, tag);
+  *num_probes = 1;
+  if (data_offset || match_tags(bucket, 0, p->bucket_slots) || alternate == bucket) {
+    return data_offset;
   }
+  *num_probes = 2;
+  return probe_bucket(p, alternate, key, key_len, tag);
+}
 
-  // Find byte mark and load metadata.
-  int32_t num_non_empty_partitions;
+static int64_t probe_buckets_any(struct pal_partition *p, char *key, int32_t key_len, int32_t hash, int32_t index_offset) {
+  int32_t num_probes;
+  return probe_buckets_with(p, key, key_len, hash, index_offset, &num_probes);
+}
+
+static int64_t probe_buckets_counted(struct pal_partition *p, char *key, int32_t key_len, int32_t hash, int32_t index_offset) {
+  int32_t num_probes;
+  int64_t data_offset = probe_buckets_with(p, key, key_len, hash, index_offset, &num_probes);
+  count_lookup(p->metrics, data_offset, num_probes);
+  return data_offset;
+}
+
+/**
+ * Choose a partition's probing loop.
+ *
+ */
+static pal_probe_t select_probe(struct pal_partition *p, char counted) {
+  if (counted) {
+    return p->bucket_slots ? probe_buckets_counted : probe_counted;
+  }
+  return p->bucket_slots ? probe_buckets_any : probe_any;
+}
+
+/**
+ * Find a key's data offset, starting from the given index offset.
+ *
+ * Returns 0 if the key is missing.
+ *
+ */
+static inline int64_t probe(struct pal_partition *p, char *key, int32_t key_len, int32_t hash, int32_t index_offset) {
+  return p->probe(p, key, key_len, hash, index_offset);
+}
+
+/**
+ * Read a bucketized partition's layout line (see `buckets.h`), moving its
+ * index past it.
+ *
+ */
+static char read_layout(struct pal_partition *p) {
+  p->bucket_slots = (unsigned char) p->index[0];
+  p->offset_width = (unsigned char) p->index[1];
+  p->keys_offset = p->bucket_slots * (1 + p->offset_width);
   if (
-    read_version(file) ||
-    read_int64(file, &r->timestamp) ||
-    read_int32(file, &r->num_values) ||
-    read_int32(file, &num_non_empty_partitions) ||
-    read_int32(file, &r->max_key_size)
+    p->bucket_slots < 1 ||
+    p->bucket_slots > PAL_MAX_BUCKET_SLOTS ||
+    p->offset_width < 1 ||
+    p->offset_width > 8 ||
+    p->slot_size < PAL_LINE_SIZE ||
+    p->keys_offset + (int64_t) p->bucket_slots * p->key_size > p->slot_size ||
+    p->offset_width + (int64_t) p->bucket_slots * p->key_size < 8 // See `pal_read_bucket_offset`.
   ) {
-    PAL_ERRNO = INVALID_DATA;
-    goto metadata_error;
+    return -1;
   }
-  int64_t offset = ftell(file) - 31;
+  p->index += PAL_LINE_SIZE;
+  return 0;
+}
 
-  // Gather all partitions.
-  r->partitions = calloc(r->max_key_size + 1, sizeof (struct pal_partition));
-  if (r->partitions == NULL) {
-    PAL_ERRNO = ALLOC_FAIL;
-    goto metadata_error;
+/**
+ * Read the optional membership filter section (see `filters.h`), located
+ * between the header's cursor and the start of the indices, advancing the
+ * cursor past its header. Filter offsets are relative to the same base as
+ * section offsets.
+ *
+ */
+static char read_filters(pal_reader_t *r, char **cursor, char *end, char *base) {
+  if (end - *cursor < 7 || memcmp(*cursor, "FILTERS", 7)) {
+    return 0; // No filters.
   }
-  while (num_non_empty_partitions--) {
-    struct pal_partition *partition = malloc(sizeof *partition);
-    int32_t key_size;
+  *cursor += 7;
+  int32_t num_filters;
+  if (read_int32(cursor, end, &num_filters) || num_filters < 0) {
+    return -1;
+  }
+  int32_t i;
+  for (i = 0; i < num_filters; i++) {
+    int32_t key_size, num_blocks, filter_offset;
     if (
-      partition == NULL ||
-      read_int32(file, &key_size) ||
-      key_size > r->max_key_size || // Sanity check.
-      read_int32(file, &partition->num_keys) ||
-      read_int32(file, &partition->num_slots) ||
-      read_int32(file, &partition->slot_size) ||
-      read_int32(file, &partition->index_offset) ||
-      read_int64(file, &partition->data_offset)
+      read_int32(cursor, end, &key_size) ||
+      read_int32(cursor, end, &num_blocks) ||
+      read_int32(cursor, end, &filter_offset) ||
+      key_size < 0 ||
+      key_size > r->max_key_size ||
+      r->partitions[key_size] == NULL ||
+      num_blocks <= 0 ||
+      filter_offset < 0 ||
+      filter_offset + (int64_t) num_blocks * PAL_FILTER_BLOCK_SIZE > end - base
     ) {
-      PAL_ERRNO = partition == NULL ? ALLOC_FAIL : INVALID_DATA;
-      goto partition_error;
+      return -1;
     }
-    r->partitions[key_size] = partition;
-    partition->index_size = partition->slot_size * partition->num_slots;
-    partition->index = NULL;
-    partition->data = NULL;
+    r->partitions[key_size]->filter = base + filter_offset;
+    r->partitions[key_size]->filter_blocks = num_blocks;
   }
+  return 0;
+}
 
-  // Build metadata (overloading serializers), index, and data.
-  int fd = fileno(file);
-  int64_t size = fsize(fd);
-  int32_t metadata_offset = ftell(file);
-  int32_t index_offset;
-  int64_t data_offset;
-  if (
-    size < 0 ||
-    metadata_offset < 0 ||
-    read_int32(file, &r->metadata_size) ||
-    fseek(file, r->metadata_size, SEEK_CUR) || // Skip metadata.
-    read_int32(file, &index_offset) ||
-    read_int64(file, &data_offset)
-  ) {
-    PAL_ERRNO = size < 0 ? STAT_FAIL : INVALID_DATA;
-    goto partition_error;
+/**
+ * Read the optional key directory's header, which follows the filters'.
+ *
+ * Entries are only validated when used (see `directory_entry`), opening a
+ * store doesn't touch them.
+ *
+ */
+static char read_directory(pal_reader_t *r, char *cursor, char *end, char *base) {
+  if (end - cursor < 7 || memcmp(cursor, "ORDERED", 7)) {
+    return 0; // No directory.
   }
-  r->index_size = data_offset - index_offset;
-  r->data_size = size - data_offset;
-  r->metadata = unaligned_mmap(r->metadata_size, fd, metadata_offset + 4);
-  r->index = unaligned_mmap(r->index_size, fd, offset + index_offset);
-  r->data = unaligned_mmap(r->data_size, fd, offset + data_offset);
+  cursor += 7;
+  int32_t directory_offset;
   if (
-    r->metadata == MAP_FAILED ||
-    r->index == MAP_FAILED ||
-    r->data == MAP_FAILED
+    read_int32(&cursor, end, &r->directory_size) ||
+    read_int32(&cursor, end, &directory_offset) ||
+    r->directory_size < 0 ||
+    directory_offset < 0 ||
+    directory_offset + 8 * (int64_t) r->directory_size > end - base
   ) {
-    PAL_ERRNO = MMAP_FAIL;
-    goto mmap_error;
+    return -1;
   }
+  r->directory = base + directory_offset;
+  return 0;
+}
 
-  // Populate partition index and data (saving lookups later).
-  int i;
-  for (i = 0; i <= r->max_key_size; i++) {
-    struct pal_partition *partition = r->partitions[i];
-    if (partition != NULL) {
-      partition->index = r->index + partition->index_offset;
-      partition->data = r->data + partition->data_offset;
+/**
+ * Compute a partition's layout statistics.
+ *
+ * Displacements are counted in slots for linear probing indices, and in
+ * buckets for bucketized ones (i.e. 0 for keys in their home bucket, 1 for
+ * those in their alternate bucket).
+ *
+ */
+static void partition_statistics(struct pal_partition *p, pal_partition_statistics_t *s) {
+  int32_t num_buckets = p->bucket_slots ? p->num_slots : 1;
+  int32_t bucket_slots = p->bucket_slots ? p->bucket_slots : p->num_slots;
+  int64_t total_displacement = 0;
+  int32_t num_occupied = 0;
+  int32_t i, j;
+
+  s->key_size = p->key_size;
+  s->num_keys = p->num_keys;
+  s->num_slots = num_buckets * bucket_slots;
+  s->slot_size = p->bucket_slots ?
+    1 + p->offset_width + p->key_size :
+    p->slot_size;
+  s->load_factor = (double) p->num_keys / s->num_slots;
+  s->filter_size = p->filter_blocks * PAL_FILTER_BLOCK_SIZE;
+  s->max_displacement = 0;
+  for (i = 0; i < num_buckets; i++) {
+    char *bucket = p->index + (int64_t) i * p->slot_size;
+    for (j = 0; j < bucket_slots; j++) {
+      char *key;
+      int32_t displacement;
+      if (p->bucket_slots) {
+        if (!bucket[j]) {
+          continue; // Empty slot.
+        }
+        key = bucket + p->keys_offset + j * p->key_size;
+        displacement = pal_hash(key, p->key_size) % p->num_slots != i;
+      } else {
+        key = p->index + (int64_t) j * p->slot_size;
+        if (!key[p->key_size]) {
+          continue; // Empty slot.
+        }
+        int32_t home = pal_hash(key, p->key_size) % p->num_slots;
+        displacement = j >= home ? j - home : j - home + p->num_slots;
+      }
+      if (displacement > s->max_displacement) {
+        s->max_displacement = displacement;
+      }
+      total_displacement += displacement;
+      num_occupied++;
     }
   }
+  s->mean_displacement = num_occupied ?
+    (double) total_displacement / num_occupied :
+    0;
+}
 
-  fclose(file);
-  return r;
-
-mmap_error:
-  munmap_reader(r);
-partition_error:
-  free_reader_partitions(r);
-  free(r->partitions);
-metadata_error:
-  free(r);
-reader_error:
-  fclose(file);
-file_error:
+/**
+ * Move an iterator to the next occupied slot of a partition, stopping at the
+ * given index offset.
+ *
+ * Returns the slot's key (and sets its data offset), NULL if there are none
+ * left.
+ *
+ */
+static char *advance(struct pal_iterator *iter, struct pal_partition *p, int32_t end_index_offset, int64_t *data_offset) {
+  while (iter->index_offset < end_index_offset) {
+    char *slot = p->index + iter->index_offset;
+    if (p->bucket_slots) {
+      int32_t i = iter->bucket_slot++;
+      if (iter->bucket_slot == p->bucket_slots) {
+        iter->bucket_slot = 0;
+        iter->index_offset += p->slot_size;
+      }
+      if (slot[i]) {
+        *data_offset = pal_read_offset(
+          slot + p->bucket_slots + i * p->offset_width,
+          p->offset_width
+        );
+        return slot + p->keys_offset + i * p->key_size;
+      }
+    } else {
+      iter->index_offset += p->slot_size;
+      unpack_int64(slot + p->key_size, data_offset);
+      if (*data_offset) {
+        return slot;
+      }
+    }
+  }
   return NULL;
 }
 
-void pal_statistics(pal_reader_t *reader, pal_statistics_t *stats) {
-  stats->timestamp = reader->timestamp;
-  stats->num_values = reader->num_values;
-  stats->index_size = reader->index_size;
-  stats->data_size = reader->data_size;
+/**
+ * Resolve a key directory entry to its key and data offset.
+ *
+ * Returns the key's partition, NULL if the entry doesn't reference an
+ * occupied slot.
+ *
+ */
+static struct pal_partition *directory_entry(pal_reader_t *r, int32_t entry, char **key, int64_t *data_offset) {
+  char *cursor = r->directory + 8 * (int64_t) entry;
+  char *end = cursor + 8;
+  int32_t key_size, key_offset;
+  read_int32(&cursor, end, &key_size);
+  read_int32(&cursor, end, &key_offset);
+  if (
+    key_size <= 0 ||
+    key_size > r->max_key_size ||
+    r->partitions[key_size] == NULL
+  ) {
+    return NULL;
+  }
+  struct pal_partition *p = r->partitions[key_size];
+  int64_t offset = key_offset - (p->index - r->index); // Within the partition.
+  if (offset < 0 || offset >= p->index_size) {
+    return NULL;
+  }
+  char *slot = p->index + offset - offset % p->slot_size;
+  offset %= p->slot_size;
+  if (p->bucket_slots) {
+    offset -= p->keys_offset;
+    int32_t i = offset / key_size;
+    if (offset < 0 || offset % key_size || i >= p->bucket_slots || !slot[i]) {
+      return NULL;
+    }
+    *data_offset = pal_read_offset(
+      slot + p->bucket_slots + i * p->offset_width,
+      p->offset_width
+    );
+    *key = slot + p->keys_offset + i * key_size;
+  } else {
+    if (offset) {
+      return NULL;
+    }
+    unpack_int64(slot + key_size, data_offset);
+    if (!*data_offset) {
+      return NULL;
+    }
+    *key = slot;
+  }
+  return p;
 }
 
-void pal_metadata(pal_reader_t *reader, char **metadata, int32_t *metadata_len) {
-  *metadata = reader->metadata;
-  *metadata_len = reader->metadata_size;
+/**
+ * Compare two byte strings, shorter ones first when one is a prefix of the
+ * other (the key directory's order).
+ *
+ */
+static int compare_bytes(const char *a, int32_t a_len, const char *b, int32_t b_len) {
+  int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  return cmp ? cmp : (a_len > b_len) - (a_len < b_len);
 }
 
-char pal_get(pal_reader_t *reader, char *key, int32_t key_len, char **value, int64_t *value_len) {
-  if (key_len > reader->max_key_size) {
-    return 0;
-  }
-
-  struct pal_partition *p = reader->partitions[key_len];
-  if (p == NULL) {
-    return 0;
+/**
+ * Binary search the key directory for the first key greater or equal to a
+ * target or, if `after_prefix` is set, the first greater one not starting with
+ * it.
+ *
+ * Returns -1 if an invalid entry was found.
+ *
+ */
+static int32_t search_directory(pal_reader_t *r, const char *target, int32_t target_len, char after_prefix) {
+  if (!target_len) {
+    return after_prefix ? r->directory_size : 0; // Every key starts with it.
   }
-
-  int32_t hash;
-  MurmurHash3_x86_32(key, key_len, 42, &hash);
-  int32_t index_offset = p->slot_size * ((hash & 0x7fffffff) % p->num_slots);
-
-  int32_t attempts = p->num_slots;
-  while (attempts--) {
-    // Single step linear probing.
-    char *slot = p->index + index_offset;
+  int32_t lo = 0;
+  int32_t hi = r->directory_size;
+  while (lo < hi) {
+    int32_t mid = lo + (hi - lo) / 2;
+    char *key;
     int64_t data_offset;
-    unpack_int64(slot + key_len, &data_offset);
-    if (!data_offset) {
-      // Offset 0 is reserved, the key is missing.
-      return 0;
+    struct pal_partition *p = directory_entry(r, mid, &key, &data_offset);
+    if (p == NULL) {
+      return -1;
     }
-    if (!memcmp(slot, key, key_len)) {
-      // Found a matching key.
-      *value = unpack_int64(p->data + data_offset, value_len);
-      return 1;
+    int32_t key_len = p->key_size;
+    if (after_prefix && key_len > target_len) {
+      key_len = target_len;
     }
-    index_offset += p->slot_size;
-    if (index_offset == p->index_size) {
-      index_offset = 0;
+    int cmp = compare_bytes(key, key_len, target, target_len);
+    if (cmp < 0 || (after_prefix && !cmp)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
     }
   }
-  return 0;
+  return lo;
 }
 
-void pal_iterator_reset(pal_iterator_t *iterator, pal_reader_t *reader) {
-  struct pal_iterator *iter = (struct pal_iterator *) iterator;
-  iter->reader = reader;
-  iter->key_size = 0;
-  iter->num_keys = 0;
+/**
+ * Read a byte every `WARM_STRIDE`, faulting in a region of the mapping.
+ *
+ */
+static void touch_pages(const char *addr, int64_t size) {
+  volatile char sink;
+  int64_t offset;
+  for (offset = 0; offset < size; offset += WARM_STRIDE) {
+    sink = addr[offset];
+  }
+  (void) sink;
+}
+
+// Compressed data (see `lz4.h` and the writer's `flush_block`).
+
+/**
+ * Same as `unpack_int64`, without reading past `end` (decompressed blocks
+ * aren't part of the mapping, so their contents are checked).
+ *
+ * Returns the next address, NULL if the integer is truncated.
+ *
+ */
+static char *unpack_int64_bounded(char *addr, char *end, int64_t *dst) {
+  *dst = 0;
+  int k = 0;
+  char b;
+  do {
+    if (addr == end || k > 63) {
+      return NULL;
+    }
+    b = *addr++;
+    *dst |= (int64_t) (b & 0x7f) << k;
+    k += 7;
+  } while (b & 0x80);
+  return addr;
+}
+
+/**
+ * Read a compressed partition's block table (see `pal_init`).
+ *
+ */
+static char read_blocks_table(struct pal_partition *p) {
+  char *cursor = p->data;
+  if (
+    read_int32(&cursor, p->data + p->data_size, &p->num_blocks) ||
+    p->num_blocks < 0 ||
+    8 * ((int64_t) p->num_blocks + 1) > p->data + p->data_size - cursor
+  ) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Offset of a block within its partition's data (the table has one more
+ * entry than there are blocks, holding the last block's end).
+ *
+ */
+static int64_t block_offset(struct pal_partition *p, int32_t index) {
+  char *cursor = p->data + 4 + 8 * (int64_t) index;
+  int64_t offset;
+  read_int64(&cursor, cursor + 8, &offset);
+  return offset;
+}
+
+static void free_block(struct pal_cached_block *block) {
+  free(block->data);
+  free(block);
+}
+
+/**
+ * Decompress one of a partition's blocks.
+ *
+ * Returns NULL if the block is invalid or memory allocation failed (see
+ * PAL_ERRNO).
+ *
+ */
+static struct pal_cached_block *load_block(struct pal_partition *p, int64_t index) {
+  if (index >= p->num_blocks) {
+    PAL_ERRNO = INVALID_DATA;
+    return NULL;
+  }
+  int64_t start = block_offset(p, index);
+  int64_t end = block_offset(p, index + 1);
+  if (start < 4 + 8 * ((int64_t) p->num_blocks + 1) || start >= end || end > p->data_size) {
+    PAL_ERRNO = INVALID_DATA;
+    return NULL;
+  }
+  char *block_end = p->data + end;
+  char codec = p->data[start];
+  int64_t size;
+  char *payload = unpack_int64_bounded(p->data + start + 1, block_end, &size);
+  if (payload == NULL || size < 0 || size > INT32_MAX || (codec != 0 && codec != 1)) {
+    PAL_ERRNO = INVALID_DATA;
+    return NULL;
+  }
+
+  struct pal_cached_block *block = malloc(sizeof *block);
+  char *data = malloc(size + 1); // Avoid zero-sized allocations.
+  if (block == NULL || data == NULL) {
+    PAL_ERRNO = ALLOC_FAIL;
+    goto error;
+  }
+  if (
+    codec ?
+      pal_lz4_decompress(payload, block_end - payload, data, size) != size :
+      block_end - payload != size
+  ) {
+    PAL_ERRNO = INVALID_DATA;
+    goto error;
+  }
+  if (!codec) {
+    memcpy(data, payload, size);
+  }
+  block->partition = p;
+  block->index = index;
+  block->size = size;
+  block->data = data;
+  return block;
+
+error:
+  free(block);
+  free(data);
+  return NULL;
+}
+
+/**
+ * Link to a cached block in its shard's hash chain, pointing to NULL if the
+ * block isn't cached.
+ *
+ */
+static struct pal_cached_block **find_block(struct pal_cache_shard *shard, uint32_t bucket, struct pal_partition *p, int32_t index) {
+  struct pal_cached_block **link = shard->buckets + bucket;
+  while (*link != NULL && ((*link)->partition != p || (*link)->index != index)) {
+    link = &(*link)->next;
+  }
+  return link;
+}
+
+/**
+ * Mark a block as the shard's most recently used.
+ *
+ */
+static void touch_block(struct pal_cache_shard *shard, struct pal_cached_block *block) {
+  if (block->newer != NULL) {
+    block->newer->older = block->older;
+    block->older->newer = block->newer;
+  }
+  block->older = shard->lru.older;
+  block->newer = &shard->lru;
+  shard->lru.older->newer = block;
+  shard->lru.older = block;
+}
+
+/**
+ * Evict least recently used blocks until the shard fits within its capacity.
+ *
+ */
+static void evict_blocks(struct pal_cache_shard *shard, int64_t capacity) {
+  while (shard->size > capacity && shard->lru.newer != &shard->lru) {
+    struct pal_cached_block *block = shard->lru.newer;
+    shard->lru.newer = block->newer;
+    block->newer->older = &shard->lru;
+    *find_block(shard, block->bucket, block->partition, block->index) = block->next;
+    shard->size -= block->size;
+    free_block(block);
+  }
+}
+
+/**
+ * Copy a value from a decompressed block into a buffer (if it fits).
+ *
+ * Returns the value's length, -2 if the offset is invalid.
+ *
+ */
+static int64_t copy_value(struct pal_cached_block *block, int32_t offset, char *buf, int64_t buf_len) {
+  char *end = block->data + block->size;
+  int64_t len;
+  char *value = offset < block->size ?
+    unpack_int64_bounded(block->data + offset, end, &len) :
+    NULL;
+  if (value == NULL || len < 0 || len > end - value) {
+    PAL_ERRNO = INVALID_DATA;
+    return -2;
+  }
+  if (len && len <= buf_len) {
+    memcpy(buf, value, len);
+  }
+  return len;
+}
+
+/**
+ * Copy a value from compressed data, through the block cache.
+ *
+ * Data offsets hold the value's block index in their upper bits and its
+ * offset within the block in the lower 16. Blocks are decompressed outside of
+ * their shard's lock, so that other lookups in the shard aren't held up (if
+ * two threads race to load the same block, one copy is discarded).
+ *
+ * Returns the value's length, -2 on error (see PAL_ERRNO).
+ *
+ */
+static int64_t read_compressed(pal_reader_t *reader, struct pal_partition *p, int64_t data_offset, char *buf, int64_t buf_len) {
+  int64_t index = data_offset >> 16;
+  int32_t offset = data_offset & 0xffff;
+  uint32_t mix = pal_remix((int32_t) index ^ (p->key_size << 24));
+  struct pal_cache_shard *shard = reader->cache + mix % CACHE_SHARDS;
+  uint32_t bucket = (mix / CACHE_SHARDS) % CACHE_BUCKETS;
+
+  pthread_mutex_lock(&shard->lock);
+  struct pal_cached_block *block = index < p->num_blocks ?
+    *find_block(shard, bucket, p, index) :
+    NULL;
+  if (block == NULL) {
+    pthread_mutex_unlock(&shard->lock);
+    struct pal_cached_block *loaded = load_block(p, index);
+    if (loaded == NULL) {
+      return -2;
+    }
+    pthread_mutex_lock(&shard->lock);
+    struct pal_cached_block **link = find_block(shard, bucket, p, index);
+    if (*link == NULL) {
+      loaded->bucket = bucket;
+      loaded->next = NULL;
+      loaded->newer = NULL;
+      *link = loaded;
+      shard->size += loaded->size;
+      block = loaded;
+    } else {
+      free_block(loaded); // Loaded concurrently.
+      block = *link;
+    }
+    if (reader->metrics_enabled) {
+      reader->metrics.num_block_misses++;
+    }
+  } else if (reader->metrics_enabled) {
+    reader->metrics.num_block_hits++;
+  }
+  touch_block(shard, block);
+  int64_t len = copy_value(block, offset, buf, buf_len);
+  evict_blocks(shard, reader->cache_size);
+  pthread_mutex_unlock(&shard->lock);
+  return len;
+}
+
+/**
+ * Value an iterator is positioned on, copied to the iterator's buffer for
+ * compressed data.
+ *
+ * Returns NULL on error.
+ *
+ */
+static char *iterator_value(struct pal_iterator *iter, struct pal_partition *p, int64_t data_offset, int64_t *value_len) {
+  if (!iter->reader->compressed) {
+    return unpack_int64(p->data + data_offset, value_len);
+  }
+  *value_len = read_compressed(iter->reader, p, data_offset, iter->value, iter->value_capacity);
+  if (*value_len >= iter->value_capacity) { // Never NULL, even when empty.
+    char *value = realloc(iter->value, *value_len + 1);
+    if (value == NULL) {
+      PAL_ERRNO = ALLOC_FAIL;
+      return NULL;
+    }
+    iter->value = value;
+    iter->value_capacity = *value_len + 1;
+    *value_len = read_compressed(iter->reader, p, data_offset, iter->value, iter->value_capacity);
+  }
+  return *value_len < 0 ? NULL : iter->value;
+}
+
+// Sequential iteration.
+
+static int compare_data_offsets(const void *a, const void *b) {
+  int64_t o1 = ((const struct pal_sequential_entry *) a)->data_offset;
+  int64_t o2 = ((const struct pal_sequential_entry *) b)->data_offset;
+  return (o1 > o2) - (o1 < o2);
+}
+
+/**
+ * Gather a (non-empty) partition's entries into a sequential iterator, sorted
+ * by data offset (i.e. by block for compressed data).
+ *
+ * Returns -1 on error (see PAL_ERRNO).
+ *
+ */
+static char sort_entries(struct pal_iterator *iter, struct pal_partition *p) {
+  struct pal_sequential_entry *entries = realloc(
+    iter->entries,
+    (size_t) p->num_keys * sizeof *entries
+  );
+  if (entries == NULL) {
+    PAL_ERRNO = ALLOC_FAIL;
+    return -1;
+  }
+  iter->entries = entries;
+  iter->bucket_slot = 0;
   iter->index_offset = 0;
+  int32_t i;
+  for (i = 0; i < p->num_keys; i++) {
+    entries[i].key = advance(iter, p, p->index_size, &entries[i].data_offset);
+    if (entries[i].key == NULL) {
+      PAL_ERRNO = INVALID_DATA;
+      return -1;
+    }
+  }
+  qsort(entries, p->num_keys, sizeof *entries, compare_data_offsets);
+  iter->readahead = 0;
+  return 0;
 }
 
-char pal_iterator_next(pal_iterator_t *iterator, char **key, int32_t *key_len, char **value, int64_t *value_len) {
-  struct pal_iterator *iter = (struct pal_iterator *) iterator;
+/**
+ * Hint the kernel to read a partition's data ahead of a sequential iterator.
+ *
+ * The hinted window slides along with the iterator (`POSIX_MADV_WILLNEED`
+ * rather than `POSIX_MADV_SEQUENTIAL`, which would change readahead for the
+ * whole mapping, including concurrent lookups).
+ *
+ */
+static void read_ahead(struct pal_iterator *iter, struct pal_partition *p, int64_t data_offset) {
+  int64_t offset = data_offset;
+  if (iter->reader->compressed) {
+    int64_t index = data_offset >> 16;
+    if (index >= p->num_blocks) {
+      return; // Reported when the value is read.
+    }
+    offset = block_offset(p, index);
+  }
+  if (offset < 0 || offset + READAHEAD_SIZE / 2 < iter->readahead) {
+    return; // Still well within the hinted window.
+  }
+  int64_t start = offset > iter->readahead ? offset : iter->readahead;
+  int64_t end = offset + READAHEAD_SIZE;
+  if (end > p->data_size) {
+    end = p->data_size;
+  }
+  if (start >= end) {
+    return;
+  }
+  iter->readahead = end;
+  char *addr = p->data + start;
+  int64_t misalignment = (uintptr_t) addr % sysconf(_SC_PAGESIZE);
+  posix_madvise(addr - misalignment, end - start + misalignment, POSIX_MADV_WILLNEED);
+}
+
+/**
+ * Move an iterator to its next entry, without reading its value.
+ *
+ * Returns 1 and sets the entry's partition, key, and data offset, 0 if there
+ * are none left, -1 on error (see PAL_ERRNO).
+ *
+ */
+static int next_slot(struct pal_iterator *iter, struct pal_partition **entry_partition, char **key, int64_t *data_offset) {
   pal_reader_t *reader = iter->reader;
   struct pal_partition *partition = NULL;
+
+  if (iter->end_entry >= 0) {
+    // Ordered iterator, following the key directory.
+    if (iter->entry >= iter->end_entry) {
+      return 0;
+    }
+    partition = directory_entry(reader, iter->entry++, key, data_offset);
+    if (partition == NULL) {
+      PAL_ERRNO = INVALID_DATA;
+      return -1;
+    }
+    *entry_partition = partition;
+    return 1;
+  }
+
+  if (iter->end_index_offset >= 0) {
+    // Range iterator, confined to a single partition.
+    partition = reader->partitions[iter->key_size];
+    *key = advance(iter, partition, iter->end_index_offset, data_offset);
+    if (*key == NULL) {
+      return 0;
+    }
+    *entry_partition = partition;
+    return 1;
+  }
+
   while (
     iter->key_size <= reader->max_key_size &&
     (
@@ -407,29 +1120,741 @@ char pal_iterator_next(pal_iterator_t *iterator, char **key, int32_t *key_len, c
     return 0;
   }
 
-  char *slot;
-  int64_t data_offset;
-  do {
-    slot = partition->index + iter->index_offset;
-    iter->index_offset += partition->slot_size;
-    unpack_int64(slot + iter->key_size, &data_offset);
-  } while (!data_offset);
-
-  *key = slot;
-  *key_len = iter->key_size;
-  *value = unpack_int64(partition->data + data_offset, value_len);
-
+  if (iter->sequential) {
+    // Entries in data order, sorted when entering each partition.
+    if (!iter->num_keys && sort_entries(iter, partition)) {
+      return -1;
+    }
+    struct pal_sequential_entry *entry = iter->entries + iter->num_keys;
+    *key = entry->key;
+    *data_offset = entry->data_offset;
+    read_ahead(iter, partition, entry->data_offset);
+  } else {
+    *key = advance(iter, partition, partition->index_size, data_offset);
+    if (*key == NULL) {
+      // Fewer keys than the partition's header claims.
+      PAL_ERRNO = INVALID_DATA;
+      return -1;
+    }
+  }
   if (++iter->num_keys == partition->num_keys) {
     iter->key_size++;
     iter->num_keys = 0;
+    iter->bucket_slot = 0;
     iter->index_offset = 0;
   }
+  *entry_partition = partition;
   return 1;
 }
 
+
+/**
+ * Format of a file is:
+ *
+ * n_bytes  description
+ *
+ * varies   Leading data, ignored.
+ * varies   Version utf-8 encoded with short length prefix (found by searching
+ *          for `VERSION`).
+ * 8        Creation timestamp.
+ * 4        Key count.
+ * 4        Key lengths count (i.e. number of partitions).
+ * 4        Maximum key length.
+ * // Repeated for each partition:
+ * 4        Partition key length.
+ * 4        Partition key count.
+ * 4        Partition slot count (i.e. bucket count).
+ * 4        Partition slot size (i.e. key size + maximum packed offset length).
+ * 4        Partition index offset.
+ * 8        Partition data offset.
+ * // End of partition repeat.
+ * 4        Length of serializer bytes.
+ * varies   Serializers. (Used as metadata here.)
+ * 4        Index offset.
+ * 8        Data offset.
+ * // Optional, only if followed by the `FILTERS` mark before the index:
+ * 7        `FILTERS` mark.
+ * 4        Filter count.
+ * // Repeated for each filter:
+ * 4        Partition key length.
+ * 4        Filter block count.
+ * 4        Filter offset.
+ * // End of filter repeat.
+ * // End of optional filters header.
+ * // Optional, only if followed by the `ORDERED` mark before the index:
+ * 7        `ORDERED` mark.
+ * 4        Key count.
+ * 4        Directory offset.
+ * // End of optional directory header.
+ * varies   Filter blocks, if any.
+ * // Repeated for each key of the directory, if any, in byte order (see
+ * // `pal_iterator_reset_prefix`):
+ * 4        Key length.
+ * 4        Offset of the key within the indices.
+ * // End of key repeat.
+ *
+ * `VERSION_2` files share this layout, but their partitions' indices are
+ * bucketized (see `buckets.h`), in which case slot counts and sizes are those
+ * of buckets.
+ *
+ * `VERSION_3` (linear probing) and `VERSION_4` (bucketized) files compress
+ * their data in blocks. Each partition's data then starts with a table of its
+ * blocks:
+ *
+ * 4        Block count.
+ * 8        Offset of each block, relative to the start of the table, followed
+ *          by the offset of the end of the last block.
+ * // Repeated for each block:
+ * 1        Codec (0 for raw, 1 for LZ4, see `lz4.h`).
+ * varies   Packed decompressed size.
+ * varies   Payload.
+ * // End of block repeat.
+ *
+ * Their index offsets hold a block index in their upper bits and an offset
+ * within the decompressed block in their lower 16 bits (values start within
+ * a block's first 64 KiB but can extend past it).
+ *
+ */
+pal_reader_t *pal_init(const char *path) {
+  // Map the entire file once, everything else is parsed from memory.
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    PAL_ERRNO = NO_FILE;
+    goto file_error;
+  }
+  int64_t size = fsize(fd);
+  if (size <= 0) {
+    PAL_ERRNO = size < 0 ? STAT_FAIL : INVALID_DATA;
+    close(fd);
+    goto file_error;
+  }
+  char *addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd); // The mapping doesn't need it.
+  if (addr == MAP_FAILED) {
+    PAL_ERRNO = MMAP_FAIL;
+    goto file_error;
+  }
+  char *end = addr + size;
+
+  pal_reader_t *r = calloc(1, sizeof *r);
+  if (r == NULL) {
+    PAL_ERRNO = ALLOC_FAIL;
+    goto reader_error;
+  }
+  r->addr = addr;
+  r->size = size;
+
+  // Find byte mark and load metadata.
+  char *cursor = find_version(addr, end, &r->version);
+  int32_t num_non_empty_partitions;
+  if (
+    cursor == NULL ||
+    read_int64(&cursor, end, &r->timestamp) ||
+    read_int32(&cursor, end, &r->num_values) ||
+    read_int32(&cursor, end, &num_non_empty_partitions) ||
+    read_int32(&cursor, end, &r->max_key_size) ||
+    r->max_key_size < -1 ||
+    num_non_empty_partitions < 0 ||
+    num_non_empty_partitions > r->max_key_size + 1
+  ) {
+    PAL_ERRNO = INVALID_DATA;
+    goto metadata_error;
+  }
+  // Section offsets are relative to the version's length prefix.
+  int64_t offset = (cursor - addr) - 31;
+
+  // Gather all partitions (allocated in a single block).
+  r->partitions = calloc(r->max_key_size + 2, sizeof *r->partitions);
+  r->partition_block = calloc(num_non_empty_partitions + 1, sizeof *r->partition_block);
+  if (r->partitions == NULL || r->partition_block == NULL) {
+    PAL_ERRNO = ALLOC_FAIL;
+    goto partition_error;
+  }
+  int32_t i;
+  for (i = 0; i < num_non_empty_partitions; i++) {
+    struct pal_partition *partition = r->partition_block + i;
+    int32_t key_size;
+    if (
+      read_int32(&cursor, end, &key_size) ||
+      key_size < 0 ||
+      key_size > r->max_key_size || // Sanity checks.
+      r->partitions[key_size] != NULL ||
+      read_int32(&cursor, end, &partition->num_keys) ||
+      read_int32(&cursor, end, &partition->num_slots) ||
+      read_int32(&cursor, end, &partition->slot_size) ||
+      read_int32(&cursor, end, &partition->index_offset) ||
+      read_int64(&cursor, end, &partition->data_offset)
+    ) {
+      PAL_ERRNO = INVALID_DATA;
+      goto partition_error;
+    }
+    r->partitions[key_size] = partition;
+    partition->key_size = key_size;
+    partition->index_size = partition->slot_size * partition->num_slots;
+    partition->metrics = &r->metrics;
+  }
+
+  // Metadata (overloading serializers), index, and data.
+  int32_t index_offset;
+  int64_t data_offset;
+  if (
+    read_int32(&cursor, end, &r->metadata_size) ||
+    r->metadata_size < 0 ||
+    end - cursor < r->metadata_size
+  ) {
+    PAL_ERRNO = INVALID_DATA;
+    goto partition_error;
+  }
+  r->metadata = cursor;
+  cursor += r->metadata_size;
+  if (
+    read_int32(&cursor, end, &index_offset) ||
+    read_int64(&cursor, end, &data_offset) ||
+    offset + index_offset < cursor - addr ||
+    index_offset > data_offset ||
+    offset + data_offset > size
+  ) {
+    PAL_ERRNO = INVALID_DATA;
+    goto partition_error;
+  }
+  if (
+    read_filters(r, &cursor, addr + offset + index_offset, addr + offset) ||
+    read_directory(r, cursor, addr + offset + index_offset, addr + offset)
+  ) {
+    PAL_ERRNO = INVALID_DATA;
+    goto partition_error;
+  }
+  r->index = addr + offset + index_offset;
+  r->data = addr + offset + data_offset;
+  r->index_size = data_offset - index_offset;
+  r->data_size = end - r->data;
+  r->compressed = r->version > 2;
+
+  // Populate partition index and data (saving lookups later).
+  int32_t layout_size = r->version % 2 ? 0 : PAL_LINE_SIZE;
+  for (i = 0; i < num_non_empty_partitions; i++) {
+    struct pal_partition *partition = r->partition_block + i;
+    if (
+      partition->num_slots <= 0 ||
+      partition->index_offset < 0 ||
+      partition->index_offset + layout_size + (int64_t) partition->index_size > r->index_size ||
+      partition->data_offset < 0 ||
+      partition->data_offset > r->data_size
+    ) {
+      PAL_ERRNO = INVALID_DATA;
+      goto partition_error;
+    }
+    partition->index = r->index + partition->index_offset;
+    partition->data = r->data + partition->data_offset;
+    partition->data_size = r->data_size - partition->data_offset;
+    if (
+      (layout_size && read_layout(partition)) ||
+      (r->compressed && read_blocks_table(partition))
+    ) {
+      PAL_ERRNO = INVALID_DATA;
+      goto partition_error;
+    }
+    partition->probe = select_probe(partition, 0);
+  }
+
+  if (r->compressed) {
+    r->cache = calloc(CACHE_SHARDS, sizeof *r->cache);
+    if (r->cache == NULL) {
+      PAL_ERRNO = ALLOC_FAIL;
+      goto partition_error;
+    }
+    for (i = 0; i < CACHE_SHARDS; i++) {
+      struct pal_cache_shard *shard = r->cache + i;
+      pthread_mutex_init(&shard->lock, NULL);
+      shard->lru.newer = shard->lru.older = &shard->lru;
+    }
+    r->cache_size = DEFAULT_CACHE_SIZE / CACHE_SHARDS;
+  }
+
+  return r;
+
+partition_error:
+  free(r->partition_block);
+  free(r->partitions);
+metadata_error:
+  free(r);
+reader_error:
+  munmap(addr, size);
+file_error:
+  return NULL;
+}
+
+void pal_statistics(pal_reader_t *reader, pal_statistics_t *stats) {
+  stats->timestamp = reader->timestamp;
+  stats->num_keys = 0;
+  int i;
+  for (i = 0; i <= reader->max_key_size; i++) {
+    struct pal_partition *partition = reader->partitions[i];
+    if (partition != NULL) {
+      stats->num_keys += partition->num_keys;
+    }
+  }
+  stats->num_values = reader->num_values;
+  stats->index_size = reader->index_size;
+  stats->data_size = reader->data_size;
+}
+
+int32_t pal_partition_statistics(pal_reader_t *reader, int32_t n, pal_partition_statistics_t *stats) {
+  int32_t num_partitions = 0;
+  int32_t i;
+  for (i = 0; i <= reader->max_key_size; i++) {
+    struct pal_partition *partition = reader->partitions[i];
+    if (partition == NULL) {
+      continue;
+    }
+    if (stats != NULL && num_partitions < n) {
+      partition_statistics(partition, stats + num_partitions);
+    }
+    num_partitions++;
+  }
+  return num_partitions;
+}
+
+void pal_enable_metrics(pal_reader_t *reader, char enabled) {
+  reader->metrics_enabled = enabled;
+  int32_t i;
+  for (i = 0; i <= reader->max_key_size; i++) {
+    struct pal_partition *partition = reader->partitions[i];
+    if (partition != NULL) {
+      partition->probe = select_probe(partition, enabled);
+    }
+  }
+}
+
+void pal_metrics(pal_reader_t *reader, pal_metrics_t *metrics) {
+  *metrics = reader->metrics;
+}
+
+void pal_metadata(pal_reader_t *reader, char **metadata, int32_t *metadata_len) {
+  *metadata = reader->metadata;
+  *metadata_len = reader->metadata_size;
+}
+
+void pal_warm(pal_reader_t *reader) {
+  touch_pages(reader->index, reader->index_size);
+  int32_t i;
+  for (i = 0; i <= reader->max_key_size; i++) {
+    struct pal_partition *p = reader->partitions[i];
+    if (p == NULL) {
+      continue;
+    }
+    if (p->filter != NULL) {
+      touch_pages(p->filter, (int64_t) p->filter_blocks * PAL_FILTER_BLOCK_SIZE);
+    }
+    if (p->num_blocks) {
+      touch_pages(p->data, 4 + 8 * ((int64_t) p->num_blocks + 1));
+    }
+  }
+}
+
+int32_t pal_hash(char *key, int32_t key_len) {
+  int32_t hash;
+  MurmurHash3_x86_32(key, key_len, 42, &hash);
+  return hash & 0x7fffffff;
+}
+
+int32_t pal_shard(int32_t hash, int32_t num_shards) {
+  // Seeded, otherwise shards would match the upper bits used by bucketized
+  // indices' alternate buckets.
+  return ((uint64_t) pal_remix(hash ^ SHARD_SEED) * num_shards) >> 32;
+}
+
+int pal_get(pal_reader_t *reader, char *key, int32_t key_len, char **value, int64_t *value_len) {
+  struct pal_partition *p = get_partition(reader, key_len);
+  if (p == NULL && !reader->compressed) {
+    count_missing_partition(reader);
+    return 0;
+  }
+  return pal_get_hashed(reader, key, key_len, pal_hash(key, key_len), value, value_len);
+}
+
+int pal_get_hashed(pal_reader_t *reader, char *key, int32_t key_len, int32_t hash, char **value, int64_t *value_len) {
+  if (reader->compressed) {
+    PAL_ERRNO = COMPRESSED_STORE;
+    return -1;
+  }
+  struct pal_partition *p = get_partition(reader, key_len);
+  if (p == NULL) {
+    count_missing_partition(reader);
+    return 0;
+  }
+  if (!filter_contains(reader, p, hash)) {
+    return 0;
+  }
+
+  int64_t data_offset = probe(p, key, key_len, hash, home_offset(p, hash));
+  if (!data_offset) {
+    return 0;
+  }
+  *value = unpack_int64(p->data + data_offset, value_len);
+  return 1;
+}
+
+int64_t pal_read(pal_reader_t *reader, char *key, int32_t key_len, int32_t hash, char *buf, int64_t buf_len) {
+  struct pal_partition *p = get_partition(reader, key_len);
+  if (p == NULL) {
+    count_missing_partition(reader);
+    return -1;
+  }
+  if (!filter_contains(reader, p, hash)) {
+    return -1;
+  }
+
+  int64_t data_offset = probe(p, key, key_len, hash, home_offset(p, hash));
+  if (!data_offset) {
+    return -1;
+  }
+  if (reader->compressed) {
+    return read_compressed(reader, p, data_offset, buf, buf_len);
+  }
+  int64_t value_len;
+  char *value = unpack_int64(p->data + data_offset, &value_len);
+  if (value_len && value_len <= buf_len) {
+    memcpy(buf, value, value_len);
+  }
+  return value_len;
+}
+
+/**
+ * Lookups are processed in groups of `BATCH_WIDTH` keys, each group in four
+ * passes: hash every key and prefetch its filter block (or home slot if its
+ * partition has no filter), then check filters and prefetch the home slot of
+ * keys which pass, then probe each index and prefetch the matching value's
+ * header, and finally decode the headers. This lets the cache misses of
+ * different keys overlap rather than be paid one after the other, and keys
+ * rejected by a filter never touch the index.
+ *
+ */
+int32_t pal_get_batch(pal_reader_t *reader, int32_t n, char **keys, int32_t *key_lens, int32_t *hashes, char **values, int64_t *value_lens) {
+  struct pal_partition *partitions[BATCH_WIDTH];
+  int32_t key_hashes[BATCH_WIDTH];
+  int32_t index_offsets[BATCH_WIDTH];
+  int32_t num_found = 0;
+  int32_t i, j;
+  if (reader->compressed) {
+    for (i = 0; i < n; i++) {
+      values[i] = NULL;
+      value_lens[i] = -2;
+    }
+    PAL_ERRNO = COMPRESSED_STORE;
+    return -1;
+  }
+  for (i = 0; i < n; i += BATCH_WIDTH) {
+    int32_t width = n - i < BATCH_WIDTH ? n - i : BATCH_WIDTH;
+
+    for (j = 0; j < width; j++) {
+      struct pal_partition *p = get_partition(reader, key_lens[i + j]);
+      partitions[j] = p;
+      if (p != NULL) {
+        int32_t hash = hashes != NULL ?
+          hashes[i + j] :
+          pal_hash(keys[i + j], key_lens[i + j]);
+        key_hashes[j] = hash;
+        index_offsets[j] = home_offset(p, hash);
+        if (p->filter != NULL) {
+          PREFETCH(filter_block(p, hash));
+        } else {
+          PREFETCH(p->index + index_offsets[j]);
+        }
+      } else {
+        count_missing_partition(reader);
+      }
+    }
+
+    for (j = 0; j < width; j++) {
+      struct pal_partition *p = partitions[j];
+      if (p != NULL && p->filter != NULL) {
+        if (filter_contains(reader, p, key_hashes[j])) {
+          PREFETCH(p->index + index_offsets[j]);
+        } else {
+          partitions[j] = NULL;
+        }
+      }
+    }
+
+    for (j = 0; j < width; j++) {
+      struct pal_partition *p = partitions[j];
+      int64_t data_offset = 0;
+      if (p != NULL) {
+        data_offset = probe(
+          p,
+          keys[i + j],
+          key_lens[i + j],
+          key_hashes[j],
+          index_offsets[j]
+        );
+      }
+      if (data_offset) {
+        values[i + j] = p->data + data_offset;
+        PREFETCH(values[i + j]);
+      } else {
+        values[i + j] = NULL;
+      }
+    }
+
+    for (j = 0; j < width; j++) {
+      if (values[i + j] == NULL) {
+        value_lens[i + j] = -1;
+      } else {
+        values[i + j] = unpack_int64(values[i + j], value_lens + i + j);
+        num_found++;
+      }
+    }
+  }
+  return num_found;
+}
+
+void pal_iterator_reset(pal_iterator_t *iterator, pal_reader_t *reader) {
+  struct pal_iterator *iter = (struct pal_iterator *) iterator;
+  iter->reader = reader;
+  iter->key_size = 0;
+  iter->num_keys = 0;
+  iter->bucket_slot = 0;
+  iter->index_offset = 0;
+  iter->end_index_offset = -1;
+  iter->end_entry = -1;
+  iter->sequential = 0;
+  iter->value = NULL;
+  iter->value_capacity = 0;
+  iter->entries = NULL;
+  iter->readahead = 0;
+}
+
+void pal_iterator_reset_sequential(pal_iterator_t *iterator, pal_reader_t *reader) {
+  pal_iterator_reset(iterator, reader);
+  ((struct pal_iterator *) iterator)->sequential = 1;
+}
+
+int32_t pal_ranges(pal_reader_t *reader, int32_t n, pal_range_t *ranges) {
+  int64_t total_slots = 0;
+  int32_t i;
+  for (i = 0; i <= reader->max_key_size; i++) {
+    struct pal_partition *partition = reader->partitions[i];
+    if (partition != NULL && partition->num_keys) {
+      total_slots += partition->num_slots;
+    }
+  }
+  int64_t range_slots = n > 0 ? (total_slots + n - 1) / n : total_slots;
+  if (!range_slots) {
+    range_slots = 1;
+  }
+
+  int32_t num_ranges = 0;
+  for (i = 0; i <= reader->max_key_size; i++) {
+    struct pal_partition *partition = reader->partitions[i];
+    if (partition == NULL || !partition->num_keys) {
+      continue;
+    }
+    int64_t start_slot;
+    for (
+      start_slot = 0;
+      start_slot < partition->num_slots;
+      start_slot += range_slots
+    ) {
+      if (ranges != NULL) {
+        int64_t end_slot = start_slot + range_slots;
+        pal_range_t *range = ranges + num_ranges;
+        range->key_size = i;
+        range->start_slot = start_slot;
+        range->end_slot = end_slot < partition->num_slots ?
+          end_slot :
+          partition->num_slots;
+      }
+      num_ranges++;
+    }
+  }
+  return num_ranges;
+}
+
+int pal_iterator_reset_range(pal_iterator_t *iterator, pal_reader_t *reader, pal_range_t *range) {
+  struct pal_iterator *iter = (struct pal_iterator *) iterator;
+  if (
+    range->key_size < 0 ||
+    range->key_size > reader->max_key_size ||
+    reader->partitions[range->key_size] == NULL
+  ) {
+    return -1;
+  }
+  struct pal_partition *partition = reader->partitions[range->key_size];
+  if (
+    range->start_slot < 0 ||
+    range->start_slot > range->end_slot ||
+    range->end_slot > partition->num_slots
+  ) {
+    return -1;
+  }
+  iter->reader = reader;
+  iter->key_size = range->key_size;
+  iter->num_keys = 0;
+  iter->bucket_slot = 0;
+  iter->index_offset = range->start_slot * partition->slot_size;
+  iter->end_index_offset = range->end_slot * partition->slot_size;
+  iter->end_entry = -1;
+  iter->sequential = 0;
+  iter->value = NULL;
+  iter->value_capacity = 0;
+  iter->entries = NULL;
+  iter->readahead = 0;
+  return 0;
+}
+
+char pal_ordered(pal_reader_t *reader) {
+  return reader->directory != NULL;
+}
+
+int pal_iterator_reset_prefix(pal_iterator_t *iterator, pal_reader_t *reader, char *prefix, int32_t prefix_len) {
+  if (reader->directory == NULL || prefix_len < 0) {
+    return -1;
+  }
+  int32_t start = search_directory(reader, prefix, prefix_len, 0);
+  int32_t end = search_directory(reader, prefix, prefix_len, 1);
+  if (start < 0 || end < 0) {
+    return -1;
+  }
+  pal_iterator_reset(iterator, reader);
+  struct pal_iterator *iter = (struct pal_iterator *) iterator;
+  iter->entry = start;
+  iter->end_entry = end;
+  return 0;
+}
+
+int pal_iterator_reset_bounds(pal_iterator_t *iterator, pal_reader_t *reader, char *start, int32_t start_len, char *end, int32_t end_len) {
+  if (
+    reader->directory == NULL ||
+    (start != NULL && start_len < 0) ||
+    (end != NULL && end_len < 0)
+  ) {
+    return -1;
+  }
+  int32_t start_entry = start == NULL ?
+    0 :
+    search_directory(reader, start, start_len, 0);
+  int32_t end_entry = end == NULL ?
+    reader->directory_size :
+    search_directory(reader, end, end_len, 0);
+  if (start_entry < 0 || end_entry < 0) {
+    return -1;
+  }
+  pal_iterator_reset(iterator, reader);
+  struct pal_iterator *iter = (struct pal_iterator *) iterator;
+  iter->entry = start_entry;
+  iter->end_entry = end_entry;
+  return 0;
+}
+
+int pal_iterator_next(pal_iterator_t *iterator, char **key, int32_t *key_len, char **value, int64_t *value_len) {
+  struct pal_iterator *iter = (struct pal_iterator *) iterator;
+  struct pal_partition *partition;
+  int64_t data_offset;
+  int ret = next_slot(iter, &partition, key, &data_offset);
+  if (ret <= 0) {
+    return ret;
+  }
+  *key_len = partition->key_size;
+  *value = iterator_value(iter, partition, data_offset, value_len);
+  return *value != NULL ? 1 : -1;
+}
+
+int pal_iterator_next_key(pal_iterator_t *iterator, char **key, int32_t *key_len, int64_t *value_len) {
+  struct pal_iterator *iter = (struct pal_iterator *) iterator;
+  struct pal_partition *partition;
+  int64_t data_offset;
+  int ret = next_slot(iter, &partition, key, &data_offset);
+  if (ret <= 0) {
+    return ret;
+  }
+  *key_len = partition->key_size;
+  if (value_len == NULL) {
+    return 1;
+  }
+  if (iter->reader->compressed) {
+    *value_len = read_compressed(iter->reader, partition, data_offset, NULL, 0);
+  } else {
+    unpack_int64(partition->data + data_offset, value_len);
+  }
+  return *value_len >= 0 ? 1 : -1;
+}
+
+int32_t pal_iterator_count(pal_iterator_t *iterator) {
+  struct pal_iterator *iter = (struct pal_iterator *) iterator;
+  pal_reader_t *reader = iter->reader;
+  int32_t count = 0;
+
+  if (iter->end_entry >= 0) {
+    if (iter->entry < iter->end_entry) {
+      count = iter->end_entry - iter->entry;
+      iter->entry = iter->end_entry;
+    }
+    return count;
+  }
+
+  if (iter->end_index_offset >= 0) {
+    struct pal_partition *partition;
+    char *key;
+    int64_t data_offset;
+    while (next_slot(iter, &partition, &key, &data_offset) > 0) {
+      count++; // Range iterators can't fail.
+    }
+    return count;
+  }
+
+  // Full iterator, the remaining keys of each partition are already known.
+  for (; iter->key_size <= reader->max_key_size; iter->key_size++) {
+    struct pal_partition *partition = reader->partitions[iter->key_size];
+    if (partition != NULL) {
+      count += partition->num_keys - iter->num_keys;
+    }
+    iter->num_keys = 0;
+  }
+  iter->bucket_slot = 0;
+  iter->index_offset = 0;
+  return count;
+}
+
+void pal_iterator_destroy(pal_iterator_t *iterator) {
+  struct pal_iterator *iter = (struct pal_iterator *) iterator;
+  free(iter->value);
+  free(iter->entries);
+  iter->value = NULL;
+  iter->value_capacity = 0;
+  iter->entries = NULL;
+}
+
+void pal_set_cache_size(pal_reader_t *reader, int64_t cache_size) {
+  if (!reader->compressed) {
+    return;
+  }
+  reader->cache_size = cache_size / CACHE_SHARDS;
+  int32_t i;
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    struct pal_cache_shard *shard = reader->cache + i;
+    pthread_mutex_lock(&shard->lock);
+    evict_blocks(shard, reader->cache_size);
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
+
+char pal_compressed(pal_reader_t *reader) {
+  return reader->compressed;
+}
+
 void pal_destroy(pal_reader_t *reader) {
-  munmap_reader(reader);
-  free_reader_partitions(reader);
+  if (reader->compressed) {
+    int32_t i;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+      struct pal_cache_shard *shard = reader->cache + i;
+      evict_blocks(shard, -1);
+      pthread_mutex_destroy(&shard->lock);
+    }
+    free(reader->cache);
+  }
+  assert(!munmap(reader->addr, reader->size));
+  free(reader->partition_block);
   free(reader->partitions);
   free(reader);
 }
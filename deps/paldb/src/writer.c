@@ -0,0 +1,2359 @@
+#define _POSIX_C_SOURCE 200809L // For `mkstemp` and `fdopen`.
+
+#include "../include/paldb.h"
+#include "buckets.h"
+#include "filters.h"
+#include "lz4.h"
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define DEFAULT_LOAD_FACTOR 0.6
+#define DEFAULT_BUCKETIZED_LOAD_FACTOR 0.9
+#define MAX_KICKS 512 // Displacements before growing a bucketized index.
+#define MIN_CAPACITY 1024
+#define MAX_CHUNK_FILES 256 // Chunks distributed per pass in chunked builds.
+#define PARALLEL_MIN_ITEMS 65536 // Smaller indices are built by one thread.
+#define RANGES_PER_THREAD 4
+#define MIN_RANGE_SLOTS 4096
+#define MIN_LEAD_SLOTS 64 // Slots of each range whose items are remembered.
+#define COPY_BUFFER_SIZE 65536
+#define DEFAULT_VALUE_CACHE_SIZE (16 << 20)
+#define MIN_VALUE_CACHE_SLOTS 1024
+#define MAX_BLOCK_SIZE 65536 // Offsets within blocks are 16 bits.
+
+// Data structures.
+
+struct pal_writer_partition {
+  int32_t key_size;
+  int64_t num_items; // Including deletions and overwrites.
+  int64_t capacity;
+  char *keys; // Contiguous, `key_size` bytes per item.
+  int64_t *offsets; // Data offset of each item (0 for deletions).
+  int32_t *hashes; // Hash of each item's key.
+  FILE *spilled; // Temporary file, items flushed to respect the memory budget.
+  int64_t num_spilled; // Items in `spilled`, the others are in `keys`.
+  int32_t num_keys; // The remaining fields are populated when building.
+  int32_t num_slots; // Number of buckets for bucketized indices.
+  int32_t slot_size; // Bucket size for bucketized indices.
+  int64_t index_size; // Including the layout line for bucketized indices.
+  char *index;
+  FILE *index_file; // Temporary file replacing `index` when building in chunks.
+  int32_t filter_blocks; // 0 if the partition has no filter.
+  char *filter;
+  FILE *data; // Temporary file, the first byte is reserved.
+  int64_t data_size;
+  int32_t num_blocks; // The remaining fields are only used for compressed data.
+  int32_t blocks_capacity;
+  int64_t *block_offsets; // Offset of each block within `data`.
+  char *block; // Values not yet compressed, the first byte is reserved.
+  int64_t block_size;
+  int64_t block_capacity;
+};
+
+// Value already written to a partition's data, used for deduplication.
+struct cached_value {
+  int32_t key_size;
+  int32_t hash;
+  int64_t offset; // 0 for empty cache slots.
+  int64_t len;
+  char *value;
+};
+
+// Open addressing table of cached values, shared by all partitions.
+struct value_cache {
+  int64_t capacity; // Maximum bytes of values retained.
+  int64_t size; // Bytes of values currently retained.
+  int64_t num_values;
+  int64_t num_slots;
+  struct cached_value *slots;
+};
+
+struct pal_writer {
+  char *path;
+  char *tmp_dir;
+  double load_factor;
+  char no_distinct;
+  char bucketized;
+  int32_t filter_bits;
+  int32_t block_size;
+  char ordered;
+  int64_t memory_budget; // 0 if unbounded.
+  int32_t num_threads;
+  int64_t buffered_size; // Bytes allocated to items held in memory.
+  struct value_cache values;
+  char *metadata;
+  int32_t metadata_size;
+  int32_t num_values;
+  int32_t max_key_size;
+  struct pal_writer_partition **partitions; // Array indexed by key length.
+};
+
+// Helpers.
+
+/**
+ * Write 32-bit integer to a file (serialized as big-endian).
+ *
+ */
+static char write_int32(FILE *file, int32_t val) {
+  val = htonl(val);
+  return fwrite(&val, 1, 4, file) < 4 ? -1 : 0;
+}
+
+/**
+ * Write 64-bit integer to a file (serialized as big-endian).
+ *
+ */
+static char write_int64(FILE *file, int64_t val) {
+  if (write_int32(file, (int32_t) (val >> 32))) {
+    return -1;
+  }
+  return write_int32(file, (int32_t) (val & 0xffffffffll));
+}
+
+/**
+ * Write zero bytes to a file.
+ *
+ */
+static char write_padding(FILE *file, int64_t size) {
+  while (size--) {
+    if (fputc(0, file) == EOF) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Pack a (non-negative) integer, inverse of the reader's `unpack_int64`.
+ *
+ * Returns the next address.
+ *
+ */
+static char *pack_int64(char *addr, int64_t src) {
+  do {
+    *addr = src & 0x7f;
+    src >>= 7;
+  } while (src && (*addr++ |= 0x80));
+  return ++addr;
+}
+
+/**
+ * Read a packed integer, same as the reader's.
+ *
+ */
+static void unpack_int64(char *addr, int64_t *dst) {
+  *dst = 0;
+  int k = 0;
+  char b;
+  do {
+    b = *addr++;
+    *dst |= (int64_t) (b & 0x7f) << k;
+    k += 7;
+  } while (b & 0x80);
+}
+
+/**
+ * Length of a packed integer.
+ *
+ */
+static int32_t packed_size(int64_t src) {
+  char buf[10];
+  return pack_int64(buf, src) - buf;
+}
+
+/**
+ * Milliseconds since the epoch.
+ *
+ */
+static int64_t now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (int64_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/**
+ * Open an anonymous temporary file (removed once closed).
+ *
+ */
+static FILE *open_tmp(const char *dir) {
+  if (dir == NULL) {
+    return tmpfile();
+  }
+  size_t len = strlen(dir) + 12;
+  char *path = malloc(len);
+  if (path == NULL) {
+    return NULL;
+  }
+  snprintf(path, len, "%s/pal-XXXXXX", dir);
+  int fd = mkstemp(path);
+  if (fd >= 0) {
+    unlink(path);
+  }
+  free(path);
+  return fd < 0 ? NULL : fdopen(fd, "w+b");
+}
+
+/**
+ * Copy a file's contents to the current position of another.
+ *
+ */
+static char copy_file(FILE *src, FILE *dst) {
+  char buf[COPY_BUFFER_SIZE];
+  size_t len;
+  if (fflush(src) || fseek(src, 0, SEEK_SET)) {
+    return -1;
+  }
+  while ((len = fread(buf, 1, sizeof buf, src)) > 0) {
+    if (fwrite(buf, 1, len, dst) < len) {
+      return -1;
+    }
+  }
+  return ferror(src) ? -1 : 0;
+}
+
+/**
+ * Get (creating it if necessary) the partition for a given key length.
+ *
+ */
+static struct pal_writer_partition *get_partition(pal_writer_t *writer, int32_t key_size) {
+  if (key_size > writer->max_key_size) {
+    struct pal_writer_partition **partitions = realloc(
+      writer->partitions,
+      (key_size + 1) * sizeof *partitions
+    );
+    if (partitions == NULL) {
+      PAL_ERRNO = ALLOC_FAIL;
+      return NULL;
+    }
+    memset(
+      partitions + writer->max_key_size + 1,
+      0,
+      (key_size - writer->max_key_size) * sizeof *partitions
+    );
+    writer->partitions = partitions;
+    writer->max_key_size = key_size;
+  }
+
+  struct pal_writer_partition *partition = writer->partitions[key_size];
+  if (partition != NULL) {
+    return partition;
+  }
+  partition = calloc(1, sizeof *partition);
+  if (partition == NULL) {
+    PAL_ERRNO = ALLOC_FAIL;
+    return NULL;
+  }
+  partition->key_size = key_size;
+  partition->data = open_tmp(writer->tmp_dir);
+  if (
+    partition->data == NULL ||
+    (!writer->block_size && fputc(0, partition->data) == EOF)
+  ) {
+    // Reserve 0 data offset.
+    if (partition->data != NULL) {
+      fclose(partition->data);
+    }
+    free(partition);
+    PAL_ERRNO = WRITE_FAIL;
+    return NULL;
+  }
+  if (writer->block_size) {
+    // Compressed data, reserve the first byte of the first block instead.
+    partition->block = calloc(1, writer->block_size);
+    if (partition->block == NULL) {
+      fclose(partition->data);
+      free(partition);
+      PAL_ERRNO = ALLOC_FAIL;
+      return NULL;
+    }
+    partition->block_size = 1;
+    partition->block_capacity = writer->block_size;
+  } else {
+    partition->data_size = 1;
+  }
+  writer->partitions[key_size] = partition;
+  return partition;
+}
+
+// Compressed data (see `lz4.h`).
+
+/**
+ * Compress a partition's pending block and append it to its data.
+ *
+ * Each block starts with its codec (0 for blocks stored as is, when
+ * compression doesn't help, 1 for LZ4) and its packed uncompressed size.
+ *
+ */
+static char flush_block(struct pal_writer_partition *partition) {
+  if (!partition->block_size) {
+    return 0;
+  }
+  if (partition->num_blocks == partition->blocks_capacity) {
+    int32_t capacity = partition->blocks_capacity ? 2 * partition->blocks_capacity : 64;
+    int64_t *offsets = realloc(partition->block_offsets, capacity * sizeof *offsets);
+    if (offsets == NULL) {
+      PAL_ERRNO = ALLOC_FAIL;
+      return -1;
+    }
+    partition->block_offsets = offsets;
+    partition->blocks_capacity = capacity;
+  }
+  char *compressed = malloc(pal_lz4_bound(partition->block_size));
+  if (compressed == NULL) {
+    PAL_ERRNO = ALLOC_FAIL;
+    return -1;
+  }
+  char header[11];
+  int32_t compressed_size = pal_lz4_compress(partition->block, partition->block_size, compressed);
+  char *payload = compressed;
+  header[0] = 1;
+  if (compressed_size >= partition->block_size) {
+    payload = partition->block;
+    compressed_size = partition->block_size;
+    header[0] = 0;
+  }
+  size_t header_size = pack_int64(header + 1, partition->block_size) - header;
+  char ret = 0;
+  if (
+    fwrite(header, 1, header_size, partition->data) < header_size ||
+    fwrite(payload, 1, compressed_size, partition->data) < (size_t) compressed_size
+  ) {
+    PAL_ERRNO = WRITE_FAIL;
+    ret = -1;
+  } else {
+    partition->block_offsets[partition->num_blocks++] = partition->data_size;
+    partition->data_size += header_size + compressed_size;
+    partition->block_size = 0;
+  }
+  free(compressed);
+  return ret;
+}
+
+/**
+ * Add a value to a partition's pending block, flushing it first if it is
+ * full. Values never span blocks (blocks holding large values are larger
+ * than the target size), so their offset is their block's index followed by
+ * their 16-bit offset within it.
+ *
+ */
+static char append_value(pal_writer_t *writer, struct pal_writer_partition *partition, char *header, int32_t header_size, char *value, int64_t value_len, int64_t *offset) {
+  if (partition->block_size >= writer->block_size && flush_block(partition)) {
+    return -1;
+  }
+  int64_t size = partition->block_size + header_size + value_len;
+  if (size > INT32_MAX / 2) {
+    PAL_ERRNO = INVALID_DATA; // Too large to compress.
+    return -1;
+  }
+  if (size > partition->block_capacity) {
+    char *block = realloc(partition->block, size);
+    if (block == NULL) {
+      PAL_ERRNO = ALLOC_FAIL;
+      return -1;
+    }
+    partition->block = block;
+    partition->block_capacity = size;
+  }
+  *offset = ((int64_t) partition->num_blocks << 16) | partition->block_size;
+  memcpy(partition->block + partition->block_size, header, header_size);
+  memcpy(partition->block + partition->block_size + header_size, value, value_len);
+  partition->block_size = size;
+  return 0;
+}
+
+/**
+ * Write a compressed partition's block table, the blocks themselves follow.
+ * Block offsets are relative to the table's start.
+ *
+ */
+static char write_blocks_table(FILE *file, struct pal_writer_partition *partition) {
+  int64_t table_size = 4 + 8 * ((int64_t) partition->num_blocks + 1);
+  if (write_int32(file, partition->num_blocks)) {
+    return -1;
+  }
+  int32_t i;
+  for (i = 0; i < partition->num_blocks; i++) {
+    if (write_int64(file, table_size + partition->block_offsets[i])) {
+      return -1;
+    }
+  }
+  return write_int64(file, partition->data_size);
+}
+
+/**
+ * Upper bound of a partition's data offsets, which index slots must hold.
+ *
+ */
+static int64_t max_offset(pal_writer_t *writer, struct pal_writer_partition *partition) {
+  return writer->block_size ?
+    (int64_t) partition->num_blocks << 16 :
+    partition->data_size;
+}
+
+/**
+ * Free all of a value cache's memory, leaving it empty.
+ *
+ */
+static void clear_value_cache(struct value_cache *cache) {
+  int64_t i;
+  for (i = 0; i < cache->num_slots; i++) {
+    free(cache->slots[i].value);
+  }
+  free(cache->slots);
+  cache->slots = NULL;
+  cache->num_slots = 0;
+  cache->num_values = 0;
+  cache->size = 0;
+}
+
+/**
+ * Find a value's cache slot (either the matching value's or the empty one
+ * where it should be inserted). The cache mustn't be full.
+ *
+ */
+static struct cached_value *find_value(struct value_cache *cache, int32_t key_size, int32_t hash, char *value, int64_t len) {
+  int64_t slot = ((uint32_t) hash ^ (uint32_t) key_size * 0x9e3779b1) % cache->num_slots;
+  while (1) {
+    struct cached_value *cached = cache->slots + slot;
+    if (
+      !cached->offset ||
+      (
+        cached->hash == hash &&
+        cached->key_size == key_size &&
+        cached->len == len &&
+        !memcmp(cached->value, value, len)
+      )
+    ) {
+      return cached;
+    }
+    if (++slot == cache->num_slots) {
+      slot = 0;
+    }
+  }
+}
+
+/**
+ * Double the number of slots in a value cache.
+ *
+ * Returns -1 if the allocation failed (the cache is left unchanged).
+ *
+ */
+static char grow_value_cache(struct value_cache *cache) {
+  struct value_cache grown = *cache;
+  grown.num_slots = cache->num_slots ? 2 * cache->num_slots : MIN_VALUE_CACHE_SLOTS;
+  grown.slots = calloc(grown.num_slots, sizeof *grown.slots);
+  if (grown.slots == NULL) {
+    return -1;
+  }
+  int64_t i;
+  for (i = 0; i < cache->num_slots; i++) {
+    struct cached_value *cached = cache->slots + i;
+    if (cached->offset) {
+      *find_value(&grown, cached->key_size, cached->hash, cached->value, cached->len) = *cached;
+    }
+  }
+  free(cache->slots);
+  *cache = grown;
+  return 0;
+}
+
+/**
+ * Data offset of an identical value already written to a partition, 0 if
+ * there is none (or it wasn't cached).
+ *
+ */
+static int64_t cached_offset(struct value_cache *cache, int32_t key_size, int32_t hash, char *value, int64_t len) {
+  if (!cache->num_values) {
+    return 0;
+  }
+  return find_value(cache, key_size, hash, value, len)->offset;
+}
+
+/**
+ * Remember a value written to a partition. Values are cached until the
+ * cache's capacity is reached, after which only those already cached are
+ * deduplicated. Deduplication is best effort, allocation failures are ignored.
+ *
+ */
+static void cache_value(struct value_cache *cache, int32_t key_size, int32_t hash, char *value, int64_t len, int64_t offset) {
+  if (len > cache->capacity - cache->size) {
+    return;
+  }
+  if (2 * (cache->num_values + 1) > cache->num_slots && grow_value_cache(cache)) {
+    return;
+  }
+  char *copy = malloc(len + 1); // Avoid zero-sized allocations.
+  if (copy == NULL) {
+    return;
+  }
+  memcpy(copy, value, len);
+  struct cached_value *cached = find_value(cache, key_size, hash, value, len);
+  cached->key_size = key_size;
+  cached->hash = hash;
+  cached->offset = offset;
+  cached->len = len;
+  cached->value = copy;
+  cache->size += len;
+  cache->num_values++;
+}
+
+/**
+ * Make room for at least one more item in a partition.
+ *
+ */
+static char grow_partition(struct pal_writer_partition *partition) {
+  int64_t capacity = 2 * partition->capacity;
+  if (capacity < MIN_CAPACITY) {
+    capacity = MIN_CAPACITY;
+  }
+  char *keys = realloc(partition->keys, capacity * partition->key_size);
+  if (keys == NULL) {
+    return -1;
+  }
+  partition->keys = keys;
+  int64_t *offsets = realloc(partition->offsets, capacity * sizeof *offsets);
+  if (offsets == NULL) {
+    return -1;
+  }
+  partition->offsets = offsets;
+  int32_t *hashes = realloc(partition->hashes, capacity * sizeof *hashes);
+  if (hashes == NULL) {
+    return -1;
+  }
+  partition->hashes = hashes;
+  partition->capacity = capacity;
+  return 0;
+}
+
+/**
+ * Slot where a key with the given hash would be stored absent any collisions.
+ *
+ */
+static int32_t home_slot(struct pal_writer_partition *partition, int32_t hash) {
+  return (hash & 0x7fffffff) % partition->num_slots;
+}
+
+/**
+ * Find the slot containing a key or, if it is missing, the empty slot where it
+ * should be inserted.
+ *
+ * Returns -1 if the index is full.
+ *
+ */
+static int32_t find_slot(struct pal_writer_partition *partition, char *key, int32_t hash) {
+  int32_t key_size = partition->key_size;
+  int32_t slot = home_slot(partition, hash);
+  int32_t attempts = partition->num_slots;
+  while (attempts--) {
+    // Single step linear probing, same as the reader.
+    char *addr = partition->index + (int64_t) slot * partition->slot_size;
+    if (!addr[key_size] || !memcmp(addr, key, key_size)) {
+      return slot;
+    }
+    if (++slot == partition->num_slots) {
+      slot = 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Empty a slot, shifting back any subsequent colliding keys so that they
+ * remain reachable by linear probing.
+ *
+ */
+static void remove_slot(struct pal_writer_partition *partition, int32_t slot) {
+  int32_t key_size = partition->key_size;
+  int32_t slot_size = partition->slot_size;
+  int32_t next = slot;
+  while (1) {
+    memset(partition->index + (int64_t) slot * slot_size, 0, slot_size);
+    char *addr;
+    int32_t home;
+    do {
+      if (++next == partition->num_slots) {
+        next = 0;
+      }
+      addr = partition->index + (int64_t) next * slot_size;
+      if (!addr[key_size]) {
+        return;
+      }
+      home = home_slot(partition, pal_hash(addr, key_size));
+    } while (
+      slot <= next ?
+        (slot < home && home <= next) :
+        (slot < home || home <= next)
+    );
+    memcpy(partition->index + (int64_t) slot * slot_size, addr, slot_size);
+    slot = next;
+  }
+}
+
+/**
+ * Find a key's slot within `[slot, end)`, probing like `find_slot` but
+ * without wrapping around.
+ *
+ * Returns `end` if all these slots hold other keys.
+ *
+ */
+static int64_t probe_slots(struct pal_writer_partition *partition, char *index, char *key, int64_t slot, int64_t end) {
+  int32_t key_size = partition->key_size;
+  for (; slot < end; slot++) {
+    char *addr = index + slot * partition->slot_size;
+    if (!addr[key_size] || !memcmp(addr, key, key_size)) {
+      break;
+    }
+  }
+  return slot;
+}
+
+/**
+ * Store an entry in the slot found by `probe_slots`, overwriting any existing
+ * entry for the same key if `no_distinct` is set.
+ *
+ * Returns 1 if the key is new, 0 if it was overwritten, and -1 otherwise.
+ *
+ */
+static char set_slot(pal_writer_t *writer, struct pal_writer_partition *partition, char *addr, char *key, int64_t offset) {
+  int32_t key_size = partition->key_size;
+  if (!addr[key_size]) {
+    memcpy(addr, key, key_size);
+    pack_int64(addr + key_size, offset);
+    return 1;
+  }
+  if (!writer->no_distinct) {
+    PAL_ERRNO = DUPLICATE_KEY;
+    return -1;
+  }
+  memset(addr + key_size, 0, partition->slot_size - key_size);
+  pack_int64(addr + key_size, offset);
+  return 0;
+}
+
+/**
+ * Size a partition's (linear probing) index for its items.
+ *
+ */
+static char size_index(pal_writer_t *writer, struct pal_writer_partition *partition, double load_factor) {
+  int64_t num_slots = partition->num_items / load_factor;
+  int64_t slot_size = partition->key_size + packed_size(max_offset(writer, partition));
+  if (num_slots * slot_size > INT32_MAX) {
+    PAL_ERRNO = INVALID_DATA;
+    return -1;
+  }
+  partition->num_keys = 0;
+  partition->num_slots = num_slots;
+  partition->slot_size = slot_size;
+  partition->index_size = num_slots * slot_size;
+  return 0;
+}
+
+// Parallel builds.
+
+// Tasks shared by a pool of threads (see `run_tasks`).
+struct task_pool {
+  char (*run)(void *arg, int64_t task);
+  void *arg;
+  int64_t num_tasks;
+  int64_t next_task;
+  char failed;
+  pthread_mutex_t lock;
+};
+
+static void *run_pool(void *arg) {
+  struct task_pool *pool = arg;
+  while (1) {
+    pthread_mutex_lock(&pool->lock);
+    int64_t task = pool->failed ? pool->num_tasks : pool->next_task++;
+    pthread_mutex_unlock(&pool->lock);
+    if (task >= pool->num_tasks) {
+      return NULL;
+    }
+    if (pool->run(pool->arg, task)) {
+      pthread_mutex_lock(&pool->lock);
+      pool->failed = 1;
+      pthread_mutex_unlock(&pool->lock);
+    }
+  }
+}
+
+/**
+ * Run tasks `0` to `num_tasks - 1` on up to `num_threads` threads (this one
+ * included), skipping the remaining tasks after a failure.
+ *
+ * Returns -1 if any task failed (PAL_ERRNO is shared by all threads, so only
+ * one of their errors is kept).
+ *
+ */
+static char run_tasks(int32_t num_threads, int64_t num_tasks, char (*run)(void *, int64_t), void *arg) {
+  struct task_pool pool;
+  pool.run = run;
+  pool.arg = arg;
+  pool.num_tasks = num_tasks;
+  pool.next_task = 0;
+  pool.failed = 0;
+  if (pthread_mutex_init(&pool.lock, NULL)) {
+    PAL_ERRNO = ALLOC_FAIL;
+    return -1;
+  }
+  if (num_threads > num_tasks) {
+    num_threads = num_tasks;
+  }
+  pthread_t *threads = malloc((num_threads + 1) * sizeof *threads);
+  int32_t num_started = 0;
+  while (threads != NULL && num_started + 1 < num_threads) {
+    if (pthread_create(&threads[num_started], NULL, run_pool, &pool)) {
+      break; // The threads already started will pick up the rest.
+    }
+    num_started++;
+  }
+  run_pool(&pool);
+  int32_t i;
+  for (i = 0; i < num_started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+  pthread_mutex_destroy(&pool.lock);
+  return pool.failed ? -1 : 0;
+}
+
+// Index built a range of slots at a time, in parallel (see `build_ranges`).
+struct ranges {
+  pal_writer_t *writer;
+  struct pal_writer_partition *partition;
+  int64_t num_ranges;
+  int64_t range_slots;
+  int64_t slice_items; // Items are grouped by range in slices, one per task.
+  int64_t *counts; // Items of each slice in each range, then their offset.
+  int64_t *items; // Item numbers, by range then insertion order.
+  int64_t *starts; // Offset of each range's items (and of the end).
+  int64_t **overflows; // Items probing past the end of each range.
+  int64_t *num_overflows;
+  int64_t **leads; // Items homed in the first slots of each range.
+  int64_t *num_leads;
+  int64_t *lead_ends; // End of these first slots (a cluster boundary).
+  int64_t *num_keys;
+};
+
+static int64_t range_end(struct ranges *r, int64_t range) {
+  int64_t end = (range + 1) * r->range_slots;
+  return end < r->partition->num_slots ? end : r->partition->num_slots;
+}
+
+static int64_t item_range(struct ranges *r, int64_t item) {
+  return home_slot(r->partition, r->partition->hashes[item]) / r->range_slots;
+}
+
+/**
+ * First empty slot within `[slot, end)`, `end` if there is none.
+ *
+ */
+static int64_t empty_slot(struct pal_writer_partition *partition, int64_t slot, int64_t end) {
+  for (; slot < end; slot++) {
+    if (!partition->index[slot * partition->slot_size + partition->key_size]) {
+      break;
+    }
+  }
+  return slot;
+}
+
+/**
+ * Append an item number to a growable array.
+ *
+ */
+static char push_number(int64_t **numbers, int64_t *len, int64_t *capacity, int64_t number) {
+  if (*len == *capacity) {
+    int64_t n = *capacity ? 2 * *capacity : 64;
+    int64_t *grown = realloc(*numbers, n * sizeof *grown);
+    if (grown == NULL) {
+      PAL_ERRNO = ALLOC_FAIL;
+      return -1;
+    }
+    *numbers = grown;
+    *capacity = n;
+  }
+  (*numbers)[(*len)++] = number;
+  return 0;
+}
+
+static char count_slice(void *arg, int64_t slice) {
+  struct ranges *r = arg;
+  int64_t *counts = r->counts + slice * r->num_ranges;
+  int64_t end = (slice + 1) * r->slice_items;
+  int64_t i;
+  if (end > r->partition->num_items) {
+    end = r->partition->num_items;
+  }
+  for (i = slice * r->slice_items; i < end; i++) {
+    counts[item_range(r, i)]++;
+  }
+  return 0;
+}
+
+static char group_slice(void *arg, int64_t slice) {
+  struct ranges *r = arg;
+  int64_t *offsets = r->counts + slice * r->num_ranges;
+  int64_t end = (slice + 1) * r->slice_items;
+  int64_t i;
+  if (end > r->partition->num_items) {
+    end = r->partition->num_items;
+  }
+  for (i = slice * r->slice_items; i < end; i++) {
+    r->items[offsets[item_range(r, i)]++] = i;
+  }
+  return 0;
+}
+
+/**
+ * Insert a range's items in order, as if it were the whole index except that
+ * keys probing past its end are set aside. Also remembers which items are
+ * homed in its first few clusters, for `fix_range`.
+ *
+ */
+static char fill_range(void *arg, int64_t range) {
+  struct ranges *r = arg;
+  struct pal_writer_partition *partition = r->partition;
+  int64_t start = range * r->range_slots;
+  int64_t end = range_end(r, range);
+  int64_t capacity = 0;
+  int64_t i;
+  for (i = r->starts[range]; i < r->starts[range + 1]; i++) {
+    int64_t item = r->items[i];
+    char *key = partition->keys + item * partition->key_size;
+    int64_t slot = probe_slots(
+      partition,
+      partition->index,
+      key,
+      home_slot(partition, partition->hashes[item]),
+      end
+    );
+    if (slot == end) {
+      if (push_number(&r->overflows[range], &r->num_overflows[range], &capacity, item)) {
+        return -1;
+      }
+    } else if (set_slot(r->writer, partition, partition->index + slot * partition->slot_size, key, partition->offsets[item]) < 0) {
+      return -1;
+    }
+  }
+
+  int64_t lead_end = empty_slot(partition, start, end);
+  if (lead_end - start < MIN_LEAD_SLOTS) {
+    int64_t slot = start + MIN_LEAD_SLOTS < end ? start + MIN_LEAD_SLOTS : end;
+    lead_end = empty_slot(partition, slot, end);
+  }
+  r->lead_ends[range] = lead_end;
+  capacity = 0;
+  for (i = r->starts[range]; i < r->starts[range + 1]; i++) {
+    int64_t item = r->items[i];
+    if (
+      home_slot(partition, partition->hashes[item]) < lead_end &&
+      push_number(&r->leads[range], &r->num_leads[range], &capacity, item)
+    ) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Insert the items of a range's leading cluster again, merged (in insertion
+ * order) with the items probing into it from the previous range, which
+ * continue from its first slot.
+ *
+ * Adding items only ever pushes others further, so the following clusters are
+ * unaffected unless the leading cluster reaches them, in which case they are
+ * merged into it and inserted again too. If it reaches the end of the range,
+ * the items probing past it are updated.
+ *
+ */
+static char fix_range(struct ranges *r, int64_t range, int64_t *in, int64_t num_in) {
+  struct pal_writer_partition *partition = r->partition;
+  int32_t key_size = partition->key_size;
+  int32_t slot_size = partition->slot_size;
+  int64_t start = range * r->range_slots;
+  int64_t end = range_end(r, range);
+  int64_t lead_end = empty_slot(partition, start, end);
+  int64_t *next = NULL; // Items probing past the end of the range.
+  int64_t num_next = 0;
+  int64_t next_capacity = 0;
+  char ret = -1;
+  char merged;
+  do {
+    // Candidate items, those homed past the cluster are skipped.
+    int64_t *items = r->leads[range];
+    int64_t num_items = r->num_leads[range];
+    if (lead_end > r->lead_ends[range]) {
+      items = r->items + r->starts[range];
+      num_items = r->starts[range + 1] - r->starts[range];
+    }
+    memset(partition->index + start * slot_size, 0, (lead_end - start) * slot_size);
+    num_next = 0;
+    merged = 0;
+    int64_t i = 0;
+    int64_t j = 0;
+    while (i < num_items || j < num_in) {
+      int64_t item;
+      int64_t slot;
+      if (j == num_in || (i < num_items && items[i] < in[j])) {
+        item = items[i++];
+        slot = home_slot(partition, partition->hashes[item]);
+        if (slot >= lead_end) {
+          continue;
+        }
+      } else {
+        item = in[j++];
+        slot = start;
+      }
+      char *key = partition->keys + item * key_size;
+      slot = probe_slots(partition, partition->index, key, slot, lead_end);
+      if (slot == lead_end) {
+        if (lead_end == end) {
+          if (push_number(&next, &num_next, &next_capacity, item)) {
+            goto cleanup;
+          }
+          continue;
+        }
+        // Merge the following cluster and start over.
+        lead_end = empty_slot(partition, lead_end + 1, end);
+        merged = 1;
+        break;
+      }
+      if (set_slot(r->writer, partition, partition->index + slot * slot_size, key, partition->offsets[item]) < 0) {
+        goto cleanup;
+      }
+    }
+  } while (merged);
+
+  if (lead_end == end) {
+    free(r->overflows[range]);
+    r->overflows[range] = next;
+    r->num_overflows[range] = num_next;
+    next = NULL;
+  }
+  ret = 0;
+
+cleanup:
+  free(next);
+  return ret;
+}
+
+static char count_range(void *arg, int64_t range) {
+  struct ranges *r = arg;
+  struct pal_writer_partition *partition = r->partition;
+  int64_t end = range_end(r, range);
+  int64_t slot;
+  for (slot = range * r->range_slots; slot < end; slot++) {
+    if (partition->index[slot * partition->slot_size + partition->key_size]) {
+      r->num_keys[range]++;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Build a partition's (linear probing) index on `num_threads` threads, into
+ * the same bytes as `build_index` (there must be no deletions).
+ *
+ * Items are first grouped by the range of slots their home slot falls in
+ * (keeping them in insertion order), then each range is filled independently,
+ * setting aside keys which probe past its end. These are then carried over to
+ * the next range, in order, whose leading cluster is rebuilt with them (see
+ * `fix_range`). Keys probing past the end of the last range wrap around to
+ * the first, whose leading cluster is rebuilt in turn, and so on until no
+ * range's incoming keys change.
+ *
+ */
+static char build_ranges(pal_writer_t *writer, struct pal_writer_partition *partition) {
+  struct ranges r;
+  memset(&r, 0, sizeof r);
+  r.writer = writer;
+  r.partition = partition;
+  int64_t num_slots = partition->num_slots;
+  int64_t num_ranges = (int64_t) writer->num_threads * RANGES_PER_THREAD;
+  if (num_ranges > num_slots / MIN_RANGE_SLOTS) {
+    num_ranges = num_slots / MIN_RANGE_SLOTS;
+  }
+  if (num_ranges < 1) {
+    num_ranges = 1;
+  }
+  r.range_slots = (num_slots + num_ranges - 1) / num_ranges;
+  r.num_ranges = num_ranges = (num_slots + r.range_slots - 1) / r.range_slots;
+  r.slice_items = (partition->num_items + num_ranges - 1) / num_ranges;
+  int64_t num_slices = (partition->num_items + r.slice_items - 1) / r.slice_items;
+
+  int64_t *carried = calloc(num_ranges, sizeof *carried); // By `fill_range`.
+  r.counts = calloc(num_slices * num_ranges, sizeof *r.counts);
+  r.items = malloc(partition->num_items * sizeof *r.items);
+  r.starts = malloc((num_ranges + 1) * sizeof *r.starts);
+  r.overflows = calloc(num_ranges, sizeof *r.overflows);
+  r.num_overflows = calloc(num_ranges, sizeof *r.num_overflows);
+  r.leads = calloc(num_ranges, sizeof *r.leads);
+  r.num_leads = calloc(num_ranges, sizeof *r.num_leads);
+  r.lead_ends = calloc(num_ranges, sizeof *r.lead_ends);
+  r.num_keys = calloc(num_ranges, sizeof *r.num_keys);
+  char ret = -1;
+  int64_t i, j;
+  if (
+    carried == NULL ||
+    r.counts == NULL ||
+    r.items == NULL ||
+    r.starts == NULL ||
+    r.overflows == NULL ||
+    r.num_overflows == NULL ||
+    r.leads == NULL ||
+    r.num_leads == NULL ||
+    r.lead_ends == NULL ||
+    r.num_keys == NULL
+  ) {
+    PAL_ERRNO = ALLOC_FAIL;
+    goto cleanup;
+  }
+
+  if (run_tasks(writer->num_threads, num_slices, count_slice, &r)) {
+    goto cleanup;
+  }
+  int64_t offset = 0;
+  for (i = 0; i < num_ranges; i++) {
+    r.starts[i] = offset;
+    for (j = 0; j < num_slices; j++) {
+      int64_t count = r.counts[j * num_ranges + i];
+      r.counts[j * num_ranges + i] = offset;
+      offset += count;
+    }
+  }
+  r.starts[num_ranges] = offset;
+  if (
+    run_tasks(writer->num_threads, num_slices, group_slice, &r) ||
+    run_tasks(writer->num_threads, num_ranges, fill_range, &r)
+  ) {
+    goto cleanup;
+  }
+
+  int64_t previous = 0;
+  int64_t range = 1 % num_ranges;
+  int64_t steps;
+  for (
+    steps = 0;
+    steps < num_ranges || carried[range] != r.num_overflows[previous];
+    steps++
+  ) {
+    int64_t num_in = r.num_overflows[previous];
+    if (carried[range] != num_in) {
+      if (fix_range(&r, range, r.overflows[previous], num_in)) {
+        goto cleanup;
+      }
+      carried[range] = num_in;
+    }
+    previous = range;
+    range = (range + 1) % num_ranges;
+  }
+
+  if (run_tasks(writer->num_threads, num_ranges, count_range, &r)) {
+    goto cleanup;
+  }
+  for (i = 0; i < num_ranges; i++) {
+    partition->num_keys += r.num_keys[i];
+  }
+  ret = 0;
+
+cleanup:
+  for (i = 0; i < num_ranges; i++) {
+    if (r.overflows != NULL) {
+      free(r.overflows[i]);
+    }
+    if (r.leads != NULL) {
+      free(r.leads[i]);
+    }
+  }
+  free(carried);
+  free(r.counts);
+  free(r.items);
+  free(r.starts);
+  free(r.overflows);
+  free(r.num_overflows);
+  free(r.leads);
+  free(r.num_leads);
+  free(r.lead_ends);
+  free(r.num_keys);
+  return ret;
+}
+
+/**
+ * Build a partition's (linear probing) index, applying overwrites and
+ * deletions in insertion order.
+ *
+ */
+static char build_index(pal_writer_t *writer, struct pal_writer_partition *partition, double load_factor) {
+  if (size_index(writer, partition, load_factor)) {
+    return -1;
+  }
+  int32_t key_size = partition->key_size;
+  int32_t slot_size = partition->slot_size;
+  partition->index = calloc(partition->num_slots, slot_size);
+  if (partition->index == NULL) {
+    PAL_ERRNO = ALLOC_FAIL;
+    return -1;
+  }
+
+  int64_t i;
+  if (writer->num_threads > 1 && partition->num_items >= PARALLEL_MIN_ITEMS) {
+    i = 0;
+    while (i < partition->num_items && partition->offsets[i]) {
+      i++;
+    }
+    if (i == partition->num_items) {
+      return build_ranges(writer, partition); // Deletions need the whole index.
+    }
+  }
+  for (i = 0; i < partition->num_items; i++) {
+    char *key = partition->keys + i * key_size;
+    int64_t offset = partition->offsets[i];
+    int32_t slot = find_slot(partition, key, partition->hashes[i]);
+    if (slot < 0) {
+      PAL_ERRNO = INVALID_DATA;
+      return -1;
+    }
+    char *addr = partition->index + (int64_t) slot * slot_size;
+    if (!addr[key_size]) {
+      // New key (deletions of missing keys are no-ops).
+      if (offset) {
+        memcpy(addr, key, key_size);
+        pack_int64(addr + key_size, offset);
+        partition->num_keys++;
+      }
+    } else if (!writer->no_distinct) {
+      PAL_ERRNO = DUPLICATE_KEY;
+      return -1;
+    } else if (offset) {
+      // Overwrite.
+      memset(addr + key_size, 0, slot_size - key_size);
+      pack_int64(addr + key_size, offset);
+    } else {
+      // Delete.
+      remove_slot(partition, slot);
+      partition->num_keys--;
+    }
+  }
+  return 0;
+}
+
+// Bucketized indices (see `buckets.h`).
+
+struct buckets {
+  int32_t key_size;
+  int32_t num_buckets;
+  int32_t bucket_slots;
+  int32_t offset_width;
+  int32_t bucket_size;
+  char *index; // Starting with the layout line.
+  int32_t *hashes; // Hash of each slot's key (to find its alternate bucket).
+  char *pending; // Key being inserted.
+  char *evicted; // Key being displaced.
+  uint64_t random; // Xorshift state, fixed seed to keep builds reproducible.
+};
+
+static uint64_t next_random(struct buckets *b) {
+  b->random ^= b->random << 13;
+  b->random ^= b->random >> 7;
+  b->random ^= b->random << 17;
+  return b->random;
+}
+
+static char *bucket_addr(struct buckets *b, int32_t bucket) {
+  return b->index + PAL_LINE_SIZE + (int64_t) bucket * b->bucket_size;
+}
+
+/**
+ * First empty slot in a bucket, -1 if it is full.
+ *
+ */
+static int32_t free_slot(struct buckets *b, int32_t bucket) {
+  char *addr = bucket_addr(b, bucket);
+  int32_t i;
+  for (i = 0; i < b->bucket_slots; i++) {
+    if (!addr[i]) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void write_slot(struct buckets *b, int32_t bucket, int32_t slot, char *key, int32_t hash, int64_t offset) {
+  char *addr = bucket_addr(b, bucket);
+  addr[slot] = pal_tag(pal_remix(hash));
+  char *offset_addr = addr + b->bucket_slots + slot * b->offset_width;
+  int32_t i;
+  for (i = 0; i < b->offset_width; i++) {
+    offset_addr[i] = (offset >> (8 * i)) & 0xff;
+  }
+  memcpy(addr + b->bucket_slots * (1 + b->offset_width) + slot * b->key_size, key, b->key_size);
+  b->hashes[(int64_t) bucket * b->bucket_slots + slot] = hash;
+}
+
+/**
+ * Insert a key, displacing others to their other bucket if both of its
+ * buckets are full (random walk cuckoo insertion). Keys always go to their
+ * home bucket if it has room, which lets the reader skip alternate buckets
+ * when a home bucket isn't full.
+ *
+ * Returns -1 if the key couldn't be inserted within `MAX_KICKS`
+ * displacements, in which case the index should be rebuilt larger.
+ *
+ */
+static char insert_entry(struct buckets *b, char *key, int32_t hash, int64_t offset) {
+  int32_t key_size = b->key_size;
+  memcpy(b->pending, key, key_size);
+  int32_t kicks;
+  for (kicks = 0; kicks <= MAX_KICKS; kicks++) {
+    int32_t home = (hash & 0x7fffffff) % b->num_buckets;
+    int32_t alternate = pal_alternate_bucket(pal_remix(hash), b->num_buckets);
+    int32_t bucket = home;
+    int32_t slot = free_slot(b, home);
+    if (slot < 0) {
+      bucket = alternate;
+      slot = free_slot(b, alternate);
+    }
+    if (slot >= 0) {
+      write_slot(b, bucket, slot, b->pending, hash, offset);
+      return 0;
+    }
+
+    // Both buckets are full, evict a random key from either.
+    uint64_t random = next_random(b);
+    bucket = random & 1 ? home : alternate;
+    slot = (random >> 1) % b->bucket_slots;
+    char *addr = bucket_addr(b, bucket);
+    int32_t evicted_hash = b->hashes[(int64_t) bucket * b->bucket_slots + slot];
+    int64_t evicted_offset = pal_read_offset(
+      addr + b->bucket_slots + slot * b->offset_width,
+      b->offset_width
+    );
+    memcpy(
+      b->evicted,
+      addr + b->bucket_slots * (1 + b->offset_width) + slot * key_size,
+      key_size
+    );
+    write_slot(b, bucket, slot, b->pending, hash, offset);
+    char *tmp = b->pending;
+    b->pending = b->evicted;
+    b->evicted = tmp;
+    hash = evicted_hash;
+    offset = evicted_offset;
+  }
+  return -1;
+}
+
+/**
+ * Build a partition's bucketized index.
+ *
+ * Overwrites and deletions are first resolved by building a regular index
+ * (see `build_index`), whose entries are then moved into buckets. The number
+ * of buckets is grown until all keys fit.
+ *
+ */
+static char build_buckets(pal_writer_t *writer, struct pal_writer_partition *partition) {
+  if (build_index(writer, partition, DEFAULT_LOAD_FACTOR)) {
+    return -1;
+  }
+  char *slots = partition->index;
+  int32_t num_slots = partition->num_slots;
+  int32_t slot_size = partition->slot_size;
+  partition->index = NULL;
+
+  struct buckets b;
+  b.key_size = partition->key_size;
+  b.offset_width = 1;
+  while (b.offset_width < 8 && max_offset(writer, partition) >> (8 * b.offset_width)) {
+    b.offset_width++;
+  }
+  // Buckets span as few lines as possible while holding enough slots.
+  int32_t entry_size = 1 + b.offset_width + b.key_size;
+  int32_t num_lines = (PAL_MIN_BUCKET_SLOTS * entry_size + PAL_LINE_SIZE - 1) / PAL_LINE_SIZE;
+  b.bucket_size = num_lines * PAL_LINE_SIZE;
+  b.bucket_slots = b.bucket_size / entry_size;
+  if (b.bucket_slots > PAL_MAX_BUCKET_SLOTS) {
+    b.bucket_slots = PAL_MAX_BUCKET_SLOTS;
+  }
+  b.pending = malloc(b.key_size);
+  b.evicted = malloc(b.key_size);
+  b.index = NULL;
+  b.hashes = NULL;
+  int64_t num_buckets = partition->num_keys / (b.bucket_slots * writer->load_factor) + 1;
+  char ret = -1;
+  if (b.pending == NULL || b.evicted == NULL) {
+    PAL_ERRNO = ALLOC_FAIL;
+    goto cleanup;
+  }
+
+  int32_t i;
+  while (1) {
+    if (PAL_LINE_SIZE + num_buckets * b.bucket_size > INT32_MAX) {
+      PAL_ERRNO = INVALID_DATA;
+      goto cleanup;
+    }
+    b.num_buckets = num_buckets;
+    b.random = 88172645463325252ULL;
+    b.index = calloc(1, PAL_LINE_SIZE + num_buckets * b.bucket_size);
+    b.hashes = malloc(num_buckets * b.bucket_slots * sizeof *b.hashes);
+    if (b.index == NULL || b.hashes == NULL) {
+      PAL_ERRNO = ALLOC_FAIL;
+      goto cleanup;
+    }
+    b.index[0] = b.bucket_slots;
+    b.index[1] = b.offset_width;
+
+    for (i = 0; i < num_slots; i++) {
+      char *slot = slots + (int64_t) i * slot_size;
+      if (!slot[b.key_size]) {
+        continue; // Empty slot.
+      }
+      int64_t offset;
+      unpack_int64(slot + b.key_size, &offset);
+      if (insert_entry(&b, slot, pal_hash(slot, b.key_size), offset)) {
+        break;
+      }
+    }
+    if (i == num_slots) {
+      break;
+    }
+    // Too full, try again with more buckets.
+    free(b.index);
+    free(b.hashes);
+    b.index = NULL;
+    b.hashes = NULL;
+    num_buckets += num_buckets / 8 + 1;
+  }
+
+  partition->index = b.index;
+  partition->num_slots = b.num_buckets;
+  partition->slot_size = b.bucket_size;
+  partition->index_size = PAL_LINE_SIZE + (int64_t) b.num_buckets * b.bucket_size;
+  b.index = NULL;
+  ret = 0;
+
+cleanup:
+  free(slots);
+  free(b.index);
+  free(b.hashes);
+  free(b.pending);
+  free(b.evicted);
+  return ret;
+}
+
+/**
+ * Allocate a partition's membership filter (see `filters.h`), sized for
+ * `filter_bits` bits per key.
+ *
+ */
+static char init_filter(pal_writer_t *writer, struct pal_writer_partition *partition) {
+  if (!partition->num_keys) {
+    return 0; // Lookups already stop at the first (empty) slot.
+  }
+  int64_t num_blocks = (
+    (int64_t) partition->num_keys * writer->filter_bits +
+    8 * PAL_FILTER_BLOCK_SIZE - 1
+  ) / (8 * PAL_FILTER_BLOCK_SIZE);
+  if (num_blocks * PAL_FILTER_BLOCK_SIZE > INT32_MAX) {
+    PAL_ERRNO = INVALID_DATA;
+    return -1;
+  }
+  partition->filter = calloc(num_blocks, PAL_FILTER_BLOCK_SIZE);
+  if (partition->filter == NULL) {
+    PAL_ERRNO = ALLOC_FAIL;
+    return -1;
+  }
+  partition->filter_blocks = num_blocks;
+  return 0;
+}
+
+/**
+ * Add the keys in (a range of) a partition's index to its filter.
+ *
+ */
+static void filter_keys(pal_writer_t *writer, struct pal_writer_partition *partition, char *index, int32_t num_slots) {
+  int32_t key_size = partition->key_size;
+  int32_t bucket_slots = 1;
+  int32_t keys_offset = 0;
+  if (writer->bucketized) {
+    bucket_slots = (unsigned char) index[0];
+    keys_offset = bucket_slots * (1 + (unsigned char) index[1]);
+    index += PAL_LINE_SIZE;
+  }
+  int32_t i, j;
+  for (i = 0; i < num_slots; i++) {
+    char *slot = index + (int64_t) i * partition->slot_size;
+    for (j = 0; j < bucket_slots; j++) {
+      char *key;
+      if (writer->bucketized) {
+        if (!slot[j]) {
+          continue; // Empty slot.
+        }
+        key = slot + keys_offset + j * key_size;
+      } else {
+        if (!slot[key_size]) {
+          continue;
+        }
+        key = slot;
+      }
+      int32_t hash = pal_hash(key, key_size);
+      pal_filter_add(
+        partition->filter + (int64_t) pal_filter_block(hash, partition->filter_blocks) * PAL_FILTER_BLOCK_SIZE,
+        pal_remix(hash)
+      );
+    }
+  }
+}
+
+/**
+ * Build a partition's membership filter from the keys in its index.
+ *
+ */
+static char build_filter(pal_writer_t *writer, struct pal_writer_partition *partition) {
+  if (init_filter(writer, partition)) {
+    return -1;
+  }
+  if (partition->filter_blocks) {
+    filter_keys(writer, partition, partition->index, partition->num_slots);
+  }
+  return 0;
+}
+
+// Memory-bounded builds (see `memory_budget`).
+
+/**
+ * Append an item to a temporary file: its key followed by its hash, data
+ * offset, and sequence number (in native byte order), `key_size + 20` bytes.
+ *
+ */
+static char write_item(FILE *file, char *key, int32_t key_size, int32_t hash, int64_t offset, int64_t seq) {
+  return (
+    fwrite(key, 1, key_size, file) < (size_t) key_size ||
+    fwrite(&hash, 4, 1, file) < 1 ||
+    fwrite(&offset, 8, 1, file) < 1 ||
+    fwrite(&seq, 8, 1, file) < 1
+  ) ? -1 : 0;
+}
+
+static int32_t item_hash(char *item, int32_t key_size) {
+  int32_t hash;
+  memcpy(&hash, item + key_size, 4);
+  return hash;
+}
+
+static int64_t item_offset(char *item, int32_t key_size) {
+  int64_t offset;
+  memcpy(&offset, item + key_size + 4, 8);
+  return offset;
+}
+
+static int64_t item_seq(char *item, int32_t key_size) {
+  int64_t seq;
+  memcpy(&seq, item + key_size + 12, 8);
+  return seq;
+}
+
+/**
+ * Move all the items held in memory to their partitions' temporary files.
+ *
+ */
+static char spill_items(pal_writer_t *writer) {
+  int32_t i;
+  for (i = 0; i <= writer->max_key_size; i++) {
+    struct pal_writer_partition *partition = writer->partitions[i];
+    if (partition == NULL) {
+      continue;
+    }
+    int32_t key_size = partition->key_size;
+    int64_t j;
+    for (j = partition->num_spilled; j < partition->num_items; j++) {
+      int64_t k = j - partition->num_spilled;
+      if (
+        (partition->spilled == NULL && (partition->spilled = open_tmp(writer->tmp_dir)) == NULL) ||
+        write_item(partition->spilled, partition->keys + k * key_size, key_size, partition->hashes[k], partition->offsets[k], j)
+      ) {
+        PAL_ERRNO = WRITE_FAIL;
+        return -1;
+      }
+    }
+    partition->num_spilled = partition->num_items;
+    free(partition->keys);
+    free(partition->offsets);
+    free(partition->hashes);
+    partition->keys = NULL;
+    partition->offsets = NULL;
+    partition->hashes = NULL;
+    partition->capacity = 0;
+  }
+  writer->buffered_size = 0;
+  return 0;
+}
+
+/**
+ * Append an item to a growable array of items.
+ *
+ */
+static char push_item(char **items, int64_t *num_items, int64_t *capacity, char *item, int32_t item_size) {
+  if (*num_items == *capacity) {
+    int64_t n = *capacity ? 2 * *capacity : MIN_CAPACITY;
+    char *grown = realloc(*items, n * item_size);
+    if (grown == NULL) {
+      return -1;
+    }
+    *items = grown;
+    *capacity = n;
+  }
+  memcpy(*items + *num_items * item_size, item, item_size);
+  (*num_items)++;
+  return 0;
+}
+
+/**
+ * Read a temporary file's next `n` items into a growable array.
+ *
+ */
+static char read_items(FILE *file, int64_t n, int32_t item_size, char **items, int64_t *capacity) {
+  if (n > *capacity) {
+    char *grown = realloc(*items, n * item_size);
+    if (grown == NULL) {
+      PAL_ERRNO = ALLOC_FAIL;
+      return -1;
+    }
+    *items = grown;
+    *capacity = n;
+  }
+  if (n && fread(*items, item_size, n, file) < (size_t) n) {
+    PAL_ERRNO = WRITE_FAIL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Build a partition's (linear probing) index from its spilled items, a range
+ * of slots (chunk) at a time, into a temporary file. The index is identical to
+ * the one `build_index` would produce.
+ *
+ * Items are first sorted by chunk (of their home slot) into a temporary file,
+ * keeping each chunk's in insertion order. This takes a pass over the spilled
+ * items per `MAX_CHUNK_FILES` chunks, which distributes them to one temporary
+ * file per chunk, appended in order at its end. Each chunk is then built by
+ * inserting its items merged (by sequence number) with those which probed
+ * past the end of the previous chunk, and which continue probing from its
+ * first slot. Keys probing past the end of the last chunk wrap around to the
+ * first, which is then rebuilt, followed by any chunks whose incoming keys
+ * changed. Adding keys only ever pushes others further, so a chunk's incoming
+ * keys are unchanged as soon as their number is.
+ *
+ * Chunks are sized so that their slots and items fit in the memory budget
+ * (the filter, if any, is still held in memory whole, as are a few counters
+ * per chunk).
+ *
+ */
+static char build_chunks(pal_writer_t *writer, struct pal_writer_partition *partition) {
+  if (size_index(writer, partition, writer->load_factor)) {
+    return -1;
+  }
+  int32_t key_size = partition->key_size;
+  int32_t slot_size = partition->slot_size;
+  int32_t item_size = key_size + 20;
+  int64_t num_slots = partition->num_slots;
+  int64_t num_chunks = (
+    partition->index_size + partition->num_items * item_size +
+    writer->memory_budget - 1
+  ) / writer->memory_budget;
+  if (num_chunks > num_slots) {
+    num_chunks = num_slots;
+  }
+  int64_t chunk_slots = (num_slots + num_chunks - 1) / num_chunks;
+  num_chunks = (num_slots + chunk_slots - 1) / chunk_slots;
+
+  int64_t num_files = num_chunks < MAX_CHUNK_FILES ? num_chunks : MAX_CHUNK_FILES;
+  FILE **files = calloc(num_files, sizeof *files);
+  FILE *sorted = NULL; // Items, by chunk.
+  int64_t *chunk_starts = malloc(num_chunks * sizeof *chunk_starts);
+  int64_t *chunk_items = calloc(num_chunks, sizeof *chunk_items);
+  int64_t *chunk_keys = calloc(num_chunks, sizeof *chunk_keys);
+  int64_t *carried = malloc(num_chunks * sizeof *carried);
+  char *index = malloc(chunk_slots * slot_size);
+  char *items = NULL;
+  int64_t items_capacity = 0;
+  char *carry = NULL; // Items probing into the current chunk.
+  int64_t num_carried = 0;
+  int64_t carry_capacity = 0;
+  char *next = NULL; // Items probing past its end.
+  int64_t num_next = 0;
+  int64_t next_capacity = 0;
+  char ret = -1;
+  int64_t i, j;
+  if (
+    files == NULL ||
+    chunk_starts == NULL ||
+    chunk_items == NULL ||
+    chunk_keys == NULL ||
+    carried == NULL ||
+    index == NULL ||
+    (items = malloc(item_size)) == NULL
+  ) {
+    PAL_ERRNO = ALLOC_FAIL;
+    goto cleanup;
+  }
+  for (i = 0; i < num_chunks; i++) {
+    carried[i] = -1; // Not built yet.
+  }
+  partition->index_file = open_tmp(writer->tmp_dir);
+  sorted = open_tmp(writer->tmp_dir);
+  if (
+    partition->index_file == NULL ||
+    sorted == NULL ||
+    fflush(partition->spilled)
+  ) {
+    goto write_error;
+  }
+
+  int64_t first_chunk;
+  int64_t num_sorted = 0;
+  for (first_chunk = 0; first_chunk < num_chunks; first_chunk += num_files) {
+    int64_t end_chunk = num_chunks - first_chunk < num_files ?
+      num_chunks :
+      first_chunk + num_files;
+    if (fseek(partition->spilled, 0, SEEK_SET)) {
+      goto write_error;
+    }
+    for (i = 0; i < partition->num_items; i++) {
+      if (fread(items, item_size, 1, partition->spilled) < 1) {
+        goto write_error;
+      }
+      int64_t chunk = home_slot(partition, item_hash(items, key_size)) / chunk_slots;
+      if (chunk < first_chunk || chunk >= end_chunk) {
+        continue;
+      }
+      FILE **file = files + (chunk - first_chunk);
+      if (
+        (*file == NULL && (*file = open_tmp(writer->tmp_dir)) == NULL) ||
+        fwrite(items, item_size, 1, *file) < 1
+      ) {
+        goto write_error;
+      }
+      chunk_items[chunk]++;
+    }
+    for (i = first_chunk; i < end_chunk; i++) {
+      FILE **file = files + (i - first_chunk);
+      chunk_starts[i] = num_sorted;
+      num_sorted += chunk_items[i];
+      if (*file == NULL) {
+        continue;
+      }
+      if (
+        fflush(*file) ||
+        fseek(*file, 0, SEEK_SET)
+      ) {
+        goto write_error;
+      }
+      if (read_items(*file, chunk_items[i], item_size, &items, &items_capacity)) {
+        goto cleanup;
+      }
+      if (fwrite(items, item_size, chunk_items[i], sorted) < (size_t) chunk_items[i]) {
+        goto write_error;
+      }
+      fclose(*file);
+      *file = NULL;
+    }
+  }
+  fclose(partition->spilled); // Free its disk space early.
+  partition->spilled = NULL;
+  if (fflush(sorted)) {
+    goto write_error;
+  }
+
+  int64_t chunk = 0;
+  while (carried[chunk] != num_carried) {
+    int64_t first_slot = chunk * chunk_slots;
+    int64_t len = num_slots - first_slot < chunk_slots ?
+      num_slots - first_slot :
+      chunk_slots;
+    int64_t n = chunk_items[chunk];
+    if (fseek(sorted, chunk_starts[chunk] * item_size, SEEK_SET)) {
+      goto write_error;
+    }
+    if (read_items(sorted, n, item_size, &items, &items_capacity)) {
+      goto cleanup;
+    }
+
+    memset(index, 0, len * slot_size);
+    chunk_keys[chunk] = 0;
+    num_next = 0;
+    j = 0;
+    int64_t k = 0;
+    while (j < n || k < num_carried) {
+      char *item;
+      int64_t slot;
+      if (
+        k == num_carried ||
+        (j < n && item_seq(items + j * item_size, key_size) < item_seq(carry + k * item_size, key_size))
+      ) {
+        item = items + j++ * item_size;
+        slot = home_slot(partition, item_hash(item, key_size)) - first_slot;
+      } else {
+        item = carry + k++ * item_size;
+        slot = 0;
+      }
+      slot = probe_slots(partition, index, item, slot, len);
+      if (slot == len) {
+        if (push_item(&next, &num_next, &next_capacity, item, item_size)) {
+          PAL_ERRNO = ALLOC_FAIL;
+          goto cleanup;
+        }
+        continue;
+      }
+      // There are no deletions (see `pal_writer_put_hashed`).
+      char added = set_slot(writer, partition, index + slot * slot_size, item, item_offset(item, key_size));
+      if (added < 0) {
+        goto cleanup;
+      }
+      chunk_keys[chunk] += added;
+    }
+    if (
+      fseek(partition->index_file, first_slot * slot_size, SEEK_SET) ||
+      fwrite(index, slot_size, len, partition->index_file) < (size_t) len
+    ) {
+      goto write_error;
+    }
+
+    carried[chunk] = num_carried;
+    char *swap = carry;
+    carry = next;
+    next = swap;
+    int64_t capacity = carry_capacity;
+    carry_capacity = next_capacity;
+    next_capacity = capacity;
+    num_carried = num_next;
+    chunk = (chunk + 1) % num_chunks;
+  }
+  for (i = 0; i < num_chunks; i++) {
+    partition->num_keys += chunk_keys[i];
+  }
+
+  if (writer->filter_bits) {
+    if (init_filter(writer, partition)) {
+      goto cleanup;
+    }
+    if (partition->filter_blocks) {
+      if (fflush(partition->index_file) || fseek(partition->index_file, 0, SEEK_SET)) {
+        goto write_error;
+      }
+      for (i = 0; i < num_chunks; i++) {
+        int64_t len = num_slots - i * chunk_slots < chunk_slots ?
+          num_slots - i * chunk_slots :
+          chunk_slots;
+        if (fread(index, slot_size, len, partition->index_file) < (size_t) len) {
+          goto write_error;
+        }
+        filter_keys(writer, partition, index, len);
+      }
+    }
+  }
+  ret = 0;
+  goto cleanup;
+
+write_error:
+  PAL_ERRNO = WRITE_FAIL;
+cleanup:
+  if (files != NULL) {
+    for (i = 0; i < num_files; i++) {
+      if (files[i] != NULL) {
+        fclose(files[i]);
+      }
+    }
+  }
+  free(files);
+  if (sorted != NULL) {
+    fclose(sorted);
+  }
+  free(chunk_starts);
+  free(chunk_items);
+  free(chunk_keys);
+  free(carried);
+  free(index);
+  free(items);
+  free(carry);
+  free(next);
+  return ret;
+}
+
+// Key directory.
+
+// Reference to a key within the indices, sorted to build the directory.
+struct ordered_key {
+  char *key;
+  int32_t key_size;
+  int32_t offset; // Relative to the start of the indices.
+};
+
+/**
+ * Byte order, shorter keys first when one is a prefix of the other.
+ *
+ */
+static int compare_keys(const void *a, const void *b) {
+  const struct ordered_key *k1 = a;
+  const struct ordered_key *k2 = b;
+  int32_t len = k1->key_size < k2->key_size ? k1->key_size : k2->key_size;
+  int cmp = memcmp(k1->key, k2->key, len);
+  return cmp ? cmp : (k1->key_size > k2->key_size) - (k1->key_size < k2->key_size);
+}
+
+/**
+ * Append references to all the keys in a partition's (built) index.
+ *
+ * Returns the next free reference.
+ *
+ */
+static struct ordered_key *collect_keys(pal_writer_t *writer, struct pal_writer_partition *partition, int32_t index_offset, struct ordered_key *keys) {
+  int32_t key_size = partition->key_size;
+  char *index = partition->index;
+  int32_t bucket_slots = 1;
+  int32_t keys_offset = 0;
+  if (writer->bucketized) {
+    bucket_slots = (unsigned char) index[0];
+    keys_offset = bucket_slots * (1 + (unsigned char) index[1]);
+    index += PAL_LINE_SIZE;
+  }
+  int32_t i, j;
+  for (i = 0; i < partition->num_slots; i++) {
+    char *slot = index + (int64_t) i * partition->slot_size;
+    for (j = 0; j < bucket_slots; j++) {
+      char *key;
+      if (writer->bucketized) {
+        if (!slot[j]) {
+          continue; // Empty slot.
+        }
+        key = slot + keys_offset + j * key_size;
+      } else {
+        if (!slot[key_size]) {
+          continue;
+        }
+        key = slot;
+      }
+      keys->key = key;
+      keys->key_size = key_size;
+      keys->offset = index_offset + (key - partition->index);
+      keys++;
+    }
+  }
+  return keys;
+}
+
+/**
+ * Build the key directory: every key's reference, in byte order.
+ *
+ * Returns NULL on allocation failure.
+ *
+ */
+static struct ordered_key *build_directory(pal_writer_t *writer, int32_t num_keys) {
+  struct ordered_key *keys = malloc(((size_t) num_keys + 1) * sizeof *keys);
+  if (keys == NULL) {
+    PAL_ERRNO = ALLOC_FAIL;
+    return NULL;
+  }
+  struct ordered_key *next = keys;
+  int32_t index_offset = 0;
+  int32_t i;
+  for (i = 0; i <= writer->max_key_size; i++) {
+    struct pal_writer_partition *partition = writer->partitions[i];
+    if (partition != NULL) {
+      next = collect_keys(writer, partition, index_offset, next);
+      index_offset += partition->index_size;
+    }
+  }
+  qsort(keys, num_keys, sizeof *keys, compare_keys);
+  return keys;
+}
+
+// Partitions.
+
+/**
+ * Finish writing a partition's data, then build its index and filter.
+ *
+ */
+static char build_partition(pal_writer_t *writer, struct pal_writer_partition *partition) {
+  if (writer->block_size) {
+    if (flush_block(partition)) {
+      return -1;
+    }
+    partition->data_size += 4 + 8 * ((int64_t) partition->num_blocks + 1);
+  }
+  if (writer->memory_budget) {
+    return build_chunks(writer, partition); // Also builds the filter.
+  }
+  if (
+    writer->bucketized ?
+      build_buckets(writer, partition) :
+      build_index(writer, partition, writer->load_factor)
+  ) {
+    return -1;
+  }
+  return writer->filter_bits ? build_filter(writer, partition) : 0;
+}
+
+// Partitions built by a pool of threads (see `build_partitions`).
+struct partition_tasks {
+  pal_writer_t *writer;
+  struct pal_writer_partition **partitions;
+};
+
+static char run_partition(void *arg, int64_t task) {
+  struct partition_tasks *tasks = arg;
+  return build_partition(tasks->writer, tasks->partitions[task]);
+}
+
+/**
+ * Build all partitions. Small partitions are built concurrently, one per
+ * thread, then large ones in turn, each on all threads (see `build_ranges`).
+ *
+ */
+static char build_partitions(pal_writer_t *writer) {
+  struct partition_tasks tasks;
+  tasks.writer = writer;
+  tasks.partitions = malloc((writer->max_key_size + 1) * sizeof *tasks.partitions);
+  if (tasks.partitions == NULL) {
+    PAL_ERRNO = ALLOC_FAIL;
+    return -1;
+  }
+  int32_t num_small = 0;
+  int32_t num_large = 0;
+  int32_t i;
+  for (i = 0; i <= writer->max_key_size; i++) {
+    struct pal_writer_partition *partition = writer->partitions[i];
+    if (partition == NULL) {
+      continue;
+    }
+    if (writer->num_threads > 1 && partition->num_items >= PARALLEL_MIN_ITEMS) {
+      // Filled from the end.
+      tasks.partitions[writer->max_key_size - num_large++] = partition;
+    } else {
+      tasks.partitions[num_small++] = partition;
+    }
+  }
+  char ret = run_tasks(writer->num_threads, num_small, run_partition, &tasks);
+  for (i = 0; !ret && i < num_large; i++) {
+    ret = build_partition(writer, tasks.partitions[writer->max_key_size - i]);
+  }
+  free(tasks.partitions);
+  return ret;
+}
+
+// Public API.
+
+pal_writer_t *pal_writer_init(const char *path, const pal_writer_options_t *opts) {
+  pal_writer_options_t defaults = {0};
+  if (opts == NULL) {
+    opts = &defaults;
+  }
+  double load_factor = opts->load_factor;
+  if (!load_factor) {
+    load_factor = opts->bucketized ?
+      DEFAULT_BUCKETIZED_LOAD_FACTOR :
+      DEFAULT_LOAD_FACTOR;
+  }
+  if (
+    load_factor <= 0 ||
+    load_factor > 1 ||
+    opts->filter_bits < 0 ||
+    opts->filter_bits > PAL_MAX_FILTER_BITS ||
+    opts->block_size < 0 ||
+    opts->block_size > MAX_BLOCK_SIZE ||
+    opts->metadata_len < 0 ||
+    opts->memory_budget < 0 ||
+    opts->num_threads < 0 ||
+    (opts->memory_budget && (opts->bucketized || opts->ordered))
+  ) {
+    PAL_ERRNO = INVALID_DATA;
+    return NULL;
+  }
+
+  pal_writer_t *w = calloc(1, sizeof *w);
+  if (w == NULL) {
+    PAL_ERRNO = ALLOC_FAIL;
+    return NULL;
+  }
+  w->load_factor = load_factor;
+  w->no_distinct = opts->no_distinct;
+  w->bucketized = opts->bucketized;
+  w->filter_bits = opts->filter_bits;
+  w->block_size = opts->block_size;
+  w->ordered = opts->ordered;
+  w->memory_budget = opts->memory_budget;
+  // Chunked builds keep to the budget by building one partition at a time.
+  w->num_threads = opts->num_threads && !opts->memory_budget ?
+    opts->num_threads :
+    1;
+  w->values.capacity = opts->value_cache_size ?
+    opts->value_cache_size :
+    DEFAULT_VALUE_CACHE_SIZE;
+  w->max_key_size = -1;
+  w->metadata_size = opts->metadata_len;
+  w->path = strdup(path);
+  w->tmp_dir = opts->tmp_dir == NULL ? NULL : strdup(opts->tmp_dir);
+  w->metadata = malloc(w->metadata_size + 1); // Avoid zero-sized allocations.
+  if (
+    w->path == NULL ||
+    (opts->tmp_dir != NULL && w->tmp_dir == NULL) ||
+    w->metadata == NULL
+  ) {
+    PAL_ERRNO = ALLOC_FAIL;
+    pal_writer_destroy(w);
+    return NULL;
+  }
+  if (w->metadata_size) {
+    memcpy(w->metadata, opts->metadata, w->metadata_size);
+  }
+  return w;
+}
+
+int pal_writer_put(pal_writer_t *writer, char *key, int32_t key_len, char *value, int64_t value_len) {
+  if (key_len <= 0) {
+    PAL_ERRNO = INVALID_DATA;
+    return -1;
+  }
+  return pal_writer_put_hashed(writer, key, key_len, pal_hash(key, key_len), value, value_len);
+}
+
+int pal_writer_put_hashed(pal_writer_t *writer, char *key, int32_t key_len, int32_t hash, char *value, int64_t value_len) {
+  if (
+    key_len <= 0 ||
+    (value != NULL && value_len < 0) ||
+    (value == NULL && writer->memory_budget)
+  ) {
+    PAL_ERRNO = INVALID_DATA;
+    return -1;
+  }
+
+  struct pal_writer_partition *partition = get_partition(writer, key_len);
+  if (partition == NULL) {
+    return -1;
+  }
+  if (partition->num_items - partition->num_spilled == partition->capacity) {
+    // Spill all items first if growing would exceed the memory budget.
+    int64_t item_size = key_len + 12;
+    int64_t growth = partition->capacity ? partition->capacity : MIN_CAPACITY;
+    if (
+      writer->memory_budget &&
+      writer->buffered_size + growth * item_size > writer->memory_budget &&
+      spill_items(writer)
+    ) {
+      return -1;
+    }
+    int64_t capacity = partition->capacity;
+    if (grow_partition(partition)) {
+      PAL_ERRNO = ALLOC_FAIL;
+      return -1;
+    }
+    writer->buffered_size += (partition->capacity - capacity) * item_size;
+  }
+
+  int64_t offset = 0; // Delete key signal.
+  int32_t value_hash = 0;
+  if (value != NULL && value_len <= INT32_MAX) {
+    value_hash = pal_hash(value, value_len);
+    offset = cached_offset(&writer->values, key_len, value_hash, value, value_len);
+  }
+  if (offset) {
+    // Identical value already written, point to it.
+    writer->num_values++;
+  } else if (value != NULL) {
+    char header[10];
+    size_t header_size = pack_int64(header, value_len) - header;
+    if (writer->block_size) {
+      if (append_value(writer, partition, header, header_size, value, value_len, &offset)) {
+        return -1;
+      }
+    } else {
+      if (
+        fwrite(header, 1, header_size, partition->data) < header_size ||
+        fwrite(value, 1, value_len, partition->data) < (size_t) value_len
+      ) {
+        PAL_ERRNO = WRITE_FAIL;
+        return -1;
+      }
+      offset = partition->data_size;
+      partition->data_size += header_size + value_len;
+    }
+    writer->num_values++;
+    if (value_len <= INT32_MAX) {
+      cache_value(&writer->values, key_len, value_hash, value, value_len, offset);
+    }
+  }
+
+  int64_t item = partition->num_items++ - partition->num_spilled;
+  memcpy(partition->keys + item * key_len, key, key_len);
+  partition->offsets[item] = offset;
+  partition->hashes[item] = hash;
+  return 0;
+}
+
+/**
+ * The file is written in the same `VERSION_1` format `pal_init` reads (see
+ * `reader.c` for details), or `VERSION_2` for bucketized indices (`VERSION_3`
+ * and `VERSION_4` respectively if the data is compressed). Index
+ * offsets are relative to the start of the file, since there is no leading
+ * data.
+ *
+ */
+int pal_writer_close(pal_writer_t *writer, pal_statistics_t *stats) {
+  int32_t num_keys = 0;
+  int32_t num_partitions = 0;
+  int32_t num_filters = 0;
+  int64_t index_size = 0;
+  int64_t filters_size = 0;
+  int64_t data_size = 0;
+  int32_t i;
+  clear_value_cache(&writer->values); // No longer needed.
+  if (writer->memory_budget && spill_items(writer)) {
+    return -1;
+  }
+  if (build_partitions(writer)) {
+    return -1;
+  }
+  for (i = 0; i <= writer->max_key_size; i++) {
+    struct pal_writer_partition *partition = writer->partitions[i];
+    if (partition != NULL) {
+      if (partition->filter_blocks) {
+        num_filters++;
+        filters_size += (int64_t) partition->filter_blocks * PAL_FILTER_BLOCK_SIZE;
+      }
+      num_keys += partition->num_keys;
+      num_partitions++;
+      index_size += partition->index_size;
+      data_size += partition->data_size;
+    }
+  }
+  if (index_size > INT32_MAX) {
+    PAL_ERRNO = INVALID_DATA;
+    return -1;
+  }
+  struct ordered_key *keys = NULL;
+  if (writer->ordered && (keys = build_directory(writer, num_keys)) == NULL) {
+    return -1;
+  }
+
+  FILE *file = fopen(writer->path, "wb");
+  if (file == NULL) {
+    free(keys);
+    PAL_ERRNO = NO_FILE;
+    return -1;
+  }
+
+  // Header, the version reflects the index and data formats.
+  int64_t timestamp = now();
+  int64_t offset = 31;
+  char version[] = "\x00\x09VERSION_1";
+  version[10] += (writer->bucketized ? 1 : 0) + (writer->block_size ? 2 : 0);
+  if (
+    fwrite(version, 1, 11, file) < 11 ||
+    write_int64(file, timestamp) ||
+    write_int32(file, writer->num_values) ||
+    write_int32(file, num_partitions) ||
+    write_int32(file, writer->max_key_size)
+  ) {
+    goto write_error;
+  }
+
+  // Partitions.
+  int32_t index_offset = 0;
+  int64_t data_offset = 0;
+  for (i = 0; i <= writer->max_key_size; i++) {
+    struct pal_writer_partition *partition = writer->partitions[i];
+    if (partition == NULL) {
+      continue;
+    }
+    if (
+      write_int32(file, partition->key_size) ||
+      write_int32(file, partition->num_keys) ||
+      write_int32(file, partition->num_slots) ||
+      write_int32(file, partition->slot_size) ||
+      write_int32(file, index_offset) ||
+      write_int64(file, data_offset)
+    ) {
+      goto write_error;
+    }
+    offset += 28;
+    index_offset += partition->index_size;
+    data_offset += partition->data_size;
+  }
+
+  // Metadata and section offsets, followed by filters and the key directory
+  // if any (both headers first). Filter blocks and bucketized indices are
+  // padded to start on a line boundary (mappings are page aligned, so blocks
+  // and buckets then start on cache lines).
+  offset += 4 + writer->metadata_size + 12;
+  if (num_filters) {
+    offset += 7 + 4 + 12 * num_filters;
+  }
+  if (writer->ordered) {
+    offset += 7 + 4 + 4;
+  }
+  int64_t filters_padding = 0;
+  int64_t filters_offset = offset;
+  if (num_filters) {
+    filters_padding = (PAL_LINE_SIZE - offset % PAL_LINE_SIZE) % PAL_LINE_SIZE;
+    filters_offset = offset + filters_padding;
+    offset = filters_offset + filters_size;
+  }
+  int64_t directory_offset = offset;
+  if (writer->ordered) {
+    offset += 8 * (int64_t) num_keys;
+  }
+  int64_t padding = writer->bucketized ?
+    (PAL_LINE_SIZE - offset % PAL_LINE_SIZE) % PAL_LINE_SIZE :
+    0;
+  if (offset + padding + index_size > INT32_MAX) {
+    PAL_ERRNO = INVALID_DATA;
+    fclose(file);
+    free(keys);
+    return -1;
+  }
+  if (
+    write_int32(file, writer->metadata_size) ||
+    fwrite(writer->metadata, 1, writer->metadata_size, file) < (size_t) writer->metadata_size ||
+    write_int32(file, offset + padding) ||
+    write_int64(file, offset + padding + index_size)
+  ) {
+    goto write_error;
+  }
+  if (num_filters) {
+    if (fwrite("FILTERS", 1, 7, file) < 7 || write_int32(file, num_filters)) {
+      goto write_error;
+    }
+    for (i = 0; i <= writer->max_key_size; i++) {
+      struct pal_writer_partition *partition = writer->partitions[i];
+      if (partition == NULL || !partition->filter_blocks) {
+        continue;
+      }
+      if (
+        write_int32(file, partition->key_size) ||
+        write_int32(file, partition->filter_blocks) ||
+        write_int32(file, filters_offset)
+      ) {
+        goto write_error;
+      }
+      filters_offset += (int64_t) partition->filter_blocks * PAL_FILTER_BLOCK_SIZE;
+    }
+  }
+  if (
+    writer->ordered && (
+      fwrite("ORDERED", 1, 7, file) < 7 ||
+      write_int32(file, num_keys) ||
+      write_int32(file, directory_offset)
+    )
+  ) {
+    goto write_error;
+  }
+  if (num_filters) {
+    if (write_padding(file, filters_padding)) {
+      goto write_error;
+    }
+    for (i = 0; i <= writer->max_key_size; i++) {
+      struct pal_writer_partition *partition = writer->partitions[i];
+      if (partition == NULL || !partition->filter_blocks) {
+        continue;
+      }
+      size_t size = (size_t) partition->filter_blocks * PAL_FILTER_BLOCK_SIZE;
+      if (fwrite(partition->filter, 1, size, file) < size) {
+        goto write_error;
+      }
+    }
+  }
+  if (keys != NULL) {
+    for (i = 0; i < num_keys; i++) {
+      if (write_int32(file, keys[i].key_size) || write_int32(file, keys[i].offset)) {
+        goto write_error;
+      }
+    }
+  }
+  if (write_padding(file, padding)) {
+    goto write_error;
+  }
+
+  // Indices, then data.
+  for (i = 0; i <= writer->max_key_size; i++) {
+    struct pal_writer_partition *partition = writer->partitions[i];
+    if (partition == NULL) {
+      continue;
+    }
+    size_t size = partition->index_size;
+    if (
+      partition->index_file != NULL ?
+        copy_file(partition->index_file, file) :
+        fwrite(partition->index, 1, size, file) < size
+    ) {
+      goto write_error;
+    }
+  }
+  for (i = 0; i <= writer->max_key_size; i++) {
+    struct pal_writer_partition *partition = writer->partitions[i];
+    if (partition == NULL) {
+      continue;
+    }
+    if (
+      (writer->block_size && write_blocks_table(file, partition)) ||
+      copy_file(partition->data, file)
+    ) {
+      goto write_error;
+    }
+  }
+
+  free(keys);
+  if (fclose(file)) {
+    PAL_ERRNO = WRITE_FAIL;
+    return -1;
+  }
+
+  if (stats != NULL) {
+    stats->timestamp = timestamp;
+    stats->num_keys = num_keys;
+    stats->num_values = writer->num_values;
+    stats->index_size = index_size;
+    stats->data_size = data_size;
+  }
+  return 0;
+
+write_error:
+  fclose(file);
+  free(keys);
+  PAL_ERRNO = WRITE_FAIL;
+  return -1;
+}
+
+void pal_writer_destroy(pal_writer_t *writer) {
+  int32_t i;
+  for (i = 0; i <= writer->max_key_size; i++) {
+    struct pal_writer_partition *partition = writer->partitions[i];
+    if (partition != NULL) {
+      fclose(partition->data);
+      if (partition->spilled != NULL) {
+        fclose(partition->spilled);
+      }
+      if (partition->index_file != NULL) {
+        fclose(partition->index_file);
+      }
+      free(partition->keys);
+      free(partition->offsets);
+      free(partition->hashes);
+      free(partition->index);
+      free(partition->filter);
+      free(partition->block_offsets);
+      free(partition->block);
+      free(partition);
+    }
+  }
+  free(writer->partitions);
+  clear_value_cache(&writer->values);
+  free(writer->metadata);
+  free(writer->tmp_dir);
+  free(writer->path);
+  free(writer);
+}
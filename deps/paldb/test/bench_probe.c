@@ -0,0 +1,122 @@
+#define _POSIX_C_SOURCE 200809L // For `clock_gettime`.
+
+#include "../include/paldb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * Probe loop benchmark.
+ *
+ * Builds a store per key size and index format, and measures `pal_get`
+ * throughput on random hits, keeping the best of a few rounds. Keys are
+ * generated from a fixed seed, so that runs of different builds probe
+ * identical stores.
+ *
+ * Usage: bench_probe [NUM_KEYS] [NUM_READS]
+ *
+ */
+
+#define NUM_ROUNDS 5
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int bench(int32_t key_size, char bucketized, int32_t num_keys, int32_t num_reads) {
+  char path[] = "/tmp/pal-bench-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    return -1;
+  }
+
+  char *keys = malloc((size_t) num_keys * key_size);
+  if (keys == NULL) {
+    return -1;
+  }
+  int32_t i, j;
+  for (i = 0; i < num_keys; i++) {
+    char *key = keys + (size_t) i * key_size;
+    for (j = 0; j < key_size; j++) {
+      key[j] = rand();
+    }
+    memcpy(key, &i, key_size < 4 ? key_size : 4); // Ensure uniqueness.
+  }
+
+  pal_writer_options_t opts;
+  memset(&opts, 0, sizeof opts);
+  opts.bucketized = bucketized;
+  pal_writer_t *writer = pal_writer_init(path, &opts);
+  if (writer == NULL) {
+    return -1;
+  }
+  for (i = 0; i < num_keys; i++) {
+    if (pal_writer_put(writer, keys + (size_t) i * key_size, key_size, "", 0)) {
+      return -1;
+    }
+  }
+  if (pal_writer_close(writer, NULL)) {
+    return -1;
+  }
+  pal_writer_destroy(writer);
+
+  pal_reader_t *reader = pal_init(path);
+  if (reader == NULL) {
+    return -1;
+  }
+  int32_t *order = malloc(num_reads * sizeof *order);
+  for (i = 0; i < num_reads; i++) {
+    order[i] = rand() % num_keys;
+  }
+
+  char *value;
+  int64_t value_len;
+  int32_t found = 0;
+  double best = 0;
+  int round;
+  for (round = 0; round < NUM_ROUNDS; round++) {
+    found = 0;
+    double begin = now();
+    for (i = 0; i < num_reads; i++) {
+      char *key = keys + (size_t) order[i] * key_size;
+      found += pal_get(reader, key, key_size, &value, &value_len);
+    }
+    double rate = found / (now() - begin);
+    if (rate > best) {
+      best = rate;
+    }
+  }
+  printf(
+    "key size %2d, %-10s index: %.2e reads/sec\n",
+    key_size, bucketized ? "bucketized" : "linear", best
+  );
+
+  pal_destroy(reader);
+  free(order);
+  free(keys);
+  close(fd);
+  unlink(path);
+  return found == num_reads ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+  int32_t num_keys = argc > 1 ? atoi(argv[1]) : 1000000;
+  int32_t num_reads = argc > 2 ? atoi(argv[2]) : 10000000;
+  int32_t key_sizes[] = {4, 8, 10, 16, 32};
+  size_t i;
+  char bucketized;
+  srand(1);
+  for (i = 0; i < sizeof key_sizes / sizeof key_sizes[0]; i++) {
+    for (bucketized = 0; bucketized < 2; bucketized++) {
+      if (bench(key_sizes[i], bucketized, num_keys, num_reads)) {
+        printf("benchmark failed\n");
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,431 @@
+#define _POSIX_C_SOURCE 200809L // For `clock_gettime` and `getopt`.
+
+#include "../include/paldb.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BATCH_SIZE 256
+
+/**
+ * Reader benchmark.
+ *
+ * Generates a store with the given number of keys (of random sizes between
+ * the minimum and maximum key size, each mapped to a distinct value of fixed
+ * size),
+ * then runs lookups against it under several workloads:
+ *
+ * + `uniform`, all keys equally likely.
+ * + `zipf`, key popularity follows a Zipfian distribution (of exponent
+ *   `SKEW`), as is typical of caches and other read-heavy services.
+ * + `miss`, a uniform workload where a fraction `MISS_RATIO` of the keys looked
+ *   up are absent from the store.
+ *
+ * Each workload is run twice over the same sequence of keys: once to measure
+ * throughput (both with `pal_get` and `pal_get_batch`), once timing each
+ * lookup individually to compute latency percentiles. The latter include the
+ * overhead of reading the clock (typically a few tens of nanoseconds). Pass
+ * `-b` to write a bucketized index, `-l` to set the index's load factor, `-f`
+ * to write membership filters with the given number of bits per key, and `-c`
+ * to compress values in blocks of the given size (lookups then copy values
+ * with `pal_read`, batched ones included).
+ *
+ * Usage: bench_reader [-n NUM_KEYS] [-k MIN_KEY_SIZE] [-K MAX_KEY_SIZE]
+ *                     [-v VALUE_SIZE] [-r NUM_READS] [-s SKEW]
+ *                     [-m MISS_RATIO] [-w WORKLOAD] [-l LOAD_FACTOR]
+ *                     [-f FILTER_BITS] [-c BLOCK_SIZE] [-b]
+ *
+ */
+
+struct options {
+  int32_t num_keys;
+  int32_t min_key_size;
+  int32_t max_key_size;
+  int64_t value_size;
+  int32_t num_reads;
+  double skew;
+  double miss_ratio;
+  const char *workload; // NULL for all.
+  pal_writer_options_t writer_opts;
+};
+
+/**
+ * Generated keys, contiguous (with stride `max_key_size`).
+ *
+ * The first `num_keys` are written to the store, the next `num_keys` are
+ * guaranteed to be absent from it.
+ *
+ */
+struct keys {
+  int32_t stride;
+  char *data;
+  int32_t *sizes;
+};
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t next_random(void) {
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static double next_double(void) {
+  return (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+static int generate_keys(struct keys *keys, struct options *opts) {
+  int32_t n = 2 * opts->num_keys;
+  keys->stride = opts->max_key_size;
+  keys->data = malloc((size_t) n * keys->stride);
+  keys->sizes = malloc(n * sizeof *keys->sizes);
+  if (keys->data == NULL || keys->sizes == NULL) {
+    return -1;
+  }
+
+  int32_t spread = opts->max_key_size - opts->min_key_size + 1;
+  int32_t i, j;
+  for (i = 0; i < n; i++) {
+    char *key = keys->data + (size_t) i * keys->stride;
+    int32_t size = opts->min_key_size + next_random() % spread;
+    for (j = 0; j < size; j++) {
+      key[j] = next_random();
+    }
+    memcpy(key, &i, 4); // Ensure uniqueness (the minimum key size is 4).
+    keys->sizes[i] = size;
+  }
+  return 0;
+}
+
+static int write_store(const char *path, struct keys *keys, struct options *opts) {
+  char *value = malloc(opts->value_size + 1);
+  if (value == NULL) {
+    return -1;
+  }
+  pal_writer_t *writer = pal_writer_init(path, &opts->writer_opts);
+  if (writer == NULL) {
+    free(value);
+    return -1;
+  }
+  int32_t i;
+  for (i = 0; i < opts->num_keys; i++) {
+    char *key = keys->data + (size_t) i * keys->stride;
+    // Distinct values (identical ones would be deduplicated), starting with
+    // the key's index followed by random letters (from a small alphabet, so
+    // that they compress somewhat).
+    int64_t j = snprintf(value, opts->value_size + 1, "%d:", i);
+    for (; j < opts->value_size; j++) {
+      value[j] = 'a' + next_random() % 16;
+    }
+    if (pal_writer_put(writer, key, keys->sizes[i], value, opts->value_size)) {
+      goto error;
+    }
+  }
+  if (pal_writer_close(writer, NULL)) {
+    goto error;
+  }
+  pal_writer_destroy(writer);
+  free(value);
+  return 0;
+
+error:
+  pal_writer_destroy(writer);
+  free(value);
+  return -1;
+}
+
+/**
+ * Fill `order` with indices of keys to look up.
+ *
+ */
+static int generate_order(int32_t *order, const char *workload, struct options *opts) {
+  int32_t n = opts->num_keys;
+  int32_t i;
+
+  if (!strcmp(workload, "uniform")) {
+    for (i = 0; i < opts->num_reads; i++) {
+      order[i] = next_random() % n;
+    }
+    return 0;
+  }
+
+  if (!strcmp(workload, "miss")) {
+    for (i = 0; i < opts->num_reads; i++) {
+      int32_t offset = next_double() < opts->miss_ratio ? n : 0;
+      order[i] = offset + next_random() % n;
+    }
+    return 0;
+  }
+
+  if (!strcmp(workload, "zipf")) {
+    // Sample ranks by inverting the cumulative distribution, then map ranks to
+    // random keys so that popular keys are spread across partitions and slots.
+    double *cdf = malloc(n * sizeof *cdf);
+    int32_t *ranks = malloc(n * sizeof *ranks);
+    if (cdf == NULL || ranks == NULL) {
+      free(cdf);
+      free(ranks);
+      return -1;
+    }
+    double total = 0;
+    for (i = 0; i < n; i++) {
+      total += 1 / pow(i + 1, opts->skew);
+      cdf[i] = total;
+      ranks[i] = i;
+    }
+    for (i = n - 1; i > 0; i--) {
+      int32_t j = next_random() % (i + 1);
+      int32_t rank = ranks[i];
+      ranks[i] = ranks[j];
+      ranks[j] = rank;
+    }
+    for (i = 0; i < opts->num_reads; i++) {
+      double target = next_double() * total;
+      int32_t lo = 0;
+      int32_t hi = n - 1;
+      while (lo < hi) {
+        int32_t mid = lo + (hi - lo) / 2;
+        if (cdf[mid] < target) {
+          lo = mid + 1;
+        } else {
+          hi = mid;
+        }
+      }
+      order[i] = ranks[lo];
+    }
+    free(cdf);
+    free(ranks);
+    return 0;
+  }
+
+  return -1;
+}
+
+/**
+ * Single lookup, copying the value from compressed stores (which `pal_get`
+ * can't reference).
+ *
+ */
+static int32_t lookup(pal_reader_t *reader, char *key, int32_t key_size, char *buf, int64_t buf_size) {
+  if (!pal_compressed(reader)) {
+    char *value;
+    int64_t value_size;
+    return pal_get(reader, key, key_size, &value, &value_size);
+  }
+  return pal_read(reader, key, key_size, pal_hash(key, key_size), buf, buf_size) >= 0;
+}
+
+static int bench(pal_reader_t *reader, struct keys *keys, const char *workload, struct options *opts) {
+  int32_t num_reads = opts->num_reads;
+  int32_t *order = malloc(num_reads * sizeof *order);
+  double *latencies = malloc(num_reads * sizeof *latencies);
+  char **batch_keys = malloc(BATCH_SIZE * sizeof *batch_keys);
+  int32_t *batch_key_sizes = malloc(BATCH_SIZE * sizeof *batch_key_sizes);
+  char **batch_values = malloc(BATCH_SIZE * sizeof *batch_values);
+  int64_t *batch_value_sizes = malloc(BATCH_SIZE * sizeof *batch_value_sizes);
+  char *buf = malloc(opts->value_size + 1);
+  int ret = -1;
+  if (
+    order == NULL ||
+    latencies == NULL ||
+    batch_keys == NULL ||
+    batch_key_sizes == NULL ||
+    batch_values == NULL ||
+    batch_value_sizes == NULL ||
+    buf == NULL ||
+    generate_order(order, workload, opts)
+  ) {
+    goto cleanup;
+  }
+
+  int32_t i, j;
+
+  // Throughput, single lookups.
+  int32_t found = 0;
+  double begin = now();
+  for (i = 0; i < num_reads; i++) {
+    char *key = keys->data + (size_t) order[i] * keys->stride;
+    found += lookup(reader, key, keys->sizes[order[i]], buf, opts->value_size);
+  }
+  double elapsed = now() - begin;
+
+  // Throughput, batched lookups.
+  int32_t batch_found = 0;
+  begin = now();
+  for (i = 0; i < num_reads; i += BATCH_SIZE) {
+    int32_t batch_size = num_reads - i < BATCH_SIZE ? num_reads - i : BATCH_SIZE;
+    for (j = 0; j < batch_size; j++) {
+      batch_keys[j] = keys->data + (size_t) order[i + j] * keys->stride;
+      batch_key_sizes[j] = keys->sizes[order[i + j]];
+    }
+    if (pal_compressed(reader)) {
+      for (j = 0; j < batch_size; j++) {
+        batch_found += lookup(reader, batch_keys[j], batch_key_sizes[j], buf, opts->value_size);
+      }
+      continue;
+    }
+    batch_found += pal_get_batch(
+      reader,
+      batch_size,
+      batch_keys,
+      batch_key_sizes,
+      NULL,
+      batch_values,
+      batch_value_sizes
+    );
+  }
+  double batch_elapsed = now() - begin;
+
+  // Latencies.
+  for (i = 0; i < num_reads; i++) {
+    char *key = keys->data + (size_t) order[i] * keys->stride;
+    int32_t key_size = keys->sizes[order[i]];
+    double start = now();
+    lookup(reader, key, key_size, buf, opts->value_size);
+    latencies[i] = now() - start;
+  }
+  qsort(latencies, num_reads, sizeof *latencies, compare_doubles);
+
+  printf(
+    "%-8s %.2e reads/sec, %.2e reads/sec batched, %5.1f%% hits, "
+    "p50 %5.0f ns, p99 %5.0f ns, p999 %6.0f ns\n",
+    workload,
+    num_reads / elapsed,
+    num_reads / batch_elapsed,
+    100.0 * found / num_reads,
+    1e9 * latencies[(int32_t) (0.5 * (num_reads - 1))],
+    1e9 * latencies[(int32_t) (0.99 * (num_reads - 1))],
+    1e9 * latencies[(int32_t) (0.999 * (num_reads - 1))]
+  );
+  ret = found == batch_found ? 0 : -1;
+
+cleanup:
+  free(order);
+  free(latencies);
+  free(batch_keys);
+  free(batch_key_sizes);
+  free(batch_values);
+  free(batch_value_sizes);
+  free(buf);
+  return ret;
+}
+
+int main(int argc, char **argv) {
+  struct options opts = {
+    .num_keys = 1000000,
+    .min_key_size = 8,
+    .max_key_size = 16,
+    .value_size = 16,
+    .num_reads = 10000000,
+    .skew = 0.99,
+    .miss_ratio = 0.9
+  };
+  int c;
+  while ((c = getopt(argc, argv, "n:k:K:v:r:s:m:w:l:f:c:b")) != -1) {
+    switch (c) {
+      case 'n': opts.num_keys = atoi(optarg); break;
+      case 'k': opts.min_key_size = atoi(optarg); break;
+      case 'K': opts.max_key_size = atoi(optarg); break;
+      case 'v': opts.value_size = atoll(optarg); break;
+      case 'r': opts.num_reads = atoi(optarg); break;
+      case 's': opts.skew = atof(optarg); break;
+      case 'm': opts.miss_ratio = atof(optarg); break;
+      case 'w': opts.workload = optarg; break;
+      case 'l': opts.writer_opts.load_factor = atof(optarg); break;
+      case 'f': opts.writer_opts.filter_bits = atoi(optarg); break;
+      case 'c': opts.writer_opts.block_size = atoi(optarg); break;
+      case 'b': opts.writer_opts.bucketized = 1; break;
+      default: return 1;
+    }
+  }
+  if (
+    opts.num_keys <= 0 ||
+    opts.min_key_size < 4 ||
+    opts.max_key_size < opts.min_key_size ||
+    opts.value_size < 0 ||
+    opts.num_reads <= 0 ||
+    (
+      opts.workload &&
+      strcmp(opts.workload, "uniform") &&
+      strcmp(opts.workload, "zipf") &&
+      strcmp(opts.workload, "miss")
+    )
+  ) {
+    fprintf(stderr, "invalid options\n");
+    return 1;
+  }
+  rng_state ^= time(NULL);
+
+  struct keys keys;
+  if (generate_keys(&keys, &opts)) {
+    fprintf(stderr, "key generation failed\n");
+    return 1;
+  }
+
+  char path[] = "/tmp/pal-bench-XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "unable to create store file\n");
+    return 1;
+  }
+  close(fd);
+  double begin = now();
+  int failed = write_store(path, &keys, &opts);
+  double write_time = now() - begin;
+  begin = now();
+  pal_reader_t *reader = failed ? NULL : pal_init(path);
+  double open_time = now() - begin;
+  if (reader == NULL) {
+    fprintf(stderr, "store creation failed\n");
+    unlink(path);
+    return 1;
+  }
+
+  pal_statistics_t stats;
+  pal_statistics(reader, &stats);
+  printf(
+    "%d keys (%d to %d bytes), %lld byte values, index %d bytes, data %lld bytes\n",
+    stats.num_keys,
+    opts.min_key_size,
+    opts.max_key_size,
+    (long long) opts.value_size,
+    stats.index_size,
+    (long long) stats.data_size
+  );
+  printf("write %.3f sec, open %.3f ms\n", write_time, 1e3 * open_time);
+
+  const char *workloads[] = {"uniform", "zipf", "miss"};
+  size_t i;
+  for (i = 0; i < sizeof workloads / sizeof workloads[0]; i++) {
+    if (opts.workload && strcmp(opts.workload, workloads[i])) {
+      continue;
+    }
+    if (bench(reader, &keys, workloads[i], &opts)) {
+      fprintf(stderr, "benchmark failed\n");
+      failed = 1;
+      break;
+    }
+  }
+
+  pal_destroy(reader);
+  unlink(path);
+  free(keys.data);
+  free(keys.sizes);
+  return failed;
+}
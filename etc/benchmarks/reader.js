@@ -0,0 +1,262 @@
+/* jshint node: true */
+
+'use strict';
+
+/**
+ * Reader benchmark, JavaScript side.
+ *
+ * Mirrors `deps/paldb/test/bench_reader.c`: generates a store, then runs
+ * `Store#read` and `Db#get` lookups under uniform, Zipfian, and miss-heavy
+ * workloads, reporting throughput and latency percentiles.
+ *
+ * Usage: node etc/benchmarks/reader.js [-n NUM_KEYS] [-k MIN_KEY_SIZE]
+ *          [-K MAX_KEY_SIZE] [-v VALUE_SIZE] [-r NUM_READS] [-s SKEW]
+ *          [-m MISS_RATIO] [-w WORKLOAD]
+ *
+ */
+
+var pal = require('../../lib'),
+    store = require('../../lib/store'),
+    tmp = require('tmp');
+
+
+var WORKLOADS = ['uniform', 'zipf', 'miss'];
+
+
+/**
+ * Parse command line flags (same as the C benchmark).
+ *
+ */
+function parseOptions(argv) {
+  var opts = {
+    numKeys: 1e6,
+    minKeySize: 8,
+    maxKeySize: 16,
+    valueSize: 16,
+    numReads: 1e6,
+    skew: 0.99,
+    missRatio: 0.9,
+    workload: undefined
+  };
+  var flags = {
+    '-n': 'numKeys',
+    '-k': 'minKeySize',
+    '-K': 'maxKeySize',
+    '-v': 'valueSize',
+    '-r': 'numReads',
+    '-s': 'skew',
+    '-m': 'missRatio',
+    '-w': 'workload'
+  };
+  var i, name;
+  for (i = 0; i < argv.length; i += 2) {
+    name = flags[argv[i]];
+    if (!name || i + 1 >= argv.length) {
+      throw new Error('invalid option: ' + argv[i]);
+    }
+    opts[name] = name === 'workload' ? argv[i + 1] : +argv[i + 1];
+  }
+  if (opts.workload && !~WORKLOADS.indexOf(opts.workload)) {
+    throw new Error('unknown workload: ' + opts.workload);
+  }
+  return opts;
+}
+
+/**
+ * Random string keys, the second half is never written to the store.
+ *
+ * Keys are prefixed by their index to guarantee uniqueness.
+ *
+ */
+function generateKeys(opts) {
+  var keys = new Array(2 * opts.numKeys);
+  var spread = opts.maxKeySize - opts.minKeySize + 1;
+  var i, key, size;
+  for (i = 0; i < keys.length; i++) {
+    key = i.toString(36) + '.';
+    size = opts.minKeySize + Math.floor(Math.random() * spread);
+    while (key.length < size) {
+      key += Math.random().toString(36).slice(2);
+    }
+    keys[i] = key.slice(0, Math.max(size, key.indexOf('.') + 1));
+  }
+  return keys;
+}
+
+/**
+ * Indices of keys to look up.
+ *
+ */
+function generateOrder(workload, opts) {
+  var n = opts.numKeys;
+  var order = new Int32Array(opts.numReads);
+  var i, j, tmp;
+
+  switch (workload) {
+    case 'uniform':
+      for (i = 0; i < order.length; i++) {
+        order[i] = Math.floor(Math.random() * n);
+      }
+      break;
+    case 'miss':
+      for (i = 0; i < order.length; i++) {
+        order[i] = Math.floor(Math.random() * n);
+        if (Math.random() < opts.missRatio) {
+          order[i] += n;
+        }
+      }
+      break;
+    case 'zipf':
+      var cdf = new Float64Array(n);
+      var ranks = new Int32Array(n);
+      var total = 0;
+      for (i = 0; i < n; i++) {
+        total += 1 / Math.pow(i + 1, opts.skew);
+        cdf[i] = total;
+        ranks[i] = i;
+      }
+      for (i = n - 1; i > 0; i--) {
+        j = Math.floor(Math.random() * (i + 1));
+        tmp = ranks[i];
+        ranks[i] = ranks[j];
+        ranks[j] = tmp;
+      }
+      for (i = 0; i < order.length; i++) {
+        var target = Math.random() * total;
+        var lo = 0;
+        var hi = n - 1;
+        while (lo < hi) {
+          var mid = (lo + hi) >>> 1;
+          if (cdf[mid] < target) {
+            lo = mid + 1;
+          } else {
+            hi = mid;
+          }
+        }
+        order[i] = ranks[lo];
+      }
+      break;
+  }
+  return order;
+}
+
+function elapsed(start) {
+  var diff = process.hrtime(start);
+  return diff[0] + diff[1] * 1e-9;
+}
+
+/**
+ * Run lookups, returning throughput, hit ratio, and latency percentiles.
+ *
+ * As in the C benchmark, throughput and latencies are measured in separate
+ * passes (`process.hrtime` adds a non-negligible overhead to each lookup).
+ *
+ */
+function bench(name, workload, lookup, order, keys) {
+  var numReads = order.length;
+  var found = 0;
+  var i, start;
+
+  start = process.hrtime();
+  for (i = 0; i < numReads; i++) {
+    if (lookup(keys[order[i]])) {
+      found++;
+    }
+  }
+  var throughput = numReads / elapsed(start);
+
+  var latencies = new Float64Array(numReads);
+  for (i = 0; i < numReads; i++) {
+    start = process.hrtime();
+    lookup(keys[order[i]]);
+    latencies[i] = elapsed(start);
+  }
+  Array.prototype.sort.call(latencies, function (a, b) { return a - b; });
+
+  console.log(
+    '%s %s %s reads/sec, %s% hits, p50 %s ns, p99 %s ns, p999 %s ns',
+    pad(name, 6),
+    pad(workload, 8),
+    throughput.toExponential(2),
+    (100 * found / numReads).toFixed(1),
+    percentile(0.5),
+    percentile(0.99),
+    percentile(0.999)
+  );
+
+  function percentile(p) {
+    return (1e9 * latencies[Math.floor(p * (numReads - 1))]).toFixed(0);
+  }
+}
+
+function pad(s, n) {
+  while (s.length < n) {
+    s += ' ';
+  }
+  return s;
+}
+
+function main() {
+  var opts = parseOptions(process.argv.slice(2));
+  var keys = generateKeys(opts);
+  var value = new Array(opts.valueSize + 1).join('v');
+  var path = tmp.tmpNameSync();
+
+  var start = process.hrtime();
+  var writer = pal.Db.createWriteStream(path, function (err) {
+    if (err) {
+      throw err;
+    }
+    var writeTime = elapsed(start);
+
+    var db = new pal.Db(path);
+    var st = new store.Store(path);
+    var stats = st.getStatistics();
+    console.log(
+      '%d keys (%d to %d bytes), %d byte values, index %d bytes, data %d bytes',
+      opts.numKeys,
+      opts.minKeySize,
+      opts.maxKeySize,
+      opts.valueSize,
+      stats.indexSize,
+      stats.dataSize
+    );
+    console.log(
+      'write %s sec, open %s ms',
+      writeTime.toFixed(3),
+      st.getMetrics().openTime.toFixed(3)
+    );
+
+    // Store keys are JSON encoded (the `Db`'s default codec).
+    var keyBufs = keys.map(function (key) {
+      return new Buffer(JSON.stringify(key));
+    });
+    var buf = new Buffer(4096);
+
+    WORKLOADS.forEach(function (workload) {
+      if (opts.workload && opts.workload !== workload) {
+        return;
+      }
+      var order = generateOrder(workload, opts);
+      bench('read', workload, function (keyBuf) {
+        return st.read(keyBuf, buf) !== -1;
+      }, order, keyBufs);
+      bench('get', workload, function (key) {
+        return db.get(key) !== undefined;
+      }, order, keys);
+    });
+  });
+
+  var i = 0;
+  (function write() {
+    while (i < opts.numKeys) {
+      if (!writer.write({key: keys[i++], value: value})) {
+        writer.once('drain', write);
+        return;
+      }
+    }
+    writer.end();
+  })();
+}
+
+main();
@@ -2,6 +2,9 @@
 
 'use strict';
 
+var binding = require('../build/Release/binding'),
+    util = require('util');
+
 
 /**
  * Basic codec.
@@ -33,7 +36,30 @@ AvroCodec.prototype.encode = function (val) {
 };
 
 
+/**
+ * Avro, decoding natively (see `Decoder` in the binding).
+ *
+ * Records are decoded as plain objects, optionally projected onto `fields`
+ * (the others are skipped). The `decoder` property lets callers decode values
+ * directly from the store's memory (see `Store#readValue`).
+ *
+ */
+function NativeAvroCodec(type, fields) {
+  AvroCodec.call(this, type);
+  var schema = JSON.parse(type.toString()); // Canonical form.
+  this.decoder = fields ?
+    new binding.Decoder(schema, fields) :
+    new binding.Decoder(schema);
+}
+util.inherits(NativeAvroCodec, AvroCodec);
+
+NativeAvroCodec.prototype.decode = function (buf) {
+  return this.decoder.decode(buf);
+};
+
+
 module.exports = {
   JsonCodec: JsonCodec,
-  AvroCodec: AvroCodec
+  AvroCodec: AvroCodec,
+  NativeAvroCodec: NativeAvroCodec
 };
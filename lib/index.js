@@ -23,6 +23,12 @@ function Db(path, opts) {
   this._keyCodec = codecs.keyCodec || DEFAULT_CODEC;
   this._valueCodec = codecs.valueCodec || DEFAULT_CODEC;
   this._buf = new Buffer(opts.bufferSize || 4096); // Default to full slab.
+  this._zeroCopy = !!opts.zeroCopy; // Decode directly from the store's memory.
+  this._pending = null; // Asynchronous lookups, batched per tick.
+  this._resizes = 0; // Lookups retried after growing the buffer.
+  if (opts.metrics) {
+    this._store.enableMetrics(true);
+  }
 }
 
 Db.prototype.getStatistics = function () {
@@ -32,31 +38,150 @@ Db.prototype.getStatistics = function () {
   return stats;
 };
 
+Db.prototype.getMetrics = function () {
+  var metrics = this._store.getMetrics();
+  metrics.resizes = this._resizes;
+  return metrics;
+};
+
 Db.prototype.get = function (key, defaultValue) {
   var keyBuf = this._keyCodec.encode(key);
+  var decoder = this._valueCodec.decoder;
+  if (decoder) { // Native decoding, straight from the store's memory.
+    var value = this._store.readValue(keyBuf, decoder);
+    return value === undefined ? defaultValue : value;
+  }
+  if (this._zeroCopy) {
+    var valueBuf = this._store.readView(keyBuf);
+    return valueBuf ? this._valueCodec.decode(valueBuf) : defaultValue;
+  }
   var len = this._store.read(keyBuf, this._buf);
   if (len === -1) { // Key not found.
     return defaultValue;
   } else if (len < 0) { // Need to resize.
+    this._resizes++;
     this._buf = new Buffer(this._buf.length + ~len);
-    this._store.read(keyBuf, this._buf);
+    len = this._store.read(keyBuf, this._buf);
   }
   return this._valueCodec.decode(this._buf.slice(0, len));
 };
 
-Db.prototype.createReadStream = function () {
-  var keyCodec = this._keyCodec;
+Db.prototype.getMany = function (keys, defaultValue) {
+  var keyBufs = keys.map(function (key) {
+    return this._keyCodec.encode(key);
+  }, this);
+  var lens = this._store.readMany(keyBufs, this._buf);
+  if (typeof lens == 'number') { // Need to resize.
+    this._resizes++;
+    this._buf = new Buffer(this._buf.length + ~lens);
+    lens = this._store.readMany(keyBufs, this._buf);
+  }
+  var offset = 0;
+  return lens.map(function (len) {
+    if (len === -1) { // Key not found.
+      return defaultValue;
+    }
+    var valueBuf = this._buf.slice(offset, offset + len);
+    offset += len;
+    return this._valueCodec.decode(valueBuf);
+  }, this);
+};
+
+/**
+ * Asynchronous lookup, performed on the thread pool.
+ *
+ * Slower than `get` on stores already in memory but won't block the event
+ * loop on page faults. All lookups requested during the same tick are resolved
+ * together.
+ *
+ */
+Db.prototype.getAsync = function (key, cb) {
+  var keyBuf;
+  try {
+    keyBuf = this._keyCodec.encode(key);
+    if (!Buffer.isBuffer(keyBuf) || !keyBuf.length) {
+      throw new Error('empty key'); // Would fail the whole batch.
+    }
+  } catch (err) {
+    process.nextTick(function () { cb(err); });
+    return;
+  }
+
+  if (!this._pending) {
+    this._pending = {keyBufs: [], cbs: []};
+    process.nextTick(this._readPending.bind(this));
+  }
+  this._pending.keyBufs.push(keyBuf);
+  this._pending.cbs.push(cb);
+};
+
+Db.prototype._readPending = function () {
+  var pending = this._pending;
   var valueCodec = this._valueCodec;
-  return this._store.createReadStream()
-    .pipe(new stream.Transform({
-      objectMode: true,
-      transform: function (obj, encoding, cb) {
-        cb(null, {
-          key: keyCodec.decode(obj.key),
-          value: valueCodec.decode(obj.value)
-        });
+  this._pending = null;
+  try {
+    this._store.readAsync(pending.keyBufs, done);
+  } catch (err) {
+    done(err); // E.g. a closed store, fail every lookup of the batch.
+  }
+
+  function done(err, valueBufs) {
+    pending.cbs.forEach(function (cb, i) {
+      if (err) {
+        cb(err);
+        return;
       }
-    }));
+      var value;
+      if (valueBufs[i] !== undefined) {
+        try {
+          value = valueCodec.decode(valueBufs[i]);
+        } catch (err_) {
+          cb(err_);
+          return;
+        }
+      }
+      cb(null, value);
+    });
+  }
+};
+
+/**
+ * Stream of decoded entries, in data order if the `sequential` option is set
+ * (see `Store#createReadStream`).
+ *
+ */
+Db.prototype.createReadStream = function (opts) {
+  var keyCodec = this._keyCodec;
+  var valueCodec = this._valueCodec;
+  var readable = this._store.createReadStream({
+    zeroCopy: this._zeroCopy,
+    sequential: !!(opts && opts.sequential)
+  });
+  return pipe(readable, new stream.Transform({
+    objectMode: true,
+    transform: function (obj, encoding, cb) {
+      cb(null, {
+        key: keyCodec.decode(obj.key),
+        value: valueCodec.decode(obj.value)
+      });
+    }
+  }));
+};
+
+/**
+ * Stream of decoded keys, values are never read (see `Store#createKeyStream`).
+ *
+ */
+Db.prototype.createKeyStream = function () {
+  var keyCodec = this._keyCodec;
+  return pipe(this._store.createKeyStream({zeroCopy: this._zeroCopy}), new stream.Transform({
+    objectMode: true,
+    transform: function (buf, encoding, cb) { cb(null, keyCodec.decode(buf)); }
+  }));
+};
+
+Db.prototype.count = function (cb) {
+  this._store.count(cb);
 };
 
 Db.createWriteStream = function (path, opts, cb) {
@@ -85,17 +210,31 @@ Db.createWriteStream = function (path, opts, cb) {
 /**
  * Convenience implementation.
  *
+ * Schemas are read from the store's metadata. When the `native` option is set,
+ * values are decoded natively (records as plain objects), optionally only the
+ * top-level fields listed in `fields`. Other options are passed on to `Db`.
+ *
  */
-function AvroDb(path) {
-  var store_ = new store.Store(path);
+function AvroDb(path, opts) {
+  opts = opts || {};
+  var store_ = path instanceof store.Store ? path : new store.Store(path);
   var metadata = JSON.parse(store_.getMetadata().toString());
-  var opts = {
-    codecs: {
-      keyCodec: new codecs.AvroCodec(avsc.parse(metadata.keySchema)),
-      valueCodec: new codecs.AvroCodec(avsc.parse(metadata.valueSchema))
-    }
+  var valueType = avsc.parse(metadata.valueSchema);
+  var valueCodec;
+  if (opts.native) {
+    valueCodec = new codecs.NativeAvroCodec(valueType, opts.fields);
+  } else if (opts.fields) {
+    throw new Error('field projection requires the native decoder');
+  } else {
+    valueCodec = new codecs.AvroCodec(valueType);
+  }
+  var opts_ = {};
+  Object.keys(opts).forEach(function (key) { opts_[key] = opts[key]; });
+  opts_.codecs = {
+    keyCodec: new codecs.AvroCodec(avsc.parse(metadata.keySchema)),
+    valueCodec: valueCodec
   };
-  Db.call(this, store_, opts);
+  Db.call(this, store_, opts_);
 }
 util.inherits(AvroDb, Db);
 
@@ -116,6 +255,15 @@ AvroDb.createWriteStream = function (path, schemas, opts, cb) {
   return Db.createWriteStream(path, opts_, cb);
 };
 
+/**
+ * Pipe a stream into another, forwarding its errors (which `pipe` doesn't).
+ *
+ */
+function pipe(readable, writable) {
+  readable.on('error', function (err) { writable.emit('error', err); });
+  return readable.pipe(writable);
+}
+
 
 module.exports = {
   AvroDb: AvroDb,
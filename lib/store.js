@@ -12,8 +12,62 @@ var binding = require('../build/Release/binding'),
     util = require('util');
 
 
-binding.Store.prototype.createReadStream = function () {
-  return new Reader(this);
+binding.Store.prototype.createReadStream = function (opts) {
+  return new Reader(this, opts);
+};
+
+/**
+ * Split the store into (about) `n` disjoint read streams.
+ *
+ * Each stream iterates over its own range of the store's index on the thread
+ * pool, so they are consumed concurrently (up to `UV_THREADPOOL_SIZE`).
+ *
+ */
+binding.Store.prototype.createReadStreams = function (n, opts) {
+  opts = opts || {};
+  return this.getRanges(n).map(function (range) {
+    var opts_ = {range: range};
+    Object.keys(opts).forEach(function (key) { opts_[key] = opts[key]; });
+    return new Reader(this, opts_);
+  }, this);
+};
+
+/**
+ * Stream of the store's keys, reading only its index (and key directory).
+ *
+ * Takes the same options as `createReadStream`. When `valueSizes` is set, it
+ * emits `{key, valueSize}` objects instead (reading only each value's length,
+ * or decompressing its block for compressed stores).
+ *
+ */
+binding.Store.prototype.createKeyStream = function (opts) {
+  opts = opts || {};
+  var opts_ = {mode: opts.valueSizes ? 'sizes' : 'keys'};
+  Object.keys(opts).forEach(function (key) { opts_[key] = opts[key]; });
+  return new Reader(this, opts_);
+};
+
+/**
+ * Count the store's keys, optionally restricted by the same `range`,
+ * `prefix`, `gte`, and `lt` options as `createReadStream`.
+ *
+ * Full and ordered counts are answered from headers and the key directory,
+ * only range counts scan (part of) the index.
+ *
+ */
+binding.Store.prototype.count = function (opts, cb) {
+  if (typeof opts == 'function' && !cb) {
+    cb = opts;
+    opts = undefined;
+  }
+  var iterator;
+  try {
+    iterator = new binding.Iterator(this, false, iteratorRange(opts || {}));
+  } catch (err) {
+    process.nextTick(function () { cb(err); });
+    return;
+  }
+  iterator.count(cb);
 };
 
 binding.Store.createWriteStream = function (filePath, opts, cb) {
@@ -23,7 +77,10 @@ binding.Store.createWriteStream = function (filePath, opts, cb) {
   }
 
   var tmpDir = tmp.dirSync({unsafeCleanup: true});
-  return new Builder(tmpDir.name, opts)
+  var builder = opts && opts.native === false ?
+    new Builder(tmpDir.name, opts) :
+    new NativeBuilder(tmpDir.name, opts);
+  return builder
     .on('store', function (err, tmpPath, isCompact) {
       if (err) {
         done(err);
@@ -54,34 +111,109 @@ binding.Store.createWriteStream = function (filePath, opts, cb) {
 /**
  * Store read stream.
  *
- * This is relatively slow (compared to direct read calls).
+ * Entries are fetched from the iterator in chunks of `batchSize` to amortize
+ * the cost of each thread pool hop. When the `zeroCopy` option is set,
+ * emitted keys and values are read-only views into the store's memory rather
+ * than copies. The `range` option restricts the stream to part of the store
+ * (see `createReadStreams`). Stores written with the `ordered` option can
+ * also be read in key order, restricted to keys starting with a `prefix` or
+ * between `gte` and `lt` bounds (all buffers). The `sequential` option reads
+ * the whole store in data order instead (with readahead), so that exports of
+ * stores larger than memory read the disk sequentially. The internal `mode`
+ * option is passed on to the iterator (see `createKeyStream`).
  *
  */
-function Reader(store) {
+function Reader(store, opts) {
+  opts = opts || {};
   stream.Readable.call(this, {objectMode: true});
   this._store = store; // Keep a reference to make sure it doesn't get GC'ed.
-  this._iterator = new binding.Iterator(store);
+  this._iterator = new binding.Iterator(
+    store,
+    !!opts.zeroCopy,
+    iteratorRange(opts),
+    opts.mode
+  );
+  this._mode = opts.mode;
+  this._batchSize = opts.batchSize || 1024;
 }
 util.inherits(Reader, stream.Readable);
 
 Reader.prototype._read = function () {
   var self = this;
-  this._iterator.next(function (err, key, value) {
-    assert.strictEqual(err, null);
-    self.push(key ? {key: key, value: value} : null);
+  this._iterator.next(this._batchSize, function (err, keys, values) {
+    if (err) {
+      self.emit('error', err);
+      return;
+    }
+    var i;
+    for (i = 0; i < keys.length; i++) {
+      switch (self._mode) {
+        case 'keys':
+          self.push(keys[i]);
+          break;
+        case 'sizes':
+          self.push({key: keys[i], valueSize: values[i]});
+          break;
+        default:
+          self.push({key: keys[i], value: values[i]});
+      }
+    }
+    if (keys.length < self._batchSize) {
+      self.push(null); // Exhausted.
+    }
   });
 };
 
 /**
- * Store write stream.
+ * Iterator range argument corresponding to read options, if any.
+ *
+ */
+function iteratorRange(opts) {
+  if (opts.sequential) {
+    if (opts.range || opts.prefix || opts.gte || opts.lt) {
+      throw new Error('sequential streams span whole stores');
+    }
+    return {sequential: true};
+  }
+  if (opts.prefix || opts.gte || opts.lt) {
+    return {prefix: opts.prefix, gte: opts.gte, lt: opts.lt};
+  }
+  return opts.range;
+}
+
+/**
+ * Store write stream, implemented in JavaScript (used when the `native` option
+ * is `false`).
  *
  * It emits a `'store'` event with two arguments when done (the temporary path
- * where it was built and whether it is below the compaction threshold).
+ * where it was built and whether it is below the compaction threshold). Only
+ * `VERSION_1` stores are supported (no bucketized indices, membership filters,
+ * compressed data, key directories, or shards), all keys are held in memory
+ * (no `memoryBudget`), and indices are built on the main thread (`numThreads`
+ * is ignored).
  *
  */
 function Builder(dirPath, opts) {
   stream.Writable.call(this, {objectMode: true});
   opts = opts || {};
+  if (opts.bucketized) {
+    throw new Error('bucketized indices require the native writer');
+  }
+  if (opts.filterBits) {
+    throw new Error('membership filters require the native writer');
+  }
+  if (opts.blockSize) {
+    throw new Error('compressed data requires the native writer');
+  }
+  if (opts.numShards) {
+    throw new Error('sharded stores require the native writer');
+  }
+  if (opts.ordered) {
+    throw new Error('key directories require the native writer');
+  }
+  if (opts.memoryBudget) {
+    throw new Error('memory budgets require the native writer');
+  }
 
   this._dirPath = dirPath;
   this._loadFactor = opts.loadFactor || 0.6;
@@ -90,6 +222,11 @@ function Builder(dirPath, opts) {
   this._compactionThreshold = typeof opts.compactionThreshold == 'undefined' ?
     0.8 :
     opts.compactionThreshold;
+  this._valueCache = new ValueCache(
+    typeof opts.valueCacheSize == 'undefined' ?
+      16 * 1024 * 1024 :
+      opts.valueCacheSize
+  );
 
   this._numKeys = 0; // Active keys (removing deleted and overwritten).
   this._numValues = 0; // All values (impractical to filter out ahead of time).
@@ -128,7 +265,7 @@ Builder.prototype._write = function (obj, encoding, cb) {
   var p = this._partitions[n];
   if (!p) {
     var filePath = path.join(this._dirPath, '' + n);
-    this._partitions[n] = p = new Partition(n, filePath);
+    this._partitions[n] = p = new Partition(n, filePath, this._valueCache);
     this._numPartitions++;
   }
 
@@ -216,16 +353,109 @@ Builder.prototype._build = function (writer) {
   })();
 };
 
+/**
+ * Store write stream backed by the native writer (the default).
+ *
+ * Entries are forwarded to the writer in batches of `batchSize` and indices
+ * are built off the main thread. It emits the same `'store'` event as
+ * `Builder`.
+ *
+ */
+function NativeBuilder(dirPath, opts) {
+  stream.Writable.call(this, {objectMode: true});
+  opts = opts || {};
+
+  this._batchSize = opts.batchSize || 1024;
+  this._compactionThreshold = typeof opts.compactionThreshold == 'undefined' ?
+    0.8 :
+    opts.compactionThreshold;
+  this._filePath = path.join(dirPath, '__full__');
+  this._writer = new binding.Writer(this._filePath, {
+    loadFactor: opts.loadFactor,
+    noDistinct: !!opts.noDistinct,
+    bucketized: !!opts.bucketized,
+    filterBits: opts.filterBits,
+    blockSize: opts.blockSize,
+    ordered: !!opts.ordered,
+    numShards: opts.numShards,
+    numThreads: opts.numThreads,
+    valueCacheSize: opts.valueCacheSize,
+    memoryBudget: opts.memoryBudget,
+    metadata: opts.metadata,
+    tmpDir: dirPath
+  });
+  this._keys = [];
+  this._values = [];
+
+  var self = this;
+  this.on('finish', function () {
+    try {
+      self._addBatch();
+    } catch (err) {
+      self.emit('store', err);
+      return;
+    }
+    self._writer.close(function (err, stats) {
+      if (err) {
+        // Likely duplicate key.
+        self.emit('store', err);
+        return;
+      }
+      var isCompact = (
+        stats.numValues === 0 ||
+        stats.numKeys / stats.numValues >= self._compactionThreshold
+      );
+      self.emit('store', null, self._filePath, isCompact);
+    });
+  });
+}
+util.inherits(NativeBuilder, stream.Writable);
+
+NativeBuilder.prototype._write = function (obj, encoding, cb) {
+  var key = obj.key;
+  var value = obj.value;
+  if (
+    !Buffer.isBuffer(key) ||
+    !key.length ||
+    (!Buffer.isBuffer(value) && value !== undefined)
+  ) {
+    cb(new Error('invalid data: ' + obj));
+    return;
+  }
+
+  this._keys.push(key);
+  this._values.push(value);
+  if (this._keys.length >= this._batchSize) {
+    try {
+      this._addBatch();
+    } catch (err) {
+      cb(err);
+      return;
+    }
+  }
+  cb();
+};
+
+NativeBuilder.prototype._addBatch = function () {
+  var keys = this._keys;
+  var values = this._values;
+  this._keys = [];
+  this._values = [];
+  this._writer.add(keys, values);
+};
+
 /**
  * A store's partition, containing only keys of a same length.
  *
  * Values are not kept in memory, but written to disk as they are added. This
  * has the advantage of supporting much larger data sizes but prevents
- * efficient compaction.
+ * efficient compaction. Values identical to one already written (and still in
+ * the value cache) aren't rewritten, their key points to the existing copy.
  *
  */
-function Partition(keySize, path) {
+function Partition(keySize, path, valueCache) {
   this._keySize = keySize;
+  this._valueCache = valueCache;
   this._items = [];
   this._offset = 1; // Data offset.
   this._path = path;
@@ -242,12 +472,19 @@ Partition.prototype.addEntry = function (key, value) {
     return;
   }
 
+  var offset = this._valueCache.get(this._keySize, value);
+  if (offset) {
+    // Identical value already written.
+    this._items.push({key: key, offset: offset});
+    return true;
+  }
+
   var packedSize = new Buffer(9); // Maximum packed non-negative long length.
   var packedSizeLength = utils.packLong(value.length, packedSize);
   this._items.push({key: key, offset: this._offset});
+  this._valueCache.set(this._keySize, value, this._offset);
   this._offset += packedSizeLength + value.length;
 
-  // TODO: Avoid repeatedly rewriting the same value (as in original PalDB).
   this._stream.write(packedSize.slice(0, packedSizeLength));
   return this._stream.write(value);
 };
@@ -261,10 +498,14 @@ Partition.prototype.build = function (loadFactor, noDistinct) {
   var numKeys = 0;
   var index = new Buffer(nSlots * slotSize);
   index.fill(0);
+  var hashes = binding.hashMany(
+    this._items.map(function (item) { return item.key; }),
+    new Uint32Array(this._items.length)
+  );
 
-  this._items.forEach(function (item) {
+  this._items.forEach(function (item, i) {
     var key = item.key;
-    var pos = (binding.hash(key) * slotSize) % index.length;
+    var pos = (hashes[i] * slotSize) % index.length;
     var attempt = 0;
 
     while (
@@ -314,6 +555,56 @@ Partition.prototype.pipeValues = function (dst, cb) {
     .end();
 };
 
+/**
+ * Data offsets of values already written, by key size and contents.
+ *
+ * Values are cached until their total size reaches `capacity` bytes, after
+ * which only those already cached are deduplicated (same as the native
+ * writer's `value_cache_size`, a non-positive capacity disables caching).
+ *
+ */
+function ValueCache(capacity) {
+  this._capacity = capacity;
+  this._size = 0;
+  this._numValues = 0;
+  this._entries = {}; // Lists of values (and offsets), by key size and hash.
+  this._hashes = new Uint32Array(1);
+}
+
+ValueCache.prototype._hash = function (keySize, value) {
+  binding.hashMany([value], this._hashes);
+  return keySize + ':' + this._hashes[0];
+};
+
+ValueCache.prototype.get = function (keySize, value) {
+  if (!this._numValues) {
+    return 0; // Avoid hashing.
+  }
+  var entries = this._entries[this._hash(keySize, value)];
+  var i;
+  if (entries) {
+    for (i = 0; i < entries.length; i++) {
+      if (value.equals(entries[i].value)) {
+        return entries[i].offset;
+      }
+    }
+  }
+  return 0;
+};
+
+ValueCache.prototype.set = function (keySize, value, offset) {
+  if (value.length > this._capacity - this._size) {
+    return;
+  }
+  var hash = this._hash(keySize, value);
+  var entries = this._entries[hash] || (this._entries[hash] = []);
+  var copy = new Buffer(value.length); // The original might be reused.
+  value.copy(copy);
+  entries.push({value: copy, offset: offset});
+  this._size += value.length;
+  this._numValues++;
+};
+
 
 module.exports = {
   Store: binding.Store
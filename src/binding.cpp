@@ -1,7 +1,9 @@
 #include <nan.h>
 #include <node.h>
+#include "decoder.h"
 #include "iterator.h"
 #include "store.h"
+#include "writer.h"
 
 extern "C" {
   #include "../deps/murmur3/murmur3.h"
@@ -34,7 +36,49 @@ void Hash(const Nan::FunctionCallbackInfo<v8::Value>& info) {
   info.GetReturnValue().Set(hash & 0x7fffffff);
 }
 
-void InitAll(v8::Local<v8::Object> target) {
+/**
+ * Hash multiple buffers at once.
+ *
+ * Takes an array of buffers and a `Uint32Array` at least as long, which gets
+ * populated with the hashes (and is returned).
+ *
+ */
+void HashMany(const Nan::FunctionCallbackInfo<v8::Value>& info) {
+  if (
+    info.Length() != 2 ||
+    !info[0]->IsArray() ||
+    !info[1]->IsUint32Array()
+  ) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
+
+  v8::Local<v8::Array> bufs = info[0].As<v8::Array>();
+  Nan::TypedArrayContents<uint32_t> hashes(info[1]);
+  if (hashes.length() < bufs->Length()) {
+    Nan::ThrowError("hash array too small");
+    return;
+  }
+
+  uint32_t i;
+  for (i = 0; i < bufs->Length(); i++) {
+    v8::Local<v8::Value> buf = Nan::Get(bufs, i).ToLocalChecked();
+    if (!node::Buffer::HasInstance(buf)) {
+      Nan::ThrowError("invalid buffer");
+      return;
+    }
+    (*hashes)[i] = pal_hash(node::Buffer::Data(buf), node::Buffer::Length(buf));
+  }
+  info.GetReturnValue().Set(info[1]);
+}
+
+/**
+ * Module initializer, run once per context which loads the binding (e.g. by
+ * each worker thread). It keeps no per-context state outside of the returned
+ * functions; stores are shared across contexts through their snapshots.
+ *
+ */
+NAN_MODULE_INIT(InitAll) {
 
   Nan::Set(
     target,
@@ -42,20 +86,38 @@ void InitAll(v8::Local<v8::Object> target) {
     Nan::GetFunction(Store::Init()).ToLocalChecked()
   );
 
+  Nan::Set(
+    target,
+    Nan::New<v8::String>("Decoder").ToLocalChecked(),
+    Nan::GetFunction(Decoder::Init()).ToLocalChecked()
+  );
+
   Nan::Set(
     target,
     Nan::New<v8::String>("Iterator").ToLocalChecked(),
     Nan::GetFunction(Iterator::Init()).ToLocalChecked()
   );
 
+  Nan::Set(
+    target,
+    Nan::New<v8::String>("Writer").ToLocalChecked(),
+    Nan::GetFunction(Writer::Init()).ToLocalChecked()
+  );
+
   Nan::Set(
     target,
     Nan::New<v8::String>("hash").ToLocalChecked(),
     Nan::GetFunction(Nan::New<v8::FunctionTemplate>(Hash)).ToLocalChecked()
   );
 
+  Nan::Set(
+    target,
+    Nan::New<v8::String>("hashMany").ToLocalChecked(),
+    Nan::GetFunction(Nan::New<v8::FunctionTemplate>(HashMany)).ToLocalChecked()
+  );
+
 }
 
-NODE_MODULE(binding, InitAll)
+NAN_MODULE_WORKER_ENABLED(binding, InitAll)
 
 }
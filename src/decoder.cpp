@@ -0,0 +1,593 @@
+#include "decoder.h"
+#include <cstring>
+
+namespace pal {
+
+// Largest integer a double represents exactly (`Number.MAX_SAFE_INTEGER`).
+#define MAX_SAFE_INTEGER 9007199254740991LL
+
+// Primitive type names, in `Kind` order.
+static const char *PRIMITIVES[] = {
+  "null",
+  "boolean",
+  "int",
+  "long",
+  "float",
+  "double",
+  "bytes",
+  "string"
+};
+
+/**
+ * Get a property of a schema object (undefined if missing).
+ *
+ */
+static v8::Local<v8::Value> GetAttribute(v8::Local<v8::Value> schema, const char *name) {
+  return Nan::Get(schema.As<v8::Object>(), Nan::New(name).ToLocalChecked())
+    .ToLocalChecked();
+}
+
+/**
+ * Name of a union branch, as `avsc` wraps it: the type's (full) name if it is
+ * named or primitive, otherwise `"array"` or `"map"`.
+ *
+ */
+static std::string BranchName(v8::Local<v8::Value> schema) {
+  if (schema->IsString()) {
+    return *Nan::Utf8String(schema);
+  }
+  v8::Local<v8::Value> name = GetAttribute(schema, "name");
+  if (name->IsString()) {
+    return *Nan::Utf8String(name);
+  }
+  return *Nan::Utf8String(GetAttribute(schema, "type"));
+}
+
+Decoder::Decoder() {}
+
+Decoder::~Decoder() {
+  uint32_t i;
+  for (i = 0; i < _strings.size(); i++) {
+    _strings[i]->Reset();
+    delete _strings[i];
+  }
+}
+
+int32_t Decoder::AddString(const std::string &str) {
+  _strings.push_back(
+    new Nan::Persistent<v8::String>(Nan::New(str).ToLocalChecked())
+  );
+  return _strings.size() - 1;
+}
+
+/**
+ * Compile a schema, returning its type's index (-1 if invalid, setting
+ * `error`). Named types are registered in `named` before their children are
+ * compiled, so that recursive references resolve.
+ *
+ */
+int32_t Decoder::Compile(v8::Local<v8::Value> schema, std::map<std::string, int32_t> &named, const char **error) {
+  int32_t index = _types.size();
+  uint32_t i;
+
+  if (schema->IsString()) {
+    std::string name(*Nan::Utf8String(schema));
+    for (i = 0; i <= STRING; i++) {
+      if (name == PRIMITIVES[i]) {
+        _types.push_back(Type());
+        _types[index].kind = static_cast<Kind>(i);
+        return index;
+      }
+    }
+    std::map<std::string, int32_t>::iterator it = named.find(name);
+    if (it == named.end()) {
+      *error = "unknown type";
+      return -1;
+    }
+    return it->second;
+  }
+
+  if (schema->IsArray()) {
+    v8::Local<v8::Array> branches = schema.As<v8::Array>();
+    _types.push_back(Type());
+    _types[index].kind = UNION;
+    for (i = 0; i < branches->Length(); i++) {
+      v8::Local<v8::Value> branch = Nan::Get(branches, i).ToLocalChecked();
+      int32_t branchIndex = Compile(branch, named, error);
+      if (branchIndex < 0) {
+        return -1;
+      }
+      int32_t nameIndex = AddString(BranchName(branch));
+      _types[index].types.push_back(branchIndex);
+      _types[index].names.push_back(nameIndex);
+    }
+    return index;
+  }
+
+  if (!schema->IsObject()) {
+    *error = "invalid schema";
+    return -1;
+  }
+  v8::Local<v8::Value> typeName = GetAttribute(schema, "type");
+  if (!typeName->IsString()) {
+    return Compile(typeName, named, error);
+  }
+
+  std::string kind(*Nan::Utf8String(typeName));
+  std::string name(*Nan::Utf8String(GetAttribute(schema, "name")));
+  if (kind == "record" || kind == "error") {
+    v8::Local<v8::Value> fields = GetAttribute(schema, "fields");
+    if (!fields->IsArray()) {
+      *error = "invalid record";
+      return -1;
+    }
+    _types.push_back(Type());
+    _types[index].kind = RECORD;
+    named[name] = index;
+    v8::Local<v8::Array> arr = fields.As<v8::Array>();
+    for (i = 0; i < arr->Length(); i++) {
+      v8::Local<v8::Value> field = Nan::Get(arr, i).ToLocalChecked();
+      if (!field->IsObject()) {
+        *error = "invalid record";
+        return -1;
+      }
+      int32_t fieldIndex = Compile(GetAttribute(field, "type"), named, error);
+      if (fieldIndex < 0) {
+        return -1;
+      }
+      int32_t nameIndex = AddString(*Nan::Utf8String(GetAttribute(field, "name")));
+      _types[index].types.push_back(fieldIndex);
+      _types[index].names.push_back(nameIndex);
+      _types[index].projected.push_back(1);
+    }
+  } else if (kind == "enum") {
+    v8::Local<v8::Value> symbols = GetAttribute(schema, "symbols");
+    if (!symbols->IsArray()) {
+      *error = "invalid enum";
+      return -1;
+    }
+    _types.push_back(Type());
+    _types[index].kind = ENUM;
+    named[name] = index;
+    v8::Local<v8::Array> arr = symbols.As<v8::Array>();
+    for (i = 0; i < arr->Length(); i++) {
+      int32_t nameIndex = AddString(*Nan::Utf8String(Nan::Get(arr, i).ToLocalChecked()));
+      _types[index].names.push_back(nameIndex);
+    }
+  } else if (kind == "fixed") {
+    v8::Local<v8::Value> size = GetAttribute(schema, "size");
+    if (!size->IsUint32()) {
+      *error = "invalid fixed";
+      return -1;
+    }
+    _types.push_back(Type());
+    _types[index].kind = FIXED;
+    _types[index].size = Nan::To<uint32_t>(size).FromJust();
+    named[name] = index;
+  } else if (kind == "array" || kind == "map") {
+    _types.push_back(Type());
+    _types[index].kind = kind == "array" ? ARRAY : MAP;
+    int32_t itemIndex = Compile(
+      GetAttribute(schema, kind == "array" ? "items" : "values"),
+      named,
+      error
+    );
+    if (itemIndex < 0) {
+      return -1;
+    }
+    _types[index].types.push_back(itemIndex);
+  } else {
+    return Compile(typeName, named, error); // E.g. `{"type": "int"}`.
+  }
+  return index;
+}
+
+v8::Local<v8::Value> Decoder::Decode(const char *data, size_t size, const char **error) {
+  Nan::EscapableHandleScope scope;
+  Cursor cursor;
+  cursor.pos = reinterpret_cast<const unsigned char *>(data);
+  cursor.end = cursor.pos + size;
+  cursor.error = NULL;
+  v8::Local<v8::Value> value;
+  if (!Read(0, &cursor, &value)) {
+    *error = cursor.error != NULL ? cursor.error : "invalid data";
+    return v8::Local<v8::Value>();
+  }
+  return scope.Escape(value);
+}
+
+bool Decoder::Take(Cursor *cursor, int64_t size, const unsigned char **bytes) {
+  if (size < 0 || size > cursor->end - cursor->pos) {
+    cursor->error = "truncated data";
+    return false;
+  }
+  *bytes = cursor->pos;
+  cursor->pos += size;
+  return true;
+}
+
+/**
+ * Read a zig-zag encoded variable-length integer (ints are encoded the same
+ * way, only smaller).
+ *
+ */
+bool Decoder::ReadLong(Cursor *cursor, int64_t *value) {
+  uint64_t n = 0;
+  int shift = 0;
+  unsigned char b;
+  do {
+    if (cursor->pos >= cursor->end || shift > 63) {
+      cursor->error = "truncated data";
+      return false;
+    }
+    b = *cursor->pos++;
+    n |= static_cast<uint64_t>(b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+  *value = static_cast<int64_t>((n >> 1) ^ (0 - (n & 1)));
+  return true;
+}
+
+/**
+ * Read an array or map block's item count. Writers may also include the
+ * block's size in bytes (by negating the count), -1 otherwise.
+ *
+ */
+bool Decoder::ReadBlockHeader(Cursor *cursor, int64_t *count, int64_t *size) {
+  if (!ReadLong(cursor, count)) {
+    return false;
+  }
+  *size = -1;
+  if (*count < 0) {
+    *count = -*count;
+    return ReadLong(cursor, size);
+  }
+  return true;
+}
+
+bool Decoder::Read(int32_t index, Cursor *cursor, v8::Local<v8::Value> *value) {
+  const Type &type = _types[index];
+  const unsigned char *bytes;
+  int64_t n, count, size;
+  uint32_t i;
+
+  switch (type.kind) {
+    case NUL:
+      *value = Nan::Null();
+      return true;
+    case BOOLEAN:
+      if (!Take(cursor, 1, &bytes)) {
+        return false;
+      }
+      *value = Nan::New<v8::Boolean>(*bytes != 0);
+      return true;
+    case INT:
+    case LONG:
+      if (!ReadLong(cursor, &n)) {
+        return false;
+      }
+      if (n > MAX_SAFE_INTEGER || n < -MAX_SAFE_INTEGER) {
+        cursor->error = "unsafe long";
+        return false;
+      }
+      *value = Nan::New<v8::Number>(static_cast<double>(n));
+      return true;
+    case FLOAT: {
+      if (!Take(cursor, 4, &bytes)) {
+        return false;
+      }
+      uint32_t bits = 0;
+      float f;
+      for (i = 0; i < 4; i++) {
+        bits |= static_cast<uint32_t>(bytes[i]) << (8 * i); // Little-endian.
+      }
+      std::memcpy(&f, &bits, 4);
+      *value = Nan::New<v8::Number>(f);
+      return true;
+    }
+    case DOUBLE: {
+      if (!Take(cursor, 8, &bytes)) {
+        return false;
+      }
+      uint64_t bits = 0;
+      double d;
+      for (i = 0; i < 8; i++) {
+        bits |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+      }
+      std::memcpy(&d, &bits, 8);
+      *value = Nan::New<v8::Number>(d);
+      return true;
+    }
+    case BYTES:
+    case STRING:
+      if (!ReadLong(cursor, &n) || !Take(cursor, n, &bytes)) {
+        return false;
+      }
+      if (type.kind == BYTES) {
+        *value = Nan::CopyBuffer(
+          reinterpret_cast<const char *>(bytes),
+          static_cast<uint32_t>(n)
+        ).ToLocalChecked();
+      } else {
+        *value = Nan::New(
+          reinterpret_cast<const char *>(bytes),
+          static_cast<int>(n)
+        ).ToLocalChecked();
+      }
+      return true;
+    case FIXED:
+      if (!Take(cursor, type.size, &bytes)) {
+        return false;
+      }
+      *value = Nan::CopyBuffer(reinterpret_cast<const char *>(bytes), type.size)
+        .ToLocalChecked();
+      return true;
+    case RECORD: {
+      v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+      for (i = 0; i < type.types.size(); i++) {
+        if (!type.projected[i]) {
+          if (!Skip(type.types[i], cursor)) {
+            return false;
+          }
+          continue;
+        }
+        v8::Local<v8::Value> field;
+        if (!Read(type.types[i], cursor, &field)) {
+          return false;
+        }
+        Nan::Set(obj, Nan::New(*_strings[type.names[i]]), field);
+      }
+      *value = obj;
+      return true;
+    }
+    case ENUM:
+      if (!ReadLong(cursor, &n)) {
+        return false;
+      }
+      if (n < 0 || n >= static_cast<int64_t>(type.names.size())) {
+        cursor->error = "invalid enum index";
+        return false;
+      }
+      *value = Nan::New(*_strings[type.names[n]]);
+      return true;
+    case ARRAY: {
+      v8::Local<v8::Array> arr = Nan::New<v8::Array>();
+      uint32_t length = 0;
+      while (true) {
+        if (!ReadBlockHeader(cursor, &count, &size)) {
+          return false;
+        }
+        if (!count) {
+          break;
+        }
+        for (; count > 0; count--) {
+          v8::Local<v8::Value> item;
+          if (!Read(type.types[0], cursor, &item)) {
+            return false;
+          }
+          Nan::Set(arr, length++, item);
+        }
+      }
+      *value = arr;
+      return true;
+    }
+    case MAP: {
+      v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+      while (true) {
+        if (!ReadBlockHeader(cursor, &count, &size)) {
+          return false;
+        }
+        if (!count) {
+          break;
+        }
+        for (; count > 0; count--) {
+          v8::Local<v8::Value> item;
+          if (!ReadLong(cursor, &n) || !Take(cursor, n, &bytes)) {
+            return false;
+          }
+          v8::Local<v8::String> key = Nan::New(
+            reinterpret_cast<const char *>(bytes),
+            static_cast<int>(n)
+          ).ToLocalChecked();
+          if (!Read(type.types[0], cursor, &item)) {
+            return false;
+          }
+          Nan::Set(obj, key, item);
+        }
+      }
+      *value = obj;
+      return true;
+    }
+    case UNION: {
+      if (!ReadLong(cursor, &n)) {
+        return false;
+      }
+      if (n < 0 || n >= static_cast<int64_t>(type.types.size())) {
+        cursor->error = "invalid union index";
+        return false;
+      }
+      if (_types[type.types[n]].kind == NUL) {
+        *value = Nan::Null();
+        return true;
+      }
+      v8::Local<v8::Value> branch;
+      if (!Read(type.types[n], cursor, &branch)) {
+        return false;
+      }
+      v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+      Nan::Set(obj, Nan::New(*_strings[type.names[n]]), branch);
+      *value = obj;
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Move past a value without materializing it. Array and map blocks which
+ * include their size are skipped in one go.
+ *
+ */
+bool Decoder::Skip(int32_t index, Cursor *cursor) {
+  const Type &type = _types[index];
+  const unsigned char *bytes;
+  int64_t n, count, size;
+  uint32_t i;
+
+  switch (type.kind) {
+    case NUL:
+      return true;
+    case BOOLEAN:
+      return Take(cursor, 1, &bytes);
+    case INT:
+    case LONG:
+    case ENUM:
+      return ReadLong(cursor, &n);
+    case FLOAT:
+      return Take(cursor, 4, &bytes);
+    case DOUBLE:
+      return Take(cursor, 8, &bytes);
+    case BYTES:
+    case STRING:
+      return ReadLong(cursor, &n) && Take(cursor, n, &bytes);
+    case FIXED:
+      return Take(cursor, type.size, &bytes);
+    case RECORD:
+      for (i = 0; i < type.types.size(); i++) {
+        if (!Skip(type.types[i], cursor)) {
+          return false;
+        }
+      }
+      return true;
+    case ARRAY:
+    case MAP:
+      while (true) {
+        if (!ReadBlockHeader(cursor, &count, &size)) {
+          return false;
+        }
+        if (!count) {
+          return true;
+        }
+        if (size >= 0) {
+          if (!Take(cursor, size, &bytes)) {
+            return false;
+          }
+          continue;
+        }
+        for (; count > 0; count--) {
+          if (
+            (type.kind == MAP && !(ReadLong(cursor, &n) && Take(cursor, n, &bytes))) ||
+            !Skip(type.types[0], cursor)
+          ) {
+            return false;
+          }
+        }
+      }
+    case UNION:
+      if (!ReadLong(cursor, &n)) {
+        return false;
+      }
+      if (n < 0 || n >= static_cast<int64_t>(type.types.size())) {
+        cursor->error = "invalid union index";
+        return false;
+      }
+      return Skip(type.types[n], cursor);
+  }
+  return false;
+}
+
+// v8 exposed functions.
+
+/**
+ * JS constructor.
+ *
+ * Takes a canonical schema (as a parsed object) and optionally an array of
+ * field names to project a record schema onto.
+ *
+ */
+void Decoder::New(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  if (
+    info.Length() < 1 ||
+    info.Length() > 2 ||
+    (info.Length() == 2 && !info[1]->IsArray())
+  ) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
+
+  Decoder *decoder = new Decoder();
+  std::map<std::string, int32_t> named;
+  const char *error = NULL;
+  if (decoder->Compile(info[0], named, &error) < 0) {
+    delete decoder;
+    Nan::ThrowError(error);
+    return;
+  }
+
+  if (info.Length() == 2) {
+    Type &root = decoder->_types[0];
+    if (root.kind != RECORD) {
+      delete decoder;
+      Nan::ThrowError("only records can be projected");
+      return;
+    }
+    v8::Local<v8::Array> fields = info[1].As<v8::Array>();
+    root.projected.assign(root.types.size(), 0);
+    uint32_t i, j;
+    for (i = 0; i < fields->Length(); i++) {
+      v8::Local<v8::Value> field = Nan::Get(fields, i).ToLocalChecked();
+      for (j = 0; j < root.names.size(); j++) {
+        if (Nan::New(*decoder->_strings[root.names[j]])->StrictEquals(field)) {
+          break;
+        }
+      }
+      if (j == root.names.size()) {
+        delete decoder;
+        Nan::ThrowError("unknown field");
+        return;
+      }
+      root.projected[j] = 1;
+    }
+  }
+
+  decoder->Wrap(info.This());
+  info.GetReturnValue().Set(info.This());
+}
+
+/**
+ * Decode a buffer. Attached to `Decoder`'s prototype.
+ *
+ */
+void Decoder::DecodeValue(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  if (info.Length() != 1 || !node::Buffer::HasInstance(info[0])) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
+
+  Decoder *decoder = ObjectWrap::Unwrap<Decoder>(info.This());
+  const char *error;
+  v8::Local<v8::Value> value = decoder->Decode(
+    node::Buffer::Data(info[0]),
+    node::Buffer::Length(info[0]),
+    &error
+  );
+  if (value.IsEmpty()) {
+    Nan::ThrowError(error);
+    return;
+  }
+  info.GetReturnValue().Set(value);
+}
+
+/**
+ * Initializer, returns the `Decoder` function.
+ *
+ */
+v8::Local<v8::FunctionTemplate> Decoder::Init() {
+  v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(Decoder::New);
+  tpl->SetClassName(Nan::New("Decoder").ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+  Nan::SetPrototypeMethod(tpl, "decode", Decoder::DecodeValue);
+  return tpl;
+}
+
+}
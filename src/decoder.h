@@ -0,0 +1,88 @@
+#ifndef PAL_DECODER_H_
+#define PAL_DECODER_H_
+
+#include <nan.h>
+#include <node.h>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace pal {
+
+/**
+ * Native Avro decoder, compiled once from a schema.
+ *
+ * The schema must be in canonical form (e.g. `JSON.parse(type.toString())`
+ * with `avsc`): named types are fully qualified and only defined once. Values
+ * are decoded directly into JS objects, mirroring `avsc`'s default decoding
+ * except that records are plain objects. Unions are wrapped (`{branch:
+ * value}`, or `null`) and longs must be safe integers.
+ *
+ * A top-level record can also be projected onto a subset of its fields, the
+ * others are then skipped without being materialized.
+ *
+ */
+class Decoder : public Nan::ObjectWrap {
+public:
+  static v8::Local<v8::FunctionTemplate> Init();
+
+  /**
+   * Decode a value, returning an empty handle (and setting `error`) if the
+   * data is invalid. Trailing bytes are ignored.
+   *
+   */
+  v8::Local<v8::Value> Decode(const char *data, size_t size, const char **error);
+
+private:
+  enum Kind {
+    NUL,
+    BOOLEAN,
+    INT,
+    LONG,
+    FLOAT,
+    DOUBLE,
+    BYTES,
+    STRING,
+    RECORD,
+    ENUM,
+    ARRAY,
+    MAP,
+    FIXED,
+    UNION
+  };
+
+  struct Type {
+    Kind kind;
+    int32_t size; // Only for fixed types.
+    std::vector<int32_t> types; // Fields, branches, or items (values).
+    std::vector<int32_t> names; // Fields, branches, or symbols (into `_strings`).
+    std::vector<char> projected; // Fields to materialize.
+  };
+
+  struct Cursor {
+    const unsigned char *pos;
+    const unsigned char *end;
+    const char *error;
+  };
+
+  std::vector<Type> _types; // Root first.
+  std::vector<Nan::Persistent<v8::String> *> _strings;
+
+  Decoder();
+  ~Decoder();
+
+  int32_t Compile(v8::Local<v8::Value> schema, std::map<std::string, int32_t> &named, const char **error);
+  int32_t AddString(const std::string &str);
+  static bool Take(Cursor *cursor, int64_t size, const unsigned char **bytes);
+  static bool ReadLong(Cursor *cursor, int64_t *value);
+  static bool ReadBlockHeader(Cursor *cursor, int64_t *count, int64_t *size);
+  bool Read(int32_t index, Cursor *cursor, v8::Local<v8::Value> *value);
+  bool Skip(int32_t index, Cursor *cursor);
+
+  static void New(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void DecodeValue(const Nan::FunctionCallbackInfo<v8::Value> &info);
+};
+
+}
+
+#endif
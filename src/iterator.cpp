@@ -1,31 +1,69 @@
 #include "iterator.h"
 #include "store.h"
+#include <cstring>
+#include <string>
+#include <vector>
 
 namespace pal {
 
+/**
+ * Error message corresponding to a failed iterator.
+ *
+ */
+static const char *IteratorErrorMessage() {
+  switch (PAL_ERRNO) {
+    case ALLOC_FAIL:
+      return "memory allocation failure";
+    default:
+      return "invalid data";
+  }
+}
+
 class IteratorWorker : public Nan::AsyncWorker {
 public:
-  IteratorWorker(Nan::Callback *callback, pal_iterator_t *iterator) : AsyncWorker(callback) {
+  IteratorWorker(Nan::Callback *callback, Iterator *iterator, Snapshot *snapshot, Iterator::Mode mode) : AsyncWorker(callback) {
     _iterator = iterator;
+    _snapshot = snapshot;
+    _mode = mode;
   }
 
   ~IteratorWorker() {}
 
   void Execute() {
-    _nonEmpty = pal_iterator_next(_iterator, &_key, &_keySize, &_value, &_valueSize);
+    int ret = _iterator->Advance(&_key, &_keySize, &_value, &_valueSize);
+    if (ret < 0) {
+      SetErrorMessage(IteratorErrorMessage());
+    }
+    _nonEmpty = ret > 0;
   }
 
   void HandleOKCallback() {
     Nan::HandleScope scope;
     if (_nonEmpty) {
-      Nan::MaybeLocal<v8::Object> keyBuf = Nan::CopyBuffer(_key, _keySize);
-      Nan::MaybeLocal<v8::Object> valueBuf = Nan::CopyBuffer(_value, _valueSize);
+      Nan::MaybeLocal<v8::Object> keyBuf;
+      Nan::MaybeLocal<v8::Object> valueBuf;
+      if (_snapshot) {
+        keyBuf = _snapshot->NewView(_key, _keySize);
+        if (_mode == Iterator::ENTRIES) {
+          valueBuf = _snapshot->NewView(_value, _valueSize);
+        }
+      } else {
+        keyBuf = Nan::CopyBuffer(_key, _keySize);
+        if (_mode == Iterator::ENTRIES) {
+          valueBuf = Nan::CopyBuffer(_value, _valueSize);
+        }
+      }
       v8::Local<v8::Value> argv[] = {
         Nan::Null(),
         keyBuf.ToLocalChecked(),
-        valueBuf.ToLocalChecked()
+        Nan::Undefined()
       };
-      callback->Call(3, argv);
+      if (_mode == Iterator::ENTRIES) {
+        argv[2] = valueBuf.ToLocalChecked();
+      } else if (_mode == Iterator::SIZES) {
+        argv[2] = Nan::New<v8::Number>(_valueSize);
+      }
+      callback->Call(_mode == Iterator::KEYS ? 2 : 3, argv);
     } else {
       v8::Local<v8::Value> argv[] = {Nan::Null()};
       callback->Call(1, argv);
@@ -33,7 +71,9 @@ public:
   }
 
 private:
-  pal_iterator_t *_iterator;
+  Iterator *_iterator;
+  Snapshot *_snapshot; // Only set when returning views.
+  Iterator::Mode _mode;
   char *_key;
   int32_t _keySize;
   char *_value;
@@ -41,26 +81,450 @@ private:
   char _nonEmpty;
 };
 
-Iterator::Iterator(pal_reader_t *reader) {
-  pal_iterator_reset(&_iterator, reader);
+/**
+ * Worker returning up to a given number of entries per thread pool hop.
+ *
+ */
+class IteratorBatchWorker : public Nan::AsyncWorker {
+public:
+  IteratorBatchWorker(Nan::Callback *callback, Iterator *iterator, Snapshot *snapshot, Iterator::Mode mode, uint32_t batchSize, bool compressed) : AsyncWorker(callback) {
+    _iterator = iterator;
+    _snapshot = snapshot;
+    _mode = mode;
+    _batchSize = batchSize;
+    _compressed = compressed;
+  }
+
+  ~IteratorBatchWorker() {}
+
+  void Execute() {
+    _entries.reserve(_batchSize);
+    Entry entry;
+    while (_entries.size() < _batchSize) {
+      int ret = _iterator->Advance(&entry.key, &entry.keySize, &entry.value, &entry.valueSize);
+      if (ret < 0) {
+        SetErrorMessage(IteratorErrorMessage());
+        return;
+      }
+      if (!ret) {
+        break;
+      }
+      if (_compressed && _mode == Iterator::ENTRIES) {
+        // Decompressed values are only valid until the next call.
+        entry.valueOffset = _values.size();
+        _values.append(entry.value, entry.valueSize);
+      }
+      _entries.push_back(entry);
+    }
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    v8::Local<v8::Array> keyBufs = Nan::New<v8::Array>(_entries.size());
+    v8::Local<v8::Array> values = Nan::New<v8::Array>(
+      _mode == Iterator::KEYS ? 0 : _entries.size()
+    );
+    uint32_t i;
+    for (i = 0; i < _entries.size(); i++) {
+      Entry &entry = _entries[i];
+      if (_snapshot) {
+        Nan::Set(keyBufs, i, _snapshot->NewView(entry.key, entry.keySize).ToLocalChecked());
+      } else {
+        Nan::Set(keyBufs, i, Nan::CopyBuffer(entry.key, entry.keySize).ToLocalChecked());
+      }
+      if (_mode == Iterator::SIZES) {
+        Nan::Set(values, i, Nan::New<v8::Number>(entry.valueSize));
+      } else if (_mode == Iterator::ENTRIES && _snapshot) {
+        Nan::Set(values, i, _snapshot->NewView(entry.value, entry.valueSize).ToLocalChecked());
+      } else if (_mode == Iterator::ENTRIES) {
+        const char *value = _compressed ?
+          _values.data() + entry.valueOffset :
+          entry.value;
+        Nan::Set(values, i, Nan::CopyBuffer(value, entry.valueSize).ToLocalChecked());
+      }
+    }
+    v8::Local<v8::Value> argv[] = {Nan::Null(), keyBufs, values};
+    callback->Call(_mode == Iterator::KEYS ? 2 : 3, argv);
+  }
+
+private:
+  struct Entry {
+    char *key;
+    int32_t keySize;
+    char *value;
+    int64_t valueSize;
+    size_t valueOffset; // Into `_values`, for compressed stores.
+  };
+
+  Iterator *_iterator;
+  Snapshot *_snapshot; // Only set when returning views.
+  Iterator::Mode _mode;
+  uint32_t _batchSize;
+  bool _compressed;
+  std::vector<Entry> _entries;
+  std::string _values;
+};
+
+/**
+ * Worker counting an iterator's remaining entries (see `Iterator::Count`).
+ *
+ */
+class CountWorker : public Nan::AsyncWorker {
+public:
+  CountWorker(Nan::Callback *callback, Iterator *iterator) : AsyncWorker(callback) {
+    _iterator = iterator;
+  }
+
+  ~CountWorker() {}
+
+  void Execute() {
+    _count = _iterator->Count();
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    v8::Local<v8::Value> argv[] = {Nan::Null(), Nan::New<v8::Number>(_count)};
+    callback->Call(2, argv);
+  }
+
+private:
+  Iterator *_iterator;
+  int64_t _count;
+};
+
+Iterator::Iterator(Store *store, bool zeroCopy, Mode mode) {
+  _snapshot = store->_snapshot;
+  _snapshot->Ref();
+  _shard = 0;
+  _ranged = false;
+  _sequential = false;
+  _mode = mode;
+  _primed = false;
+  _last = -1;
+  _failed = false;
+  pal_iterator_reset(&_iterator, _snapshot->readers[0]);
+  // Compressed values aren't in the store's memory, they are always copied.
+  _zeroCopy = zeroCopy && !_snapshot->compressed;
+#ifdef PAL_CLEANUP_HOOKS
+  node::AddEnvironmentCleanupHook(v8::Isolate::GetCurrent(), Iterator::Release, this);
+#endif
 }
 
-Iterator::~Iterator() {}
+Iterator::~Iterator() {
+#ifdef PAL_CLEANUP_HOOKS
+  node::RemoveEnvironmentCleanupHook(v8::Isolate::GetCurrent(), Iterator::Release, this);
+#endif
+  Release(this);
+}
+
+/**
+ * Release the iterator's value copy and snapshot reference (also run when its
+ * thread's environment is torn down, see `PAL_CLEANUP_HOOKS`).
+ *
+ */
+void Iterator::Release(void *arg) {
+  Iterator *iterator = static_cast<Iterator *>(arg);
+  if (iterator->_snapshot != NULL) {
+    pal_iterator_destroy(&iterator->_iterator);
+    uint32_t i;
+    for (i = 0; i < iterator->_ordered.size(); i++) {
+      pal_iterator_destroy(&iterator->_ordered[i]);
+    }
+    iterator->_snapshot->Unref();
+    iterator->_snapshot = NULL;
+  }
+}
+
+/**
+ * Next entry (see `pal_iterator_next`), moving on to the following shard once
+ * one is exhausted. Range iterators stay within their shard. Only keys (and
+ * value sizes) are set unless the iterator returns entries.
+ *
+ * Returns 1 if an entry was found, 0 at the end, and -1 on error (see
+ * PAL_ERRNO). Errors are final, later calls fail too.
+ *
+ */
+int Iterator::Advance(char **key, int32_t *keySize, char **value, int64_t *valueSize) {
+  if (_failed) {
+    return -1;
+  }
+  if (!_ordered.empty()) {
+    return Merge(key, keySize, value, valueSize);
+  }
+  int ret;
+  while (!(ret = Step(&_iterator, key, keySize, value, valueSize))) {
+    if (_ranged || _shard + 1 >= _snapshot->readers.size()) {
+      return 0;
+    }
+    pal_iterator_destroy(&_iterator);
+    Reset(++_shard);
+  }
+  if (ret < 0) {
+    _failed = true;
+  }
+  return ret;
+}
+
+/**
+ * Number of entries left, exhausting the iterator (see `pal_iterator_count`,
+ * entries are only read for range iterators).
+ *
+ */
+int64_t Iterator::Count() {
+  int64_t count = 0;
+  uint32_t i;
+  if (!_ordered.empty()) {
+    for (i = 0; i < _ordered.size(); i++) {
+      count += pal_iterator_count(&_ordered[i]);
+      if (_primed && _heads[i].key != NULL && (int32_t) i != _last) {
+        count++; // Fetched but not returned yet.
+      }
+      _heads[i].key = NULL;
+    }
+    _primed = true;
+    _last = -1;
+    return count;
+  }
+  count = pal_iterator_count(&_iterator);
+  while (!_ranged && _shard + 1 < _snapshot->readers.size()) {
+    pal_iterator_destroy(&_iterator);
+    Reset(++_shard);
+    count += pal_iterator_count(&_iterator);
+  }
+  return count;
+}
+
+/**
+ * Start iterating over a shard.
+ *
+ */
+void Iterator::Reset(uint32_t shard) {
+  if (_sequential) {
+    pal_iterator_reset_sequential(&_iterator, _snapshot->readers[shard]);
+  } else {
+    pal_iterator_reset(&_iterator, _snapshot->readers[shard]);
+  }
+}
+
+/**
+ * Advance a single reader's iterator according to the iterator's mode.
+ *
+ */
+int Iterator::Step(pal_iterator_t *iterator, char **key, int32_t *keySize, char **value, int64_t *valueSize) {
+  switch (_mode) {
+    case KEYS:
+      return pal_iterator_next_key(iterator, key, keySize, NULL);
+    case SIZES:
+      return pal_iterator_next_key(iterator, key, keySize, valueSize);
+    default:
+      return pal_iterator_next(iterator, key, keySize, value, valueSize);
+  }
+}
+
+/**
+ * Next entry of an ordered iterator: the smallest of its shards' next keys.
+ * Each shard is only advanced once its entry was returned, so that entry stays
+ * valid until the following call (as with `pal_iterator_next`).
+ *
+ */
+int Iterator::Merge(char **key, int32_t *keySize, char **value, int64_t *valueSize) {
+  uint32_t i;
+  if (!_primed) {
+    for (i = 0; i < _ordered.size(); i++) {
+      Fetch(i);
+    }
+    _primed = true;
+  } else if (_last >= 0) {
+    Fetch(_last);
+  }
+  if (_failed) {
+    return -1;
+  }
+
+  _last = -1;
+  for (i = 0; i < _heads.size(); i++) {
+    Head &head = _heads[i];
+    if (head.key == NULL) {
+      continue;
+    }
+    if (_last >= 0) {
+      Head &best = _heads[_last];
+      int32_t size = head.keySize < best.keySize ? head.keySize : best.keySize;
+      int cmp = std::memcmp(head.key, best.key, size);
+      if (cmp > 0 || (!cmp && head.keySize >= best.keySize)) {
+        continue;
+      }
+    }
+    _last = i;
+  }
+  if (_last < 0) {
+    return 0;
+  }
+  Head &head = _heads[_last];
+  *key = head.key;
+  *keySize = head.keySize;
+  *value = head.value;
+  *valueSize = head.valueSize;
+  return 1;
+}
+
+/**
+ * Advance one of an ordered iterator's shards, failing the whole iterator if
+ * it can't be read.
+ *
+ */
+void Iterator::Fetch(uint32_t shard) {
+  Head &head = _heads[shard];
+  int ret = Step(&_ordered[shard], &head.key, &head.keySize, &head.value, &head.valueSize);
+  if (ret <= 0) {
+    head.key = NULL;
+  }
+  if (ret < 0) {
+    _failed = true;
+  }
+}
 
 // v8 exposed functions.
 
 /**
  * JS constructor.
  *
+ * If the second argument is truthy, keys and values are returned as views
+ * into the store's memory instead of copies (see `Snapshot::NewView`), except
+ * for compressed stores. An
+ * optional third argument restricts iteration to one of the ranges returned
+ * by `Store::GetRanges`; iterators over distinct ranges can run concurrently.
+ * It can instead hold a `prefix` buffer, or `gte` and `lt` bounds (buffers,
+ * either can be omitted), to iterate in byte order over the matching keys of
+ * a store written with the `ordered` option. Finally, it can set `sequential`
+ * to iterate over the whole store in data order (see
+ * `pal_iterator_reset_sequential`), for scans of stores larger than memory.
+ *
+ * A fourth argument, `'keys'` or `'sizes'`, makes the iterator return only
+ * keys, or keys and value sizes, without reading any values.
+ *
  */
 void Iterator::New(const Nan::FunctionCallbackInfo<v8::Value> &info) {
-  if (info.Length() != 1 || !info[0]->IsObject()) {
+  if (
+    info.Length() < 1 ||
+    info.Length() > 4 ||
+    !info[0]->IsObject() ||
+    (info.Length() >= 3 && !info[2]->IsUndefined() && !info[2]->IsObject()) ||
+    (info.Length() == 4 && !info[3]->IsUndefined() && !info[3]->IsString())
+  ) {
     Nan::ThrowError("invalid arguments");
     return;
   }
 
+  Mode mode = ENTRIES;
+  if (info.Length() == 4 && info[3]->IsString()) {
+    std::string name(*Nan::Utf8String(info[3]));
+    if (name == "keys") {
+      mode = KEYS;
+    } else if (name == "sizes") {
+      mode = SIZES;
+    } else {
+      Nan::ThrowError("invalid mode");
+      return;
+    }
+  }
+
   Store *store = ObjectWrap::Unwrap<Store>(info[0]->ToObject());
-  Iterator *iter = new Iterator(store->_reader);
+  bool zeroCopy = info.Length() >= 2 && Nan::To<bool>(info[1]).FromJust();
+  Iterator *iter = new Iterator(store, zeroCopy, mode);
+  bool hasRange = info.Length() >= 3 && info[2]->IsObject();
+  v8::Local<v8::Object> obj;
+  v8::Local<v8::Value> prefix, gte, lt, sequential;
+  if (hasRange) {
+    obj = info[2]->ToObject();
+    prefix = Nan::Get(obj, Nan::New("prefix").ToLocalChecked()).ToLocalChecked();
+    gte = Nan::Get(obj, Nan::New("gte").ToLocalChecked()).ToLocalChecked();
+    lt = Nan::Get(obj, Nan::New("lt").ToLocalChecked()).ToLocalChecked();
+    sequential = Nan::Get(obj, Nan::New("sequential").ToLocalChecked()).ToLocalChecked();
+  }
+  if (hasRange && Nan::To<bool>(sequential).FromJust()) {
+    if (
+      !prefix->IsUndefined() ||
+      !gte->IsUndefined() ||
+      !lt->IsUndefined() ||
+      !Nan::Get(obj, Nan::New("keySize").ToLocalChecked()).ToLocalChecked()->IsUndefined()
+    ) {
+      delete iter;
+      Nan::ThrowError("sequential iterators span whole stores");
+      return;
+    }
+    iter->_sequential = true;
+    iter->Reset(0);
+  } else if (
+    hasRange &&
+    (!prefix->IsUndefined() || !gte->IsUndefined() || !lt->IsUndefined())
+  ) {
+    if (
+      (!prefix->IsUndefined() && !node::Buffer::HasInstance(prefix)) ||
+      (!gte->IsUndefined() && !node::Buffer::HasInstance(gte)) ||
+      (!lt->IsUndefined() && !node::Buffer::HasInstance(lt)) ||
+      (!prefix->IsUndefined() && !(gte->IsUndefined() && lt->IsUndefined()))
+    ) {
+      delete iter;
+      Nan::ThrowError("invalid arguments");
+      return;
+    }
+    std::vector<pal_reader_t *> &readers = iter->_snapshot->readers;
+    iter->_ordered.resize(readers.size());
+    iter->_heads.resize(readers.size());
+    uint32_t i;
+    for (i = 0; i < readers.size(); i++) {
+      if (!pal_ordered(readers[i])) {
+        delete iter;
+        Nan::ThrowError("store has no key directory");
+        return;
+      }
+      int ret = !prefix->IsUndefined() ?
+        pal_iterator_reset_prefix(
+          &iter->_ordered[i],
+          readers[i],
+          node::Buffer::Data(prefix),
+          node::Buffer::Length(prefix)
+        ) :
+        pal_iterator_reset_bounds(
+          &iter->_ordered[i],
+          readers[i],
+          gte->IsUndefined() ? NULL : node::Buffer::Data(gte),
+          gte->IsUndefined() ? 0 : node::Buffer::Length(gte),
+          lt->IsUndefined() ? NULL : node::Buffer::Data(lt),
+          lt->IsUndefined() ? 0 : node::Buffer::Length(lt)
+        );
+      if (ret) {
+        delete iter;
+        Nan::ThrowError("invalid key directory");
+        return;
+      }
+    }
+  } else if (hasRange) {
+    pal_range_t range;
+    range.key_size = Nan::To<int32_t>(
+      Nan::Get(obj, Nan::New("keySize").ToLocalChecked()).ToLocalChecked()
+    ).FromJust();
+    range.start_slot = Nan::To<int32_t>(
+      Nan::Get(obj, Nan::New("startSlot").ToLocalChecked()).ToLocalChecked()
+    ).FromJust();
+    range.end_slot = Nan::To<int32_t>(
+      Nan::Get(obj, Nan::New("endSlot").ToLocalChecked()).ToLocalChecked()
+    ).FromJust();
+    uint32_t shard = Nan::To<uint32_t>( // 0 if missing (unsharded stores).
+      Nan::Get(obj, Nan::New("shard").ToLocalChecked()).ToLocalChecked()
+    ).FromJust();
+    if (
+      shard >= iter->_snapshot->readers.size() ||
+      pal_iterator_reset_range(&iter->_iterator, iter->_snapshot->readers[shard], &range)
+    ) {
+      delete iter;
+      Nan::ThrowError("invalid range");
+      return;
+    }
+    iter->_shard = shard;
+    iter->_ranged = true;
+  }
   iter->Wrap(info.This());
   info.GetReturnValue().Set(info.This());
 }
@@ -68,16 +532,62 @@ void Iterator::New(const Nan::FunctionCallbackInfo<v8::Value> &info) {
 /**
  * Advance the iterator.
  *
+ * Called either with a single callback, passed the next key and value (or
+ * nothing once the iterator is exhausted), or with a batch size and a
+ * callback, passed arrays of up to that many keys and values (fewer only once
+ * the iterator is exhausted). Values are replaced by their sizes, or omitted,
+ * depending on the iterator's mode.
+ *
  */
 void Iterator::Next(const Nan::FunctionCallbackInfo<v8::Value> &info) {
-  if (info.Length() != 1 || !info[0]->IsFunction()) {
+  Iterator *iterator = ObjectWrap::Unwrap<Iterator>(info.This());
+  Nan::AsyncWorker *worker;
+  if (info.Length() == 1 && info[0]->IsFunction()) {
+    Nan::Callback *callback = new Nan::Callback(info[0].As<v8::Function>());
+    worker = new IteratorWorker(
+      callback,
+      iterator,
+      iterator->_zeroCopy ? iterator->_snapshot : NULL,
+      iterator->_mode
+    );
+  } else if (
+    info.Length() == 2 &&
+    info[0]->IsUint32() &&
+    Nan::To<uint32_t>(info[0]).FromJust() > 0 &&
+    info[1]->IsFunction()
+  ) {
+    Nan::Callback *callback = new Nan::Callback(info[1].As<v8::Function>());
+    worker = new IteratorBatchWorker(
+      callback,
+      iterator,
+      iterator->_zeroCopy ? iterator->_snapshot : NULL,
+      iterator->_mode,
+      Nan::To<uint32_t>(info[0]).FromJust(),
+      iterator->_snapshot->compressed
+    );
+  } else {
     Nan::ThrowError("invalid arguments");
     return;
   }
+  worker->SaveToPersistent("iterator", info.This());
+  Nan::AsyncQueueWorker(worker);
+}
 
+/**
+ * Count the iterator's remaining entries, exhausting it.
+ *
+ * Takes a callback, passed the count. Ordered and full iterators don't read
+ * any entries (see `pal_iterator_count`).
+ *
+ */
+void Iterator::CountEntries(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  if (info.Length() != 1 || !info[0]->IsFunction()) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
   Iterator *iterator = ObjectWrap::Unwrap<Iterator>(info.This());
   Nan::Callback *callback = new Nan::Callback(info[0].As<v8::Function>());
-  IteratorWorker *worker = new IteratorWorker(callback, &iterator->_iterator);
+  CountWorker *worker = new CountWorker(callback, iterator);
   worker->SaveToPersistent("iterator", info.This());
   Nan::AsyncQueueWorker(worker);
 }
@@ -91,6 +601,7 @@ v8::Local<v8::FunctionTemplate> Iterator::Init() {
   tpl->SetClassName(Nan::New("Iterator").ToLocalChecked());
   tpl->InstanceTemplate()->SetInternalFieldCount(1);
   Nan::SetPrototypeMethod(tpl, "next", Iterator::Next);
+  Nan::SetPrototypeMethod(tpl, "count", Iterator::CountEntries);
   return tpl;
 }
 
@@ -3,6 +3,8 @@
 
 #include <nan.h>
 #include <node.h>
+#include <vector>
+#include "store.h"
 
 extern "C" {
   #include "../deps/paldb/include/paldb.h"
@@ -13,24 +15,64 @@ namespace pal {
 /**
  * Iterator over a store's entries.
  *
- * Warning:
+ * Iterators hold a reference to the store's version they were created over
+ * (see `Snapshot`): they keep iterating over it even if the store is swapped
+ * meanwhile, and it isn't unmapped before they are garbage collected.
  *
- *  The store's reader must not be destroyed during the lifetime of its
- *  iterators.
+ * Ordered iterators (over a prefix or between bounds) follow the key
+ * directory of each shard, merging shards to return keys in byte order.
  *
  */
 class Iterator : public Nan::ObjectWrap {
 public:
+  // What each entry returns, keys only and value sizes never read values.
+  enum Mode {
+    ENTRIES,
+    KEYS,
+    SIZES
+  };
+
   static v8::Local<v8::FunctionTemplate> Init();
 
+  int Advance(char **key, int32_t *keySize, char **value, int64_t *valueSize);
+  int64_t Count();
+
 private:
+  // Next entry of one of an ordered iterator's shards.
+  struct Head {
+    char *key; // NULL once the shard is exhausted.
+    int32_t keySize;
+    char *value;
+    int64_t valueSize;
+  };
+
   pal_iterator_t _iterator;
+  Snapshot *_snapshot;
+  uint32_t _shard; // Index of the reader `_iterator` is over.
+  bool _ranged;
+  bool _sequential; // Whether to iterate in data order.
+  bool _zeroCopy; // Whether to return views (rather than copies).
+  Mode _mode;
+  std::vector<pal_iterator_t> _ordered; // One per shard, only for ordered
+                                        // iterators.
+  std::vector<Head> _heads; // Likewise.
+  bool _primed; // Whether `_heads` were fetched.
+  int32_t _last; // Shard of the last entry returned, -1 if none.
+  bool _failed; // Whether a shard's iterator failed, see `Advance`.
 
-  Iterator(pal_reader_t *reader);
+  Iterator(Store *store, bool zeroCopy, Mode mode);
   ~Iterator();
 
+  void Reset(uint32_t shard);
+  int Step(pal_iterator_t *iterator, char **key, int32_t *keySize, char **value, int64_t *valueSize);
+  int Merge(char **key, int32_t *keySize, char **value, int64_t *valueSize);
+  void Fetch(uint32_t shard);
+
+  static void Release(void *arg);
+
   static void New(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void Next(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void CountEntries(const Nan::FunctionCallbackInfo<v8::Value> &info);
 };
 
 }
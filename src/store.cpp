@@ -1,49 +1,516 @@
 #include "store.h"
+#include "decoder.h"
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
 
 namespace pal {
 
-Store::Store(char *path) {
-  _reader = pal_init(path);
-  if (_reader == NULL) {
-    switch (PAL_ERRNO) {
-      case NO_FILE:
-        Nan::ThrowError("no such file");
-        break;
-      case STAT_FAIL:
-        Nan::ThrowError("unable to get file size");
-        break;
-      case ALLOC_FAIL:
-        Nan::ThrowError("memory allocation failure");
-        break;
-      case MMAP_FAIL:
-        Nan::ThrowError("memory mapping failure");
+/**
+ * Batch lookup, run on the thread pool (page faults on cold stores then don't
+ * block the event loop). Values are also copied there (faulting in their
+ * pages too, and decompressing those of compressed stores), the main thread
+ * only wraps them in buffers.
+ *
+ */
+class ReadWorker : public Nan::AsyncWorker {
+public:
+  ReadWorker(Nan::Callback *callback, Store *store, uint32_t numKeys) :
+    AsyncWorker(callback),
+    _keys(numKeys),
+    _keySizes(numKeys),
+    _values(numKeys),
+    _valueSizes(numKeys),
+    _valueOffsets(numKeys) {
+    _store = store;
+    _snapshot = store->_snapshot; // Kept even if the store is swapped meanwhile.
+    _snapshot->Ref();
+  }
+
+  ~ReadWorker() {
+    _snapshot->Unref();
+  }
+
+  void SetKey(uint32_t i, char *key, int32_t keySize) {
+    _keys[i] = key;
+    _keySizes[i] = keySize;
+  }
+
+  void Execute() {
+    uint32_t i;
+    if (!_snapshot->compressed) {
+      _snapshot->GetBatch(
+        _keys.size(),
+        _keys.data(),
+        _keySizes.data(),
+        NULL,
+        _values.data(),
+        _valueSizes.data()
+      );
+      size_t size = 0;
+      for (i = 0; i < _keys.size(); i++) {
+        if (_valueSizes[i] > 0) {
+          size += _valueSizes[i];
+        }
+      }
+      _data.reserve(size);
+      for (i = 0; i < _keys.size(); i++) {
+        _valueOffsets[i] = _data.size();
+        if (_valueSizes[i] > 0) {
+          _data.append(_values[i], _valueSizes[i]);
+        }
+      }
+      return;
+    }
+
+    for (i = 0; i < _keys.size(); i++) {
+      // Size the value first, the second read then hits the block cache.
+      int32_t hash = pal_hash(_keys[i], _keySizes[i]);
+      pal_reader_t *reader = _snapshot->Route(hash);
+      int64_t valueSize = pal_read(reader, _keys[i], _keySizes[i], hash, NULL, 0);
+      size_t offset = _data.size();
+      if (valueSize > 0) {
+        _data.resize(offset + valueSize);
+        valueSize = pal_read(reader, _keys[i], _keySizes[i], hash, &_data[offset], valueSize);
+      }
+      if (valueSize == -2) {
+        SetErrorMessage("invalid data");
+        return;
+      }
+      _valueOffsets[i] = offset;
+      _valueSizes[i] = valueSize;
+    }
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    v8::Local<v8::Array> valueBufs = Nan::New<v8::Array>(_keys.size());
+    uint32_t i;
+    for (i = 0; i < _keys.size(); i++) {
+      _store->CountLookup(_valueSizes[i]);
+      if (_valueSizes[i] < 0) {
+        Nan::Set(valueBufs, i, Nan::Undefined());
+      } else {
+        Nan::Set(
+          valueBufs,
+          i,
+          Nan::CopyBuffer(_data.data() + _valueOffsets[i], _valueSizes[i]).ToLocalChecked()
+        );
+        _store->CountCopy(_valueSizes[i]);
+      }
+    }
+    v8::Local<v8::Value> argv[] = {Nan::Null(), valueBufs};
+    callback->Call(2, argv);
+  }
+
+private:
+  Store *_store;
+  Snapshot *_snapshot;
+  std::vector<char *> _keys;
+  std::vector<int32_t> _keySizes;
+  std::vector<char *> _values;
+  std::vector<int64_t> _valueSizes;
+  std::vector<size_t> _valueOffsets; // Into `_data`.
+  std::string _data; // Values, back to back.
+};
+
+/**
+ * Swap worker, opening (and warming, see `pal_warm`) a store's new version on
+ * the thread pool. It is only published once ready, lookups meanwhile keep
+ * using the current one.
+ *
+ */
+class SwapWorker : public Nan::AsyncWorker {
+public:
+  SwapWorker(Nan::Callback *callback, Store *store, const char *path) :
+    AsyncWorker(callback),
+    _path(path) {
+    _store = store;
+    _snapshot = NULL;
+  }
+
+  ~SwapWorker() {
+    if (_snapshot != NULL) {
+      _snapshot->Unref(); // Never published.
+    }
+  }
+
+  void Execute() {
+    const char *error;
+    _snapshot = Snapshot::Open(_path.c_str(), &error);
+    if (_snapshot == NULL) {
+      SetErrorMessage(error);
+      return;
+    }
+    uint32_t i;
+    for (i = 0; i < _snapshot->readers.size(); i++) {
+      pal_warm(_snapshot->readers[i]);
+    }
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    _store->Publish(_snapshot);
+    _snapshot = NULL;
+    v8::Local<v8::Value> argv[] = {Nan::Null()};
+    callback->Call(1, argv);
+  }
+
+private:
+  Store *_store;
+  Snapshot *_snapshot;
+  std::string _path;
+};
+
+/**
+ * Error message corresponding to a failed `pal_init`.
+ *
+ */
+static const char *InitErrorMessage() {
+  switch (PAL_ERRNO) {
+    case NO_FILE:
+      return "no such file";
+    case STAT_FAIL:
+      return "unable to get file size";
+    case ALLOC_FAIL:
+      return "memory allocation failure";
+    case MMAP_FAIL:
+      return "memory mapping failure";
+    default:
+      return "invalid file";
+  }
+}
+
+FileId::FileId(const struct stat &st) {
+  dev = st.st_dev;
+  ino = st.st_ino;
+  size = st.st_size;
+#ifdef __APPLE__
+  mtime = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+  mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+}
+
+bool FileId::operator<(const FileId &other) const {
+  if (dev != other.dev) {
+    return dev < other.dev;
+  }
+  if (ino != other.ino) {
+    return ino < other.ino;
+  }
+  if (size != other.size) {
+    return size < other.size;
+  }
+  return mtime < other.mtime;
+}
+
+// Open snapshots, by file(s). Its lock also guards all snapshots' reference
+// counts, so that a snapshot is never found here while being destroyed.
+static std::map<std::vector<FileId>, Snapshot *> registry;
+static std::map<double, Snapshot *> handles; // All live snapshots.
+static double lastHandle = 0;
+static uv_mutex_t registryLock;
+static uv_once_t registryOnce = UV_ONCE_INIT;
+
+static void InitRegistry() {
+  uv_mutex_init(&registryLock);
+}
+
+Snapshot *Snapshot::Open(const char *path, const char **error) {
+  uint64_t start = uv_hrtime();
+  uv_once(&registryOnce, InitRegistry);
+
+  std::vector<std::string> paths;
+  std::vector<FileId> files;
+  struct stat st;
+  if (stat(path, &st) || !S_ISDIR(st.st_mode)) {
+    paths.push_back(path);
+  } else {
+    // Sharded store, its shards are the files up to the next missing index.
+    std::vector<char> shardPath(std::strlen(path) + 16);
+    while (true) {
+      std::snprintf(
+        shardPath.data(),
+        shardPath.size(),
+        "%s/%u",
+        path,
+        static_cast<unsigned>(paths.size())
+      );
+      if (stat(shardPath.data(), &st)) {
         break;
-      default:
-        Nan::ThrowError("invalid file");
+      }
+      paths.push_back(shardPath.data());
+      files.push_back(FileId(st));
+    }
+    if (paths.empty()) {
+      *error = "no shards";
+      return NULL;
+    }
+  }
+  if (files.size() < paths.size() && !stat(path, &st)) {
+    files.push_back(FileId(st));
+  }
+
+  Snapshot *snapshot = NULL;
+  uv_mutex_lock(&registryLock);
+  std::map<std::vector<FileId>, Snapshot *>::iterator it = registry.find(files);
+  if (it != registry.end()) {
+    snapshot = it->second;
+    snapshot->_refs++;
+  }
+  uv_mutex_unlock(&registryLock);
+  if (snapshot != NULL) {
+    return snapshot;
+  }
+
+  snapshot = new Snapshot();
+  uint32_t i;
+  for (i = 0; i < paths.size(); i++) {
+    pal_reader_t *reader = pal_init(paths[i].c_str());
+    if (reader == NULL) {
+      *error = InitErrorMessage();
+      delete snapshot;
+      return NULL;
+    }
+    snapshot->readers.push_back(reader);
+    snapshot->compressed = snapshot->compressed || pal_compressed(reader);
+  }
+  snapshot->openTime = uv_hrtime() - start;
+
+  uv_mutex_lock(&registryLock);
+  snapshot->_handle = ++lastHandle;
+  handles[snapshot->_handle] = snapshot;
+  if (files.size() == paths.size()) {
+    // Another thread may have opened the same files meanwhile, the latest
+    // snapshot is registered (the other stays valid, just unshared).
+    snapshot->_files = files;
+    registry[files] = snapshot;
+  }
+  uv_mutex_unlock(&registryLock);
+  return snapshot;
+}
+
+Snapshot *Snapshot::Find(double handle) {
+  uv_once(&registryOnce, InitRegistry);
+  Snapshot *snapshot = NULL;
+  uv_mutex_lock(&registryLock);
+  std::map<double, Snapshot *>::iterator it = handles.find(handle);
+  if (it != handles.end()) {
+    snapshot = it->second;
+    snapshot->_refs++;
+  }
+  uv_mutex_unlock(&registryLock);
+  return snapshot;
+}
+
+Snapshot::~Snapshot() {
+  uint32_t i;
+  for (i = 0; i < readers.size(); i++) {
+    pal_destroy(readers[i]);
+  }
+}
+
+void Snapshot::Ref() {
+  uv_mutex_lock(&registryLock);
+  _refs++;
+  uv_mutex_unlock(&registryLock);
+}
+
+void Snapshot::Unref() {
+  uv_mutex_lock(&registryLock);
+  bool released = !--_refs;
+  if (released) {
+    handles.erase(_handle);
+    if (!_files.empty()) {
+      std::map<std::vector<FileId>, Snapshot *>::iterator it = registry.find(_files);
+      if (it != registry.end() && it->second == this) {
+        registry.erase(it);
+      }
+    }
+  }
+  uv_mutex_unlock(&registryLock);
+  if (released) {
+    delete this;
+  }
+}
+
+/**
+ * Turn a store's lookup counters on or off. Counters belong to the files'
+ * readers, they are only turned off once no store using this snapshot wants
+ * them anymore (calls must be balanced, see `Store::Publish`).
+ *
+ */
+void Snapshot::EnableMetrics(bool enabled) {
+  uv_mutex_lock(&registryLock);
+  bool changed = enabled ? !_metricsRefs++ : !--_metricsRefs;
+  if (changed) {
+    uint32_t i;
+    for (i = 0; i < readers.size(); i++) {
+      pal_enable_metrics(readers[i], enabled);
     }
   }
+  uv_mutex_unlock(&registryLock);
+}
+
+/**
+ * Batch lookup (see `pal_get_batch`), keys of sharded stores are grouped by
+ * shard so that each shard's lookups stay interleaved.
+ *
+ */
+void Snapshot::GetBatch(uint32_t numKeys, char **keys, int32_t *keySizes, int32_t *hashes, char **values, int64_t *valueSizes) {
+  if (readers.size() == 1) {
+    pal_get_batch(readers[0], numKeys, keys, keySizes, hashes, values, valueSizes);
+    return;
+  }
+
+  std::vector<std::vector<uint32_t> > shardIndices(readers.size());
+  std::vector<int32_t> keyHashes(numKeys);
+  uint32_t i, j;
+  for (i = 0; i < numKeys; i++) {
+    keyHashes[i] = hashes != NULL ? hashes[i] : pal_hash(keys[i], keySizes[i]);
+    shardIndices[pal_shard(keyHashes[i], readers.size())].push_back(i);
+  }
+
+  std::vector<char *> shardKeys;
+  std::vector<int32_t> shardKeySizes;
+  std::vector<int32_t> shardHashes;
+  std::vector<char *> shardValues;
+  std::vector<int64_t> shardValueSizes;
+  for (i = 0; i < readers.size(); i++) {
+    std::vector<uint32_t> &indices = shardIndices[i];
+    if (indices.empty()) {
+      continue;
+    }
+    shardKeys.resize(indices.size());
+    shardKeySizes.resize(indices.size());
+    shardHashes.resize(indices.size());
+    shardValues.resize(indices.size());
+    shardValueSizes.resize(indices.size());
+    for (j = 0; j < indices.size(); j++) {
+      shardKeys[j] = keys[indices[j]];
+      shardKeySizes[j] = keySizes[indices[j]];
+      shardHashes[j] = keyHashes[indices[j]];
+    }
+    pal_get_batch(
+      readers[i],
+      indices.size(),
+      shardKeys.data(),
+      shardKeySizes.data(),
+      shardHashes.data(),
+      shardValues.data(),
+      shardValueSizes.data()
+    );
+    for (j = 0; j < indices.size(); j++) {
+      values[indices[j]] = shardValues[j];
+      valueSizes[indices[j]] = shardValueSizes[j];
+    }
+  }
+}
+
+Nan::MaybeLocal<v8::Object> Snapshot::NewView(char *data, int64_t size) {
+  Ref(); // Released when the buffer is collected.
+  return Nan::NewBuffer(data, size, Snapshot::ReleaseView, this);
+}
+
+void Snapshot::ReleaseView(char *data, void *hint) {
+  static_cast<Snapshot *>(hint)->Unref();
+}
+
+Store::Store(Snapshot *snapshot) {
+  _snapshot = NULL;
+  _metrics = false;
+  _hits = 0;
+  _misses = 0;
+  _bytesCopied = 0;
+  Publish(snapshot);
+#ifdef PAL_CLEANUP_HOOKS
+  node::AddEnvironmentCleanupHook(v8::Isolate::GetCurrent(), Store::Release, this);
+#endif
 }
 
 Store::~Store() {
-  if (_reader) {
-    pal_destroy(_reader);
+#ifdef PAL_CLEANUP_HOOKS
+  node::RemoveEnvironmentCleanupHook(v8::Isolate::GetCurrent(), Store::Release, this);
+#endif
+  Release(this);
+}
+
+/**
+ * Drop the store's reference to its current version (also run when its
+ * thread's environment is torn down, see `PAL_CLEANUP_HOOKS`).
+ *
+ */
+void Store::Release(void *arg) {
+  Store *store = static_cast<Store *>(arg);
+  if (store->_snapshot != NULL) {
+    if (store->_metrics) {
+      store->_snapshot->EnableMetrics(false);
+    }
+    store->_snapshot->Unref();
+    store->_snapshot = NULL;
   }
 }
 
+/**
+ * Make a snapshot the store's current version, taking over its reference.
+ *
+ * Only the store's own reference to the previous version is released, which
+ * is therefore destroyed once no iterator, pending read, or view still uses it.
+ * Lookups are all made on the store's thread (asynchronous reads capture their
+ * snapshot when queued), so none can see a partially swapped store.
+ *
+ */
+void Store::Publish(Snapshot *snapshot) {
+  if (_metrics) {
+    snapshot->EnableMetrics(true);
+  }
+  if (_snapshot != NULL) {
+    if (_metrics) {
+      _snapshot->EnableMetrics(false);
+    }
+    _snapshot->Unref();
+  }
+  _snapshot = snapshot;
+  _partitions.clear();
+  _partitionShards.clear();
+}
+
 // v8 exposed functions.
 
 /**
  * Constructor, will be called from JS when doing `new Store()`.
  *
+ * Takes either a path (to a store file or sharded store directory), or the
+ * handle of an open store (see `getHandle`), possibly from another thread.
+ *
  */
 void Store::New(const Nan::FunctionCallbackInfo<v8::Value> &info) {
-  if (info.Length() != 1 || !info[0]->IsString()) {
+  if (info.Length() != 1 || (!info[0]->IsString() && !info[0]->IsNumber())) {
     Nan::ThrowError("invalid arguments");
     return;
   }
 
-  Nan::Utf8String path(info[0]);
-  Store *store = new Store(*path);
+  Snapshot *snapshot;
+  if (info[0]->IsNumber()) {
+    snapshot = Snapshot::Find(Nan::To<double>(info[0]).FromJust());
+    if (snapshot == NULL) {
+      Nan::ThrowError("stale handle");
+      return;
+    }
+  } else {
+    Nan::Utf8String path(info[0]);
+    const char *error;
+    snapshot = Snapshot::Open(*path, &error);
+    if (snapshot == NULL) {
+      Nan::ThrowError(error);
+      return;
+    }
+  }
+  Store *store = new Store(snapshot);
   store->Wrap(info.This());
   info.GetReturnValue().Set(info.This());
 }
@@ -51,12 +518,24 @@ void Store::New(const Nan::FunctionCallbackInfo<v8::Value> &info) {
 /**
  * Get a key. Attached to `Store`'s prototype.
  *
+ * An optional third argument can be passed with the key's precomputed hash
+ * (as returned by `hash`).
+ *
  */
 void Store::Read(const Nan::FunctionCallbackInfo<v8::Value> &info) {
-  if (info.Length() != 2 || info[0]->IsUndefined() || info[1]->IsUndefined()) {
+  if (
+    info.Length() < 2 ||
+    info.Length() > 3 ||
+    info[0]->IsUndefined() ||
+    info[1]->IsUndefined()
+  ) {
     Nan::ThrowError("wrong number of arguments");
     return;
   }
+  if (info.Length() == 3 && !info[2]->IsUint32()) {
+    Nan::ThrowError("invalid hash");
+    return;
+  }
 
   v8::Local<v8::Object> keyBuf = info[0]->ToObject();
   v8::Local<v8::Object> valueBuf = info[1]->ToObject();
@@ -69,7 +548,6 @@ void Store::Read(const Nan::FunctionCallbackInfo<v8::Value> &info) {
   }
 
   Store *store = ObjectWrap::Unwrap<Store>(info.This());
-  pal_reader_t *reader = store->_reader;
 
   size_t keySize = node::Buffer::Length(keyBuf);
   if (!keySize) {
@@ -77,28 +555,432 @@ void Store::Read(const Nan::FunctionCallbackInfo<v8::Value> &info) {
     return;
   }
 
+  char *key = node::Buffer::Data(keyBuf);
+  int32_t hash = info.Length() == 3 ?
+    Nan::To<uint32_t>(info[2]).FromJust() :
+    pal_hash(key, keySize);
   int64_t availableValueSize = node::Buffer::Length(valueBuf);
-  char *value;
-  int64_t valueSize;
-  if (!pal_get(reader, node::Buffer::Data(keyBuf), keySize, &value, &valueSize)) {
-    // Key not found.
-    valueSize = -1;
-  } else if (valueSize > availableValueSize) {
+  int64_t valueSize = pal_read(
+    store->_snapshot->Route(hash),
+    key,
+    keySize,
+    hash,
+    node::Buffer::Data(valueBuf),
+    availableValueSize
+  );
+  if (valueSize == -2) {
+    Nan::ThrowError("invalid data");
+    return;
+  }
+  store->CountLookup(valueSize);
+  if (valueSize > availableValueSize) {
     // Return ~N (where N is the number of missing bytes).
     valueSize = ~(valueSize - availableValueSize);
-  } else {
-    // Value fits in destination buffer.
-    std::memcpy(node::Buffer::Data(valueBuf), value, valueSize);
+  } else if (valueSize >= 0) {
+    // Value was copied to the destination buffer (-1 if the key is missing).
+    store->CountCopy(valueSize);
   }
   info.GetReturnValue().Set(Nan::New<v8::Integer>(static_cast<int>(valueSize)));
 }
 
+/**
+ * Get several keys at once. Attached to `Store`'s prototype.
+ *
+ * Values are copied back to back into the destination buffer and an array
+ * containing each value's length (-1 if missing) is returned. If the values
+ * don't all fit, nothing is copied and ~N is returned instead (where N is the
+ * number of missing bytes). Precomputed hashes can optionally be passed as a
+ * third `Uint32Array` argument (see `hashMany`).
+ *
+ * Values of compressed stores are decompressed directly into the destination
+ * buffer, which may then be partially written to when they don't all fit.
+ *
+ */
+void Store::ReadMany(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  if (
+    info.Length() < 2 ||
+    info.Length() > 3 ||
+    !info[0]->IsArray() ||
+    info[1]->IsUndefined() ||
+    (info.Length() == 3 && !info[2]->IsUint32Array())
+  ) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
+
+  v8::Local<v8::Array> keyBufs = info[0].As<v8::Array>();
+  v8::Local<v8::Object> valueBuf = info[1]->ToObject();
+  if (!node::Buffer::HasInstance(valueBuf)) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
+
+  Store *store = ObjectWrap::Unwrap<Store>(info.This());
+  uint32_t numKeys = keyBufs->Length();
+  std::vector<char *> keys(numKeys);
+  std::vector<int32_t> keySizes(numKeys);
+  std::vector<char *> values(numKeys);
+  std::vector<int64_t> valueSizes(numKeys);
+  uint32_t i;
+  for (i = 0; i < numKeys; i++) {
+    v8::Local<v8::Value> keyBuf = Nan::Get(keyBufs, i).ToLocalChecked();
+    if (!node::Buffer::HasInstance(keyBuf)) {
+      Nan::ThrowError("invalid arguments");
+      return;
+    }
+    keys[i] = node::Buffer::Data(keyBuf);
+    keySizes[i] = node::Buffer::Length(keyBuf);
+    if (!keySizes[i]) {
+      Nan::ThrowError("empty key");
+      return;
+    }
+  }
+
+  int32_t *hashes = NULL;
+  if (info.Length() == 3) {
+    Nan::TypedArrayContents<uint32_t> contents(info[2]);
+    if (contents.length() < numKeys) {
+      Nan::ThrowError("missing hashes");
+      return;
+    }
+    hashes = reinterpret_cast<int32_t *>(*contents);
+  }
+
+  char *data = node::Buffer::Data(valueBuf);
+  int64_t availableValueSize = node::Buffer::Length(valueBuf);
+  int64_t totalValueSize = 0;
+  bool compressed = store->_snapshot->compressed;
+  if (compressed) {
+    for (i = 0; i < numKeys; i++) {
+      int64_t remainingSize = availableValueSize - totalValueSize;
+      int32_t hash = hashes != NULL ? hashes[i] : pal_hash(keys[i], keySizes[i]);
+      valueSizes[i] = pal_read(
+        store->_snapshot->Route(hash),
+        keys[i],
+        keySizes[i],
+        hash,
+        remainingSize > 0 ? data + totalValueSize : NULL,
+        remainingSize > 0 ? remainingSize : 0
+      );
+      if (valueSizes[i] == -2) {
+        Nan::ThrowError("invalid data");
+        return;
+      }
+      if (valueSizes[i] > 0) {
+        totalValueSize += valueSizes[i];
+      }
+    }
+  } else {
+    store->_snapshot->GetBatch(
+      numKeys,
+      keys.data(),
+      keySizes.data(),
+      hashes,
+      values.data(),
+      valueSizes.data()
+    );
+    for (i = 0; i < numKeys; i++) {
+      if (valueSizes[i] > 0) {
+        totalValueSize += valueSizes[i];
+      }
+    }
+  }
+  for (i = 0; i < numKeys; i++) {
+    store->CountLookup(valueSizes[i]);
+  }
+  if (totalValueSize > availableValueSize) {
+    int64_t missingSize = ~(totalValueSize - availableValueSize);
+    info.GetReturnValue().Set(Nan::New<v8::Integer>(static_cast<int>(missingSize)));
+    return;
+  }
+
+  v8::Local<v8::Array> sizes = Nan::New<v8::Array>(numKeys);
+  for (i = 0; i < numKeys; i++) {
+    if (valueSizes[i] > 0) {
+      if (!compressed) {
+        std::memcpy(data, values[i], valueSizes[i]);
+        data += valueSizes[i];
+      }
+      store->CountCopy(valueSizes[i]);
+    }
+    Nan::Set(sizes, i, Nan::New<v8::Integer>(static_cast<int>(valueSizes[i])));
+  }
+  info.GetReturnValue().Set(sizes);
+}
+
+/**
+ * Get several keys asynchronously. Attached to `Store`'s prototype.
+ *
+ * The callback is passed an array containing a buffer per key found (and
+ * `undefined` for missing keys).
+ *
+ */
+void Store::ReadAsync(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  if (info.Length() != 2 || !info[0]->IsArray() || !info[1]->IsFunction()) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
+
+  v8::Local<v8::Array> keyBufs = info[0].As<v8::Array>();
+  uint32_t numKeys = keyBufs->Length();
+  std::vector<v8::Local<v8::Value> > keys(numKeys);
+  uint32_t i;
+  for (i = 0; i < numKeys; i++) {
+    keys[i] = Nan::Get(keyBufs, i).ToLocalChecked();
+    if (!node::Buffer::HasInstance(keys[i])) {
+      Nan::ThrowError("invalid arguments");
+      return;
+    }
+    if (!node::Buffer::Length(keys[i])) {
+      Nan::ThrowError("empty key");
+      return;
+    }
+  }
+
+  Store *store = ObjectWrap::Unwrap<Store>(info.This());
+  Nan::Callback *callback = new Nan::Callback(info[1].As<v8::Function>());
+  ReadWorker *worker = new ReadWorker(callback, store, numKeys);
+  for (i = 0; i < numKeys; i++) {
+    worker->SetKey(i, node::Buffer::Data(keys[i]), node::Buffer::Length(keys[i]));
+  }
+  worker->SaveToPersistent("store", info.This());
+  worker->SaveToPersistent("keys", keyBufs); // Keep key buffers alive.
+  Nan::AsyncQueueWorker(worker);
+}
+
+/**
+ * Get a key without copying its value. Attached to `Store`'s prototype.
+ *
+ * Returns a read-only view into the store's memory (see `Snapshot::NewView`), or
+ * `undefined` if the key is missing. Values of compressed stores can't be
+ * viewed in place, a copy is returned instead.
+ *
+ */
+void Store::ReadView(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  if (info.Length() != 1 || !node::Buffer::HasInstance(info[0])) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
+
+  size_t keySize = node::Buffer::Length(info[0]);
+  if (!keySize) {
+    Nan::ThrowError("empty key");
+    return;
+  }
+
+  Store *store = ObjectWrap::Unwrap<Store>(info.This());
+  char *key = node::Buffer::Data(info[0]);
+  int32_t hash = pal_hash(key, keySize);
+  pal_reader_t *reader = store->_snapshot->Route(hash);
+  if (pal_compressed(reader)) {
+    int64_t valueSize = pal_read(reader, key, keySize, hash, NULL, 0);
+    if (valueSize == -2) {
+      Nan::ThrowError("invalid data");
+      return;
+    }
+    store->CountLookup(valueSize);
+    if (valueSize >= 0) {
+      v8::Local<v8::Object> valueBuf = Nan::NewBuffer(valueSize).ToLocalChecked();
+      if (pal_read(reader, key, keySize, hash, node::Buffer::Data(valueBuf), valueSize) != valueSize) {
+        // The buffer would be left uninitialized.
+        Nan::ThrowError("invalid data");
+        return;
+      }
+      store->CountCopy(valueSize);
+      info.GetReturnValue().Set(valueBuf);
+    }
+    return;
+  }
+  char *value;
+  int64_t valueSize;
+  if (pal_get_hashed(reader, key, keySize, hash, &value, &valueSize) <= 0) {
+    valueSize = -1;
+  }
+  store->CountLookup(valueSize);
+  if (valueSize >= 0) {
+    info.GetReturnValue().Set(store->_snapshot->NewView(value, valueSize).ToLocalChecked());
+  }
+}
+
+/**
+ * Get a key and decode its value. Attached to `Store`'s prototype.
+ *
+ * The second argument is a `Decoder`, run directly on the store's memory (no
+ * intermediate buffer is allocated, values of compressed stores are
+ * decompressed into a scratch buffer reused across calls). Returns `undefined`
+ * if the key is missing.
+ *
+ */
+void Store::ReadValue(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  if (
+    info.Length() != 2 ||
+    !node::Buffer::HasInstance(info[0]) ||
+    !info[1]->IsObject()
+  ) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
+
+  size_t keySize = node::Buffer::Length(info[0]);
+  if (!keySize) {
+    Nan::ThrowError("empty key");
+    return;
+  }
+
+  Store *store = ObjectWrap::Unwrap<Store>(info.This());
+  Decoder *decoder = ObjectWrap::Unwrap<Decoder>(info[1]->ToObject());
+  char *key = node::Buffer::Data(info[0]);
+  int32_t hash = pal_hash(key, keySize);
+  pal_reader_t *reader = store->_snapshot->Route(hash);
+  char *value;
+  int64_t valueSize;
+  if (pal_compressed(reader)) {
+    valueSize = pal_read(
+      reader,
+      key,
+      keySize,
+      hash,
+      store->_scratch.data(),
+      store->_scratch.size()
+    );
+    if (valueSize > static_cast<int64_t>(store->_scratch.size())) {
+      store->_scratch.resize(valueSize);
+      valueSize = pal_read(reader, key, keySize, hash, store->_scratch.data(), valueSize);
+    }
+    if (valueSize == -2) {
+      Nan::ThrowError("invalid data");
+      return;
+    }
+    value = store->_scratch.data();
+  } else if (pal_get_hashed(reader, key, keySize, hash, &value, &valueSize) <= 0) {
+    valueSize = -1;
+  }
+  store->CountLookup(valueSize);
+  if (valueSize == -1) {
+    return;
+  }
+
+  const char *error;
+  v8::Local<v8::Value> decoded = decoder->Decode(value, valueSize, &error);
+  if (decoded.IsEmpty()) {
+    Nan::ThrowError(error);
+    return;
+  }
+  info.GetReturnValue().Set(decoded);
+}
+
+/**
+ * Replace the store's file(s) with a newer version. Attached to `Store`'s
+ * prototype.
+ *
+ * The new version (a file or sharded directory, as in the constructor) is
+ * opened and its indices faulted in on the thread pool, then published before
+ * the callback is called. The previous version stays mapped until its last
+ * iterator, pending `readAsync`, and view are done with it. If several swaps
+ * overlap, the one which finishes last wins.
+ *
+ */
+void Store::Swap(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  if (info.Length() != 2 || !info[0]->IsString() || !info[1]->IsFunction()) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
+
+  Store *store = ObjectWrap::Unwrap<Store>(info.This());
+  Nan::Utf8String path(info[0]);
+  Nan::Callback *callback = new Nan::Callback(info[1].As<v8::Function>());
+  SwapWorker *worker = new SwapWorker(callback, store, *path);
+  worker->SaveToPersistent("store", info.This());
+  Nan::AsyncQueueWorker(worker);
+}
+
+/**
+ * Handle to the store's current version. Attached to `Store`'s prototype.
+ *
+ * The handle is a number, which can be posted to worker threads: passing it
+ * to their `Store` constructor opens the same version without any system call
+ * (threads then share its mappings and block cache). It becomes stale once the
+ * version is destroyed, so it should be used while the store is still open and
+ * not swapped.
+ *
+ */
+void Store::GetHandle(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  Store *store = ObjectWrap::Unwrap<Store>(info.This());
+  info.GetReturnValue().Set(Nan::New<v8::Number>(store->_snapshot->Handle()));
+}
+
+/**
+ * Split the store's entries into disjoint ranges, which can then be iterated
+ * over concurrently (see `Iterator`). Ranges never span shards, each shard
+ * gets its share of the `n` requested.
+ *
+ */
+void Store::GetRanges(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  if (info.Length() != 1 || !info[0]->IsUint32()) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
+
+  Store *store = ObjectWrap::Unwrap<Store>(info.This());
+  uint32_t numShards = store->_snapshot->readers.size();
+  int32_t n = (Nan::To<uint32_t>(info[0]).FromJust() + numShards - 1) / numShards;
+  std::vector<pal_range_t> ranges;
+  std::vector<uint32_t> shards;
+  uint32_t i;
+  for (i = 0; i < numShards; i++) {
+    size_t offset = ranges.size();
+    ranges.resize(offset + pal_ranges(store->_snapshot->readers[i], n, NULL));
+    pal_ranges(store->_snapshot->readers[i], n, ranges.data() + offset);
+    shards.resize(ranges.size(), i);
+  }
+
+  v8::Local<v8::Array> arr = Nan::New<v8::Array>(ranges.size());
+  for (i = 0; i < ranges.size(); i++) {
+    v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+    obj->Set(
+      Nan::New("shard").ToLocalChecked(),
+      Nan::New<v8::Integer>(shards[i])
+    );
+    obj->Set(
+      Nan::New("keySize").ToLocalChecked(),
+      Nan::New<v8::Integer>(ranges[i].key_size)
+    );
+    obj->Set(
+      Nan::New("startSlot").ToLocalChecked(),
+      Nan::New<v8::Integer>(ranges[i].start_slot)
+    );
+    obj->Set(
+      Nan::New("endSlot").ToLocalChecked(),
+      Nan::New<v8::Integer>(ranges[i].end_slot)
+    );
+    Nan::Set(arr, i, obj);
+  }
+  info.GetReturnValue().Set(arr);
+}
+
+/**
+ * Persisted statistics. Those of sharded stores are summed across shards, with
+ * the most recent shard's creation timestamp.
+ *
+ */
 void Store::GetStatistics(const Nan::FunctionCallbackInfo<v8::Value> &info) {
   Nan::EscapableHandleScope scope;
 
   Store *store = ObjectWrap::Unwrap<Store>(info.This());
   pal_statistics_t stats;
-  pal_statistics(store->_reader, &stats);
+  pal_statistics(store->_snapshot->readers[0], &stats);
+  uint32_t i;
+  for (i = 1; i < store->_snapshot->readers.size(); i++) {
+    pal_statistics_t shardStats;
+    pal_statistics(store->_snapshot->readers[i], &shardStats);
+    if (shardStats.timestamp > stats.timestamp) {
+      stats.timestamp = shardStats.timestamp;
+    }
+    stats.num_keys += shardStats.num_keys;
+    stats.num_values += shardStats.num_values;
+    stats.index_size += shardStats.index_size;
+    stats.data_size += shardStats.data_size;
+  }
 
   v8::Local<v8::Object> obj = Nan::New<v8::Object>();
   obj->Set(
@@ -117,15 +999,175 @@ void Store::GetStatistics(const Nan::FunctionCallbackInfo<v8::Value> &info) {
     Nan::New("dataSize").ToLocalChecked(),
     Nan::New<v8::Number>(stats.data_size)
   );
+  obj->Set(
+    Nan::New("numShards").ToLocalChecked(),
+    Nan::New<v8::Integer>(static_cast<uint32_t>(store->_snapshot->readers.size()))
+  );
 
   info.GetReturnValue().Set(scope.Escape(obj));
 }
 
+/**
+ * Turn lookup counters on or off (see `pal_enable_metrics`). The files' own
+ * counters stay on while any store open on them (see `Snapshot`) has enabled
+ * metrics.
+ *
+ */
+void Store::EnableMetrics(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  if (info.Length() != 1 || !info[0]->IsBoolean()) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
+
+  Store *store = ObjectWrap::Unwrap<Store>(info.This());
+  bool enabled = Nan::To<bool>(info[0]).FromJust();
+  if (enabled != store->_metrics) {
+    store->_metrics = enabled;
+    store->_snapshot->EnableMetrics(enabled);
+  }
+}
+
+/**
+ * Runtime measurements, as opposed to the store's persisted statistics.
+ *
+ * Contains `openTime`, the time spent in `pal_init` (in milliseconds), lookup
+ * counters (only incremented while enabled, see `enableMetrics`), and each
+ * partition's index layout. The latter is computed on the first call, which
+ * requires a pass over the entire index.
+ *
+ * `hits`, `misses`, and `bytesCopied` count this store's own lookups (not its
+ * iterators') and carry over swaps. The other counters belong to the files:
+ * `filtered` counts the misses answered by a membership filter,
+ * `probeLengths` the slots inspected, `blockHits` and `blockMisses` the block
+ * cache lookups of compressed stores. They include the lookups of all stores
+ * open on the same files (while any has metrics enabled), are summed across
+ * shards, and restart after a swap (see `swap`). Partitions are listed by
+ * shard.
+ *
+ */
+void Store::GetMetrics(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  Nan::EscapableHandleScope scope;
+
+  Store *store = ObjectWrap::Unwrap<Store>(info.This());
+  uint32_t i, j;
+  if (store->_partitions.empty()) {
+    for (i = 0; i < store->_snapshot->readers.size(); i++) {
+      size_t offset = store->_partitions.size();
+      int32_t numPartitions = pal_partition_statistics(store->_snapshot->readers[i], 0, NULL);
+      store->_partitions.resize(offset + numPartitions);
+      pal_partition_statistics(
+        store->_snapshot->readers[i],
+        numPartitions,
+        store->_partitions.data() + offset
+      );
+      store->_partitionShards.resize(store->_partitions.size(), i);
+    }
+  }
+  pal_metrics_t metrics;
+  pal_metrics(store->_snapshot->readers[0], &metrics);
+  for (i = 1; i < store->_snapshot->readers.size(); i++) {
+    pal_metrics_t shardMetrics;
+    pal_metrics(store->_snapshot->readers[i], &shardMetrics);
+    metrics.num_filtered += shardMetrics.num_filtered;
+    metrics.num_block_hits += shardMetrics.num_block_hits;
+    metrics.num_block_misses += shardMetrics.num_block_misses;
+    for (j = 0; j < PAL_PROBE_BUCKETS; j++) {
+      metrics.probe_lengths[j] += shardMetrics.probe_lengths[j];
+    }
+  }
+
+  v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+  obj->Set(
+    Nan::New("openTime").ToLocalChecked(),
+    Nan::New<v8::Number>(store->_snapshot->openTime / 1e6)
+  );
+  obj->Set(
+    Nan::New("hits").ToLocalChecked(),
+    Nan::New<v8::Number>(store->_hits)
+  );
+  obj->Set(
+    Nan::New("misses").ToLocalChecked(),
+    Nan::New<v8::Number>(store->_misses)
+  );
+  obj->Set(
+    Nan::New("filtered").ToLocalChecked(),
+    Nan::New<v8::Number>(metrics.num_filtered)
+  );
+  obj->Set(
+    Nan::New("blockHits").ToLocalChecked(),
+    Nan::New<v8::Number>(metrics.num_block_hits)
+  );
+  obj->Set(
+    Nan::New("blockMisses").ToLocalChecked(),
+    Nan::New<v8::Number>(metrics.num_block_misses)
+  );
+  v8::Local<v8::Array> probeLengths = Nan::New<v8::Array>(PAL_PROBE_BUCKETS);
+  for (i = 0; i < PAL_PROBE_BUCKETS; i++) {
+    Nan::Set(probeLengths, i, Nan::New<v8::Number>(metrics.probe_lengths[i]));
+  }
+  obj->Set(Nan::New("probeLengths").ToLocalChecked(), probeLengths);
+  obj->Set(
+    Nan::New("bytesCopied").ToLocalChecked(),
+    Nan::New<v8::Number>(store->_bytesCopied)
+  );
+
+  v8::Local<v8::Array> partitions = Nan::New<v8::Array>(store->_partitions.size());
+  for (i = 0; i < store->_partitions.size(); i++) {
+    pal_partition_statistics_t *stats = &store->_partitions[i];
+    v8::Local<v8::Object> partition = Nan::New<v8::Object>();
+    partition->Set(
+      Nan::New("shard").ToLocalChecked(),
+      Nan::New<v8::Integer>(store->_partitionShards[i])
+    );
+    partition->Set(
+      Nan::New("keySize").ToLocalChecked(),
+      Nan::New<v8::Integer>(stats->key_size)
+    );
+    partition->Set(
+      Nan::New("numKeys").ToLocalChecked(),
+      Nan::New<v8::Integer>(stats->num_keys)
+    );
+    partition->Set(
+      Nan::New("numSlots").ToLocalChecked(),
+      Nan::New<v8::Integer>(stats->num_slots)
+    );
+    partition->Set(
+      Nan::New("slotSize").ToLocalChecked(),
+      Nan::New<v8::Integer>(stats->slot_size)
+    );
+    partition->Set(
+      Nan::New("loadFactor").ToLocalChecked(),
+      Nan::New<v8::Number>(stats->load_factor)
+    );
+    partition->Set(
+      Nan::New("meanDisplacement").ToLocalChecked(),
+      Nan::New<v8::Number>(stats->mean_displacement)
+    );
+    partition->Set(
+      Nan::New("maxDisplacement").ToLocalChecked(),
+      Nan::New<v8::Integer>(stats->max_displacement)
+    );
+    partition->Set(
+      Nan::New("filterSize").ToLocalChecked(),
+      Nan::New<v8::Integer>(stats->filter_size)
+    );
+    Nan::Set(partitions, i, partition);
+  }
+  obj->Set(Nan::New("partitions").ToLocalChecked(), partitions);
+
+  info.GetReturnValue().Set(scope.Escape(obj));
+}
+
+/**
+ * Store metadata, that of the first shard for sharded stores (shards are
+ * written with the same metadata).
+ *
+ */
 void Store::GetMetadata(const Nan::FunctionCallbackInfo<v8::Value> &info) {
   Store *store = ObjectWrap::Unwrap<Store>(info.This());
   char *addr;
   int32_t size;
-  pal_metadata(store->_reader, &addr, &size);
+  pal_metadata(store->_snapshot->readers[0], &addr, &size);
   Nan::MaybeLocal<v8::Object> buf = Nan::CopyBuffer(addr, size);
   info.GetReturnValue().Set(buf.ToLocalChecked());
 }
@@ -139,8 +1181,17 @@ v8::Local<v8::FunctionTemplate> Store::Init() {
   tpl->SetClassName(Nan::New("Store").ToLocalChecked());
   tpl->InstanceTemplate()->SetInternalFieldCount(1);
   Nan::SetPrototypeMethod(tpl, "read", Store::Read);
+  Nan::SetPrototypeMethod(tpl, "readMany", Store::ReadMany);
+  Nan::SetPrototypeMethod(tpl, "readAsync", Store::ReadAsync);
+  Nan::SetPrototypeMethod(tpl, "readView", Store::ReadView);
+  Nan::SetPrototypeMethod(tpl, "readValue", Store::ReadValue);
+  Nan::SetPrototypeMethod(tpl, "swap", Store::Swap);
+  Nan::SetPrototypeMethod(tpl, "getHandle", Store::GetHandle);
+  Nan::SetPrototypeMethod(tpl, "getRanges", Store::GetRanges);
   Nan::SetPrototypeMethod(tpl, "getStatistics", Store::GetStatistics);
   Nan::SetPrototypeMethod(tpl, "getMetadata", Store::GetMetadata);
+  Nan::SetPrototypeMethod(tpl, "enableMetrics", Store::EnableMetrics);
+  Nan::SetPrototypeMethod(tpl, "getMetrics", Store::GetMetrics);
   return tpl;
 }
 
@@ -3,6 +3,9 @@
 
 #include <nan.h>
 #include <node.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <vector>
 
 extern "C" {
   #include "../deps/paldb/include/paldb.h"
@@ -10,26 +13,166 @@ extern "C" {
 
 namespace pal {
 
+// Objects of exiting worker threads aren't necessarily garbage collected,
+// their snapshot references are then released by environment cleanup hooks.
+#if NODE_MAJOR_VERSION > 10 || (NODE_MAJOR_VERSION == 10 && NODE_MINOR_VERSION >= 2)
+#define PAL_CLEANUP_HOOKS
+#endif
+
+/**
+ * Identifies a version of a store file: its device and inode, along with its
+ * size and modification time (inodes of deleted files get reused, e.g. when a
+ * store is rewritten at the same path).
+ *
+ */
+struct FileId {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  int64_t mtime; // Nanoseconds.
+
+  explicit FileId(const struct stat &st);
+  bool operator<(const FileId &other) const;
+};
+
+/**
+ * Readers of one version of a store's file(s).
+ *
+ * Snapshots are reference counted: each store holds one on its current
+ * version, and so do its iterators, pending asynchronous reads, and views. A
+ * swapped out version is destroyed (unmapped) once the last of these is done
+ * with it.
+ *
+ * Snapshots are also shared process-wide: opening files which are already
+ * open (same `FileId`s, whatever the path used) returns the existing
+ * snapshot, so stores on the same files share their mappings, parsed headers,
+ * block caches, and lookup counters. This includes stores of other threads'
+ * contexts (`worker_threads`), which can also reference a given snapshot by
+ * its handle (see `Find`).
+ *
+ */
+class Snapshot {
+public:
+  std::vector<pal_reader_t *> readers; // One per shard.
+  bool compressed; // Whether any shard is (see `pal_compressed`).
+  uint64_t openTime; // Nanoseconds.
+
+  /**
+   * Open a store file or sharded store directory (or reference the snapshot
+   * already open on the same files), safe to call off the main thread. Returns
+   * NULL (and sets `error`) on failure.
+   *
+   */
+  static Snapshot *Open(const char *path, const char **error);
+
+  /**
+   * Reference the snapshot with a given handle (see `Handle`), from any
+   * thread. Returns NULL if it has since been destroyed.
+   *
+   */
+  static Snapshot *Find(double handle);
+
+  // Process-wide identifier, never reused.
+  double Handle() const { return _handle; }
+
+  void Ref();
+  void Unref();
+  void EnableMetrics(bool enabled);
+
+  pal_reader_t *Route(int32_t hash) {
+    return readers.size() == 1 ?
+      readers[0] :
+      readers[pal_shard(hash, readers.size())];
+  }
+
+  void GetBatch(uint32_t numKeys, char **keys, int32_t *keySizes, int32_t *hashes, char **values, int64_t *valueSizes);
+
+  /**
+   * Buffer pointing directly into the snapshot's mapped memory.
+   *
+   * The snapshot is kept alive until all such views are garbage collected. The
+   * mapping is read-only, views must not be written to.
+   *
+   */
+  Nan::MaybeLocal<v8::Object> NewView(char *data, int64_t size);
+
+private:
+  uint32_t _refs; // Guarded by the registry's lock.
+  uint32_t _metricsRefs; // Stores with metrics enabled, guarded likewise.
+  double _handle;
+  std::vector<FileId> _files; // Registry key, empty if unregistered.
+
+  Snapshot() : compressed(false), openTime(0), _refs(1), _metricsRefs(0), _handle(0) {}
+  ~Snapshot();
+
+  static void ReleaseView(char *data, void *hint);
+};
+
 /**
  * Store reader.
  *
+ * Stores can also be sharded: a directory of store files named `0` to `N -
+ * 1`, each holding the keys routed to it by `pal_shard` (see `Writer`). All
+ * methods then behave as if the shards were a single store.
+ *
+ * A store can be swapped for a newer version of itself while in use (see
+ * `Store::Swap`): lookups see either version, never a mix of both.
+ *
  */
 class Store : public Nan::ObjectWrap {
 public:
   static v8::Local<v8::FunctionTemplate> Init();
 
   friend class Iterator;
+  friend class ReadWorker;
+  friend class SwapWorker;
 
 private:
-  pal_reader_t *_reader;
+  Snapshot *_snapshot; // Current version.
+  bool _metrics;
+  uint64_t _hits;
+  uint64_t _misses;
+  uint64_t _bytesCopied;
+  std::vector<pal_partition_statistics_t> _partitions; // Computed lazily.
+  std::vector<uint32_t> _partitionShards;
+  std::vector<char> _scratch; // Compressed stores' values, see `readValue`.
 
-  Store(char *path);
+  Store(Snapshot *snapshot);
   ~Store();
 
+  void Publish(Snapshot *snapshot);
+  static void Release(void *arg);
+
+  // Lookup result: a value's size, or -1 if its key is missing.
+  void CountLookup(int64_t valueSize) {
+    if (_metrics) {
+      if (valueSize >= 0) {
+        _hits++;
+      } else {
+        _misses++;
+      }
+    }
+  }
+
+  void CountCopy(int64_t size) {
+    if (_metrics) {
+      _bytesCopied += size;
+    }
+  }
+
   static void New(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void Read(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void ReadMany(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void ReadAsync(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void ReadView(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void ReadValue(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void Swap(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void GetHandle(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void GetRanges(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void GetStatistics(const Nan::FunctionCallbackInfo<v8::Value> &info);
   static void GetMetadata(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void EnableMetrics(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void GetMetrics(const Nan::FunctionCallbackInfo<v8::Value> &info);
 };
 
 }
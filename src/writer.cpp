@@ -0,0 +1,481 @@
+#include "writer.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace pal {
+
+/**
+ * Human readable version of the writer's error codes.
+ *
+ */
+static const char *ErrorMessage(enum pal_error error) {
+  switch (error) {
+    case NO_FILE:
+      return "unable to create file";
+    case ALLOC_FAIL:
+      return "memory allocation failure";
+    case WRITE_FAIL:
+      return "write failure";
+    case DUPLICATE_KEY:
+      return "duplicate key";
+    default:
+      return "invalid data";
+  }
+}
+
+/**
+ * Shards left to close by `WriterWorker`'s threads.
+ *
+ */
+struct CloseQueue {
+  std::vector<pal_writer_t *> writers;
+  std::vector<pal_statistics_t> stats;
+  std::vector<bool> failures;
+  enum pal_error error; // Approximate, `PAL_ERRNO` is shared across threads.
+  size_t next;
+  uv_mutex_t lock;
+};
+
+static void RunCloseQueue(void *arg) {
+  CloseQueue *queue = static_cast<CloseQueue *>(arg);
+  while (true) {
+    uv_mutex_lock(&queue->lock);
+    size_t i = queue->next++;
+    uv_mutex_unlock(&queue->lock);
+    if (i >= queue->writers.size()) {
+      return;
+    }
+    if (pal_writer_close(queue->writers[i], &queue->stats[i])) {
+      uv_mutex_lock(&queue->lock);
+      queue->failures[i] = true;
+      queue->error = PAL_ERRNO;
+      uv_mutex_unlock(&queue->lock);
+    }
+  }
+}
+
+/**
+ * Writes the store, on the thread pool. Shards are written in parallel, by up
+ * to one thread per core (this one included).
+ *
+ */
+class WriterWorker : public Nan::AsyncWorker {
+public:
+  WriterWorker(Nan::Callback *callback, Writer *writer) : AsyncWorker(callback) {
+    _writer = writer;
+  }
+
+  ~WriterWorker() {}
+
+  void Execute() {
+    CloseQueue queue;
+    queue.writers = _writer->_writers;
+    queue.stats.resize(queue.writers.size());
+    queue.failures.resize(queue.writers.size(), false);
+    queue.next = 0;
+    if (uv_mutex_init(&queue.lock)) {
+      SetErrorMessage("unable to create lock");
+      return;
+    }
+
+    uv_cpu_info_t *cpus;
+    int numCpus = 1;
+    if (!uv_cpu_info(&cpus, &numCpus)) {
+      uv_free_cpu_info(cpus, numCpus);
+    }
+    std::vector<uv_thread_t> threads;
+    size_t i;
+    for (i = 1; i < queue.writers.size() && i < static_cast<size_t>(numCpus); i++) {
+      uv_thread_t thread;
+      if (uv_thread_create(&thread, RunCloseQueue, &queue)) {
+        break; // The threads already started will pick up the rest.
+      }
+      threads.push_back(thread);
+    }
+    RunCloseQueue(&queue);
+    for (i = 0; i < threads.size(); i++) {
+      uv_thread_join(&threads[i]);
+    }
+    uv_mutex_destroy(&queue.lock);
+
+    std::memset(&_stats, 0, sizeof _stats);
+    for (i = 0; i < queue.writers.size(); i++) {
+      if (queue.failures[i]) {
+        SetErrorMessage(ErrorMessage(queue.error));
+        return;
+      }
+      _stats.num_keys += queue.stats[i].num_keys;
+      _stats.num_values += queue.stats[i].num_values;
+      _stats.index_size += queue.stats[i].index_size;
+      _stats.data_size += queue.stats[i].data_size;
+    }
+  }
+
+  void HandleOKCallback() {
+    Nan::HandleScope scope;
+    v8::Local<v8::Object> obj = Nan::New<v8::Object>();
+    obj->Set(
+      Nan::New("numKeys").ToLocalChecked(),
+      Nan::New<v8::Number>(_stats.num_keys)
+    );
+    obj->Set(
+      Nan::New("numValues").ToLocalChecked(),
+      Nan::New<v8::Number>(_stats.num_values)
+    );
+    obj->Set(
+      Nan::New("indexSize").ToLocalChecked(),
+      Nan::New<v8::Number>(_stats.index_size)
+    );
+    obj->Set(
+      Nan::New("dataSize").ToLocalChecked(),
+      Nan::New<v8::Number>(_stats.data_size)
+    );
+    v8::Local<v8::Value> argv[] = {Nan::Null(), obj};
+    callback->Call(2, argv);
+  }
+
+private:
+  Writer *_writer;
+  pal_statistics_t _stats;
+};
+
+Writer::Writer(std::vector<pal_writer_t *> &writers) {
+  _closed = false;
+  _writers.swap(writers);
+}
+
+/**
+ * Whether a directory has no entries (besides `.` and `..`).
+ *
+ */
+static bool IsEmptyDirectory(const char *path) {
+  DIR *dir = opendir(path);
+  if (dir == NULL) {
+    return false;
+  }
+  bool empty = true;
+  struct dirent *entry;
+  while (empty && (entry = readdir(dir)) != NULL) {
+    empty = !std::strcmp(entry->d_name, ".") || !std::strcmp(entry->d_name, "..");
+  }
+  closedir(dir);
+  return empty;
+}
+
+Writer *Writer::Open(char *path, pal_writer_options_t *opts, uint32_t numShards, const char **error) {
+  std::vector<pal_writer_t *> writers;
+  if (!numShards) {
+    pal_writer_t *writer = pal_writer_init(path, opts);
+    if (writer == NULL) {
+      *error = ErrorMessage(PAL_ERRNO);
+      return NULL;
+    }
+    writers.push_back(writer);
+    return new Writer(writers);
+  }
+
+  // Sharded store, a directory with one file per shard (see `Store`). Readers
+  // open shards up to the first missing one, so the directory mustn't hold
+  // any other store's.
+  bool created = !mkdir(path, 0777);
+  if (!created && errno != EEXIST) {
+    *error = "unable to create directory";
+    return NULL;
+  }
+  if (!created && !IsEmptyDirectory(path)) {
+    *error = "not an empty directory";
+    return NULL;
+  }
+  std::vector<char> shardPath(std::strlen(path) + 16);
+  uint32_t i;
+  for (i = 0; i < numShards; i++) {
+    std::snprintf(shardPath.data(), shardPath.size(), "%s/%u", path, i);
+    pal_writer_t *writer = pal_writer_init(shardPath.data(), opts);
+    if (writer == NULL) {
+      *error = ErrorMessage(PAL_ERRNO);
+      uint32_t j;
+      for (j = 0; j < writers.size(); j++) {
+        pal_writer_destroy(writers[j]);
+      }
+      if (created) {
+        rmdir(path);
+      }
+      return NULL;
+    }
+    writers.push_back(writer);
+  }
+  return new Writer(writers);
+}
+
+Writer::~Writer() {
+  uint32_t i;
+  for (i = 0; i < _writers.size(); i++) {
+    pal_writer_destroy(_writers[i]);
+  }
+}
+
+// v8 exposed functions.
+
+/**
+ * Constructor, called from JS as `new Writer(path, opts)`.
+ *
+ * Supported options are `loadFactor`, `noDistinct`, `bucketized` (write a
+ * cache line aligned bucketized index), `filterBits` (membership filter bits
+ * per key, none are written by default), `blockSize` (compress values in
+ * blocks of about this many bytes, they are stored as is by default),
+ * `ordered` (also write a key directory, for prefix and bound iterators),
+ * `valueCacheSize` (bytes of values
+ * remembered to deduplicate identical ones, 0 to disable), `memoryBudget`
+ * (bytes of keys and indices held in memory, split evenly between shards;
+ * items beyond are spilled to `tmpDir`), `numShards` (write a sharded store,
+ * i.e. a new or empty directory with this many store files, rather than a
+ * single file),
+ * `numThreads` (threads building each store file's indices, defaults to one
+ * per core divided between shards), `metadata` (a buffer), and `tmpDir`
+ * (where values are buffered until the store is written).
+ *
+ */
+void Writer::New(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  if (info.Length() != 2 || !info[0]->IsString() || !info[1]->IsObject()) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
+
+  v8::Local<v8::Object> opts = info[1]->ToObject();
+  v8::Local<v8::Value> loadFactor = Nan::Get(
+    opts, Nan::New("loadFactor").ToLocalChecked()
+  ).ToLocalChecked();
+  v8::Local<v8::Value> noDistinct = Nan::Get(
+    opts, Nan::New("noDistinct").ToLocalChecked()
+  ).ToLocalChecked();
+  v8::Local<v8::Value> bucketized = Nan::Get(
+    opts, Nan::New("bucketized").ToLocalChecked()
+  ).ToLocalChecked();
+  v8::Local<v8::Value> filterBits = Nan::Get(
+    opts, Nan::New("filterBits").ToLocalChecked()
+  ).ToLocalChecked();
+  v8::Local<v8::Value> blockSize = Nan::Get(
+    opts, Nan::New("blockSize").ToLocalChecked()
+  ).ToLocalChecked();
+  v8::Local<v8::Value> ordered = Nan::Get(
+    opts, Nan::New("ordered").ToLocalChecked()
+  ).ToLocalChecked();
+  v8::Local<v8::Value> valueCacheSize = Nan::Get(
+    opts, Nan::New("valueCacheSize").ToLocalChecked()
+  ).ToLocalChecked();
+  v8::Local<v8::Value> memoryBudget = Nan::Get(
+    opts, Nan::New("memoryBudget").ToLocalChecked()
+  ).ToLocalChecked();
+  v8::Local<v8::Value> numShards = Nan::Get(
+    opts, Nan::New("numShards").ToLocalChecked()
+  ).ToLocalChecked();
+  v8::Local<v8::Value> numThreads = Nan::Get(
+    opts, Nan::New("numThreads").ToLocalChecked()
+  ).ToLocalChecked();
+  v8::Local<v8::Value> metadata = Nan::Get(
+    opts, Nan::New("metadata").ToLocalChecked()
+  ).ToLocalChecked();
+  v8::Local<v8::Value> tmpDir = Nan::Get(
+    opts, Nan::New("tmpDir").ToLocalChecked()
+  ).ToLocalChecked();
+
+  pal_writer_options_t options;
+  std::memset(&options, 0, sizeof options);
+  if (loadFactor->IsNumber()) {
+    options.load_factor = Nan::To<double>(loadFactor).FromJust();
+  }
+  options.no_distinct = Nan::To<bool>(noDistinct).FromJust();
+  options.bucketized = Nan::To<bool>(bucketized).FromJust();
+  if (filterBits->IsNumber()) {
+    options.filter_bits = Nan::To<int32_t>(filterBits).FromJust();
+  }
+  if (blockSize->IsNumber()) {
+    options.block_size = Nan::To<int32_t>(blockSize).FromJust();
+  }
+  options.ordered = Nan::To<bool>(ordered).FromJust();
+  if (valueCacheSize->IsNumber()) {
+    int64_t size = Nan::To<int64_t>(valueCacheSize).FromJust();
+    options.value_cache_size = size > 0 ? size : -1; // 0 means default in C.
+  }
+  if (node::Buffer::HasInstance(metadata)) {
+    options.metadata = node::Buffer::Data(metadata);
+    options.metadata_len = node::Buffer::Length(metadata);
+  }
+  Nan::Utf8String tmpDirPath(tmpDir);
+  if (tmpDir->IsString()) {
+    options.tmp_dir = *tmpDirPath;
+  }
+
+  if (!numShards->IsUndefined() && !numShards->IsUint32()) {
+    Nan::ThrowError("invalid shard count");
+    return;
+  }
+
+  uint32_t shards = numShards->IsUndefined() ?
+    0 :
+    Nan::To<uint32_t>(numShards).FromJust();
+  if (memoryBudget->IsNumber()) {
+    // Shards are filled, and closed, concurrently.
+    int64_t budget = Nan::To<int64_t>(memoryBudget).FromJust();
+    if (budget < 0) {
+      Nan::ThrowError("invalid memory budget");
+      return;
+    }
+    options.memory_budget = shards > 1 ? (budget + shards - 1) / shards : budget;
+  }
+  if (!numThreads->IsUndefined() && !numThreads->IsUint32()) {
+    Nan::ThrowError("invalid thread count");
+    return;
+  }
+  if (numThreads->IsUndefined()) {
+    // Shards are already closed concurrently (see `WriterWorker`).
+    uv_cpu_info_t *cpus;
+    int numCpus = 1;
+    if (!uv_cpu_info(&cpus, &numCpus)) {
+      uv_free_cpu_info(cpus, numCpus);
+    }
+    options.num_threads = shards > 1 ? numCpus / shards : numCpus;
+  } else {
+    options.num_threads = Nan::To<uint32_t>(numThreads).FromJust();
+  }
+
+  Nan::Utf8String path(info[0]);
+  const char *error;
+  Writer *writer = Writer::Open(*path, &options, shards, &error);
+  if (writer == NULL) {
+    Nan::ThrowError(error);
+    return;
+  }
+  writer->Wrap(info.This());
+  info.GetReturnValue().Set(info.This());
+}
+
+/**
+ * Add a batch of entries.
+ *
+ * Takes two arrays of the same length: keys (buffers) and values (buffers, or
+ * `undefined` to delete the corresponding key). The keys' hashes can
+ * optionally be passed as a third `Uint32Array` argument (see `hashMany`).
+ *
+ */
+void Writer::Add(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  static char empty[1]; // Distinguishes empty values from deletions.
+
+  if (
+    info.Length() < 2 ||
+    info.Length() > 3 ||
+    !info[0]->IsArray() ||
+    !info[1]->IsArray() ||
+    (info.Length() == 3 && !info[2]->IsUint32Array())
+  ) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
+
+  v8::Local<v8::Array> keys = info[0].As<v8::Array>();
+  v8::Local<v8::Array> values = info[1].As<v8::Array>();
+  if (keys->Length() != values->Length()) {
+    Nan::ThrowError("inconsistent batch");
+    return;
+  }
+  uint32_t *hashes = NULL;
+  Nan::TypedArrayContents<uint32_t> contents(info[2]); // Empty if undefined.
+  if (info.Length() == 3) {
+    if (contents.length() < keys->Length()) {
+      Nan::ThrowError("inconsistent batch");
+      return;
+    }
+    hashes = *contents;
+  }
+
+  Writer *writer = ObjectWrap::Unwrap<Writer>(info.This());
+  if (writer->_closed) {
+    Nan::ThrowError("writer closed");
+    return;
+  }
+
+  uint32_t i;
+  for (i = 0; i < keys->Length(); i++) {
+    v8::Local<v8::Value> key = Nan::Get(keys, i).ToLocalChecked();
+    v8::Local<v8::Value> value = Nan::Get(values, i).ToLocalChecked();
+    if (
+      !node::Buffer::HasInstance(key) ||
+      !node::Buffer::Length(key) ||
+      (!value->IsUndefined() && !node::Buffer::HasInstance(value))
+    ) {
+      Nan::ThrowError("invalid entry");
+      return;
+    }
+
+    char *valueData = NULL;
+    int64_t valueSize = 0;
+    if (!value->IsUndefined()) {
+      valueData = node::Buffer::Data(value);
+      valueSize = node::Buffer::Length(value);
+      if (valueData == NULL) {
+        valueData = empty;
+      }
+    }
+    char *keyData = node::Buffer::Data(key);
+    int32_t keySize = node::Buffer::Length(key);
+    int32_t hash = hashes ? hashes[i] : pal_hash(keyData, keySize);
+    pal_writer_t *shardWriter = writer->_writers.size() == 1 ?
+      writer->_writers[0] :
+      writer->_writers[pal_shard(hash, writer->_writers.size())];
+    if (pal_writer_put_hashed(
+      shardWriter,
+      keyData,
+      keySize,
+      hash,
+      valueData,
+      valueSize
+    )) {
+      Nan::ThrowError(ErrorMessage(PAL_ERRNO));
+      return;
+    }
+  }
+}
+
+/**
+ * Build indices and write the store file, asynchronously.
+ *
+ * The callback is passed the written store's statistics.
+ *
+ */
+void Writer::Close(const Nan::FunctionCallbackInfo<v8::Value> &info) {
+  if (info.Length() != 1 || !info[0]->IsFunction()) {
+    Nan::ThrowError("invalid arguments");
+    return;
+  }
+
+  Writer *writer = ObjectWrap::Unwrap<Writer>(info.This());
+  if (writer->_closed) {
+    Nan::ThrowError("writer closed");
+    return;
+  }
+  writer->_closed = true;
+
+  Nan::Callback *callback = new Nan::Callback(info[0].As<v8::Function>());
+  WriterWorker *worker = new WriterWorker(callback, writer);
+  worker->SaveToPersistent("writer", info.This());
+  Nan::AsyncQueueWorker(worker);
+}
+
+/**
+ * Initializer, returns the `Writer` function with the prototype set up.
+ *
+ */
+v8::Local<v8::FunctionTemplate> Writer::Init() {
+  v8::Local<v8::FunctionTemplate> tpl = Nan::New<v8::FunctionTemplate>(Writer::New);
+  tpl->SetClassName(Nan::New("Writer").ToLocalChecked());
+  tpl->InstanceTemplate()->SetInternalFieldCount(1);
+  Nan::SetPrototypeMethod(tpl, "add", Writer::Add);
+  Nan::SetPrototypeMethod(tpl, "close", Writer::Close);
+  return tpl;
+}
+
+}
@@ -0,0 +1,52 @@
+#ifndef PAL_WRITER_H_
+#define PAL_WRITER_H_
+
+#include <nan.h>
+#include <node.h>
+#include <vector>
+
+extern "C" {
+  #include "../deps/paldb/include/paldb.h"
+}
+
+namespace pal {
+
+/**
+ * Store writer.
+ *
+ * Entries are added in batches, the store file is only written (off the main
+ * thread) when the writer is closed. Sharded writers route each key to one of
+ * several store files by hash (see `pal_shard`), which are then written
+ * concurrently.
+ *
+ */
+class Writer : public Nan::ObjectWrap {
+public:
+  static v8::Local<v8::FunctionTemplate> Init();
+
+  friend class WriterWorker;
+
+private:
+  std::vector<pal_writer_t *> _writers; // One per shard.
+  bool _closed;
+
+  Writer(std::vector<pal_writer_t *> &writers);
+  ~Writer();
+
+  /**
+   * Create a writer of a store file, or of a sharded store if `numShards` is
+   * positive (its directory must be new or empty).
+   *
+   * Returns NULL on failure, with a message in `error`.
+   *
+   */
+  static Writer *Open(char *path, pal_writer_options_t *opts, uint32_t numShards, const char **error);
+
+  static void New(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void Add(const Nan::FunctionCallbackInfo<v8::Value> &info);
+  static void Close(const Nan::FunctionCallbackInfo<v8::Value> &info);
+};
+
+}
+
+#endif
@@ -3,7 +3,9 @@
 'use strict';
 
 var binding = require('../build/Release/binding'),
-    assert = require('assert');
+    assert = require('assert'),
+    fs = require('fs'),
+    tmp = require('tmp');
 
 var PATH = 'test/dat/numbers.store';
 
@@ -22,6 +24,15 @@ suite('binding', function () {
       assert.equal(binding.hash(new Buffer([12, 34, 56, 78])), 1538392938);
     });
 
+    test('many', function () {
+      var bufs = [new Buffer([12, 34]), new Buffer([12, 34, 56, 78])];
+      var hashes = new Uint32Array(2);
+      assert.strictEqual(binding.hashMany(bufs, hashes), hashes);
+      assert.deepEqual([hashes[0], hashes[1]], [1762498445, 1538392938]);
+      assert.throws(function () { binding.hashMany(bufs, new Uint32Array(1)); });
+      assert.throws(function () { binding.hashMany([1], new Uint32Array(1)); });
+    });
+
   });
 
   suite('Store', function () {
@@ -39,6 +50,110 @@ suite('binding', function () {
       assert.deepEqual(buf, new Buffer([0x06]));
     });
 
+    test('read with hash', function () {
+      var key = new Buffer([0x67, 0x03, 0x6f, 0x6e, 0x65]);
+      var buf = new Buffer(1);
+      assert.equal(store.read(key, buf, binding.hash(key)), 1);
+      assert.deepEqual(buf, new Buffer([0x06]));
+      assert.throws(function () { store.read(key, buf, -1); });
+    });
+
+    test('read many with hashes', function () {
+      var keys = [
+        new Buffer([0x67, 0x03, 0x74, 0x77, 0x6f]),
+        new Buffer([0x67, 0x03, 0x6f, 0x6e, 0x65])
+      ];
+      var hashes = binding.hashMany(keys, new Uint32Array(2));
+      var buf = new Buffer(2);
+      assert.deepEqual(store.readMany(keys, buf, hashes), [1, 1]);
+      assert.deepEqual(buf, new Buffer([0x07, 0x06]));
+    });
+
+    test('read many', function () {
+      var keys = [
+        new Buffer([0x67, 0x03, 0x74, 0x77, 0x6f]),
+        new Buffer([0]),
+        new Buffer([0x67, 0x03, 0x6f, 0x6e, 0x65])
+      ];
+      var buf = new Buffer(2);
+      assert.deepEqual(store.readMany(keys, buf), [1, -1, 1]);
+      assert.deepEqual(buf, new Buffer([0x07, 0x06]));
+      assert.equal(store.readMany(keys, new Buffer(1)), ~1);
+      assert.deepEqual(store.readMany([], buf), []);
+      assert.throws(function () { store.readMany([new Buffer(0)], buf); });
+    });
+
+    test('read view', function () {
+      var key = new Buffer([0x67, 0x05, 0x74, 0x68, 0x72, 0x65, 0x65]);
+      assert.deepEqual(store.readView(key), new Buffer([0x08]));
+      assert.strictEqual(store.readView(new Buffer([0])), undefined);
+      assert.throws(function () { store.readView(new Buffer(0)); });
+    });
+
+    test('read async', function (done) {
+      var keys = [new Buffer([0]), new Buffer([0x67, 0x03, 0x74, 0x77, 0x6f])];
+      store.readAsync(keys, function (err, values) {
+        assert.strictEqual(err, null);
+        assert.deepEqual(values, [undefined, new Buffer([0x07])]);
+        done();
+      });
+    });
+
+    test('read async invalid arguments', function () {
+      assert.throws(function () { store.readAsync([1], function () {}); });
+      assert.throws(function () { store.readAsync([new Buffer([1])]); });
+    });
+
+    test('shared readers', function () {
+      var other = new binding.Store('./' + PATH); // Same file, different path.
+      var key = new Buffer([0x67, 0x03, 0x6f, 0x6e, 0x65]);
+      var before = store.getMetrics();
+      other.enableMetrics(true);
+      assert.equal(other.read(key, new Buffer(1)), 1);
+      other.enableMetrics(false);
+      // Hits are counted per store, probe lengths per file.
+      var metrics = store.getMetrics();
+      assert.equal(metrics.hits, before.hits);
+      assert.equal(
+        metrics.probeLengths.reduce(function (a, b) { return a + b; }),
+        before.probeLengths.reduce(function (a, b) { return a + b; }) + 1
+      );
+      assert.equal(other.getMetrics().hits, 1);
+    });
+
+    test('handle', function () {
+      var other = new binding.Store(store.getHandle());
+      var key = new Buffer([0x67, 0x03, 0x6f, 0x6e, 0x65]);
+      var buf = new Buffer(1);
+      assert.equal(other.read(key, buf), 1);
+      assert.deepEqual(buf, new Buffer([0x06]));
+      assert.throws(function () { new binding.Store(-1); }, /stale handle/);
+    });
+
+    test('handle in worker thread', function (done) {
+      var threads;
+      try {
+        threads = require('worker_threads');
+      } catch (err) {
+        done(); // Not supported on this version of node.
+        return;
+      }
+      var script = [
+        "var threads = require('worker_threads');",
+        'var binding = require(' + JSON.stringify(require.resolve('../build/Release/binding')) + ');',
+        'var store = new binding.Store(threads.workerData);',
+        'var buf = new Buffer(1);',
+        'var len = store.read(new Buffer([0x67, 0x03, 0x6f, 0x6e, 0x65]), buf);',
+        'threads.parentPort.postMessage([len, buf[0]]);'
+      ].join('\n');
+      new threads.Worker(script, {eval: true, workerData: store.getHandle()})
+        .on('error', done)
+        .on('message', function (msg) {
+          assert.deepEqual(msg, [1, 0x06]);
+          done();
+        });
+    });
+
   });
 
   suite('Iterator', function () {
@@ -79,4 +194,466 @@ suite('binding', function () {
 
   });
 
+  suite('Iterator batch', function () {
+
+    var store = new binding.Store(PATH);
+
+    test('two entries then one', function (done) {
+      var iterator = new binding.Iterator(store);
+      iterator.next(2, function (err, keys, values) {
+        assert.strictEqual(err, null);
+        assert.equal(keys.length, 2);
+        assert.deepEqual(values, [new Buffer([0x06]), new Buffer([0x07])]);
+        iterator.next(2, function (err, keys, values) {
+          assert.strictEqual(err, null);
+          assert.deepEqual(
+            keys,
+            [new Buffer([0x67, 0x05, 0x74, 0x68, 0x72, 0x65, 0x65])]
+          );
+          assert.deepEqual(values, [new Buffer([0x08])]);
+          done();
+        });
+      });
+    });
+
+    test('invalid range', function () {
+      assert.throws(function () {
+        new binding.Iterator(store, false, {keySize: 6, startSlot: 0, endSlot: 1});
+      });
+      assert.throws(function () {
+        new binding.Iterator(store, false, {keySize: 5, startSlot: 0, endSlot: 9});
+      });
+    });
+
+    test('ranges', function () {
+      var ranges = store.getRanges(1);
+      assert.deepEqual(
+        ranges,
+        [
+          {keySize: 5, startSlot: 0, endSlot: 3},
+          {keySize: 7, startSlot: 0, endSlot: 1}
+        ]
+      );
+    });
+
+    test('keys', function (done) {
+      var iterator = new binding.Iterator(store, false, undefined, 'keys');
+      iterator.next(2, function (err, keys, values) {
+        assert.strictEqual(err, null);
+        assert.equal(keys.length, 2);
+        assert.strictEqual(values, undefined);
+        iterator.count(function (err, n) {
+          assert.strictEqual(err, null);
+          assert.equal(n, 1);
+          done();
+        });
+      });
+    });
+
+    test('value sizes', function (done) {
+      var iterator = new binding.Iterator(store, false, undefined, 'sizes');
+      iterator.next(function (err, key, size) {
+        assert.strictEqual(err, null);
+        assert.equal(key.length, 5);
+        assert.strictEqual(size, 1);
+        done();
+      });
+    });
+
+    test('invalid mode', function () {
+      assert.throws(function () {
+        new binding.Iterator(store, false, undefined, 'values');
+      }, /invalid mode/);
+    });
+
+    test('invalid batch size', function () {
+      var iterator = new binding.Iterator(store);
+      assert.throws(function () { iterator.next(0, function () {}); });
+      assert.throws(function () { iterator.next(-1, function () {}); });
+    });
+
+  });
+
+  suite('Iterator zero copy', function () {
+
+    test('first entry', function (done) {
+      var iterator = new binding.Iterator(new binding.Store(PATH), true);
+      iterator.next(function (err, key, value) {
+        assert.strictEqual(err, null);
+        assert.deepEqual(key, new Buffer([0x67, 0x03, 0x6f, 0x6e, 0x65]));
+        assert.deepEqual(value, new Buffer([0x06]));
+        done();
+      });
+    });
+
+  });
+
+  suite('Writer', function () {
+
+    test('invalid arguments', function () {
+      assert.throws(function () { new binding.Writer(); });
+      assert.throws(function () { new binding.Writer('foo', {loadFactor: 2}); });
+    });
+
+    test('add and close', function (done) {
+      var path = tmp.tmpNameSync();
+      var writer = new binding.Writer(path, {metadata: new Buffer([1])});
+      writer.add(
+        [new Buffer([1]), new Buffer([2, 3])],
+        [new Buffer([4]), new Buffer([5, 6])]
+      );
+      writer.add([new Buffer([7])], [new Buffer(0)]);
+      writer.close(function (err, stats) {
+        assert.strictEqual(err, null);
+        assert.equal(stats.numKeys, 3);
+        assert.equal(stats.numValues, 3);
+        var store = new binding.Store(path);
+        var buf = new Buffer(2);
+        assert.equal(store.read(new Buffer([2, 3]), buf), 2);
+        assert.deepEqual(buf, new Buffer([5, 6]));
+        assert.equal(store.read(new Buffer([7]), buf), 0);
+        assert.equal(store.read(new Buffer([3]), buf), -1);
+        assert.deepEqual(store.getMetadata(), new Buffer([1]));
+        assert.throws(function () { writer.add([], []); });
+        done();
+      });
+    });
+
+    test('add with hashes', function (done) {
+      var path = tmp.tmpNameSync();
+      var writer = new binding.Writer(path, {});
+      var keys = [new Buffer([1]), new Buffer([2])];
+      var hashes = binding.hashMany(keys, new Uint32Array(2));
+      writer.add(keys, [new Buffer([3]), new Buffer([4])], hashes);
+      writer.close(function (err) {
+        assert.strictEqual(err, null);
+        var store = new binding.Store(path);
+        var buf = new Buffer(1);
+        assert.equal(store.read(keys[1], buf), 1);
+        assert.deepEqual(buf, new Buffer([4]));
+        done();
+      });
+    });
+
+    test('bucketized', function (done) {
+      var path = tmp.tmpNameSync();
+      var writer = new binding.Writer(path, {bucketized: true});
+      var keys = [];
+      var values = [];
+      var i;
+      for (i = 0; i < 1000; i++) {
+        keys.push(new Buffer('' + i));
+        values.push(new Buffer([i % 256]));
+      }
+      writer.add(keys, values);
+      writer.close(function (err, stats) {
+        assert.strictEqual(err, null);
+        assert.equal(stats.numKeys, 1000);
+        var store = new binding.Store(path);
+        var buf = new Buffer(1);
+        for (i = 0; i < 1000; i++) {
+          assert.equal(store.read(keys[i], buf), 1);
+          assert.equal(buf[0], i % 256);
+        }
+        assert.equal(store.read(new Buffer('1000'), buf), -1);
+        var partitions = store.getMetrics().partitions;
+        partitions.forEach(function (partition) {
+          assert(partition.maxDisplacement <= 1);
+        });
+        done();
+      });
+    });
+
+    test('filters', function (done) {
+      var path = tmp.tmpNameSync();
+      var writer = new binding.Writer(path, {filterBits: 10});
+      var keys = [];
+      var values = [];
+      var i;
+      for (i = 0; i < 1000; i++) {
+        keys.push(new Buffer('' + i));
+        values.push(new Buffer([i % 256]));
+      }
+      writer.add(keys, values);
+      writer.close(function (err) {
+        assert.strictEqual(err, null);
+        var store = new binding.Store(path);
+        var buf = new Buffer(1);
+        store.enableMetrics(true);
+        for (i = 0; i < 1000; i++) {
+          assert.equal(store.read(keys[i], buf), 1);
+        }
+        for (i = 1000; i < 2000; i++) {
+          assert.equal(store.read(new Buffer('' + i), buf), -1);
+        }
+        var metrics = store.getMetrics();
+        assert.equal(metrics.misses, 1000);
+        assert(metrics.filtered > 900); // ~1% false positives.
+        metrics.partitions.forEach(function (partition) {
+          assert(partition.filterSize > 0);
+        });
+        done();
+      });
+    });
+
+    test('deduplicated values', function (done) {
+      var path = tmp.tmpNameSync();
+      var writer = new binding.Writer(path, {});
+      var value = new Buffer(100);
+      value.fill(1);
+      writer.add([new Buffer([1]), new Buffer([2])], [value, value]);
+      writer.add([new Buffer([3])], [new Buffer(value)]); // Same contents.
+      writer.close(function (err, stats) {
+        assert.strictEqual(err, null);
+        assert.equal(stats.numValues, 3);
+        assert.equal(stats.dataSize, 1 + 1 + 100);
+        var store = new binding.Store(path);
+        var buf = new Buffer(100);
+        assert.equal(store.read(new Buffer([3]), buf), 100);
+        assert.deepEqual(buf, value);
+        done();
+      });
+    });
+
+    test('value cache disabled', function (done) {
+      var path = tmp.tmpNameSync();
+      var writer = new binding.Writer(path, {valueCacheSize: 0});
+      var value = new Buffer([5]);
+      writer.add([new Buffer([1]), new Buffer([2])], [value, value]);
+      writer.close(function (err, stats) {
+        assert.strictEqual(err, null);
+        assert.equal(stats.dataSize, 1 + 2 * 2);
+        done();
+      });
+    });
+
+    test('compressed values', function (done) {
+      var path = tmp.tmpNameSync();
+      var writer = new binding.Writer(path, {blockSize: 256, valueCacheSize: 0});
+      var keys = [];
+      var values = [];
+      var i;
+      for (i = 0; i < 1000; i++) {
+        keys.push(new Buffer('' + i));
+        values.push(new Buffer('value-' + (i % 10) + '-' + i));
+      }
+      writer.add(keys, values);
+      writer.close(function (err, stats) {
+        assert.strictEqual(err, null);
+        var store = new binding.Store(path);
+        var buf = new Buffer(20);
+        store.enableMetrics(true);
+        for (i = 0; i < 1000; i++) {
+          assert.equal(store.read(keys[i], buf), values[i].length);
+          assert.deepEqual(buf.slice(0, values[i].length), values[i]);
+        }
+        assert.equal(store.read(new Buffer('1000'), buf), -1);
+        assert.equal(store.read(keys[999], new Buffer(1)), ~(values[999].length - 1));
+        assert.deepEqual(store.readMany([keys[1], keys[2]], buf), [7, 7]);
+        assert.deepEqual(buf.slice(0, 14), Buffer.concat([values[1], values[2]]));
+        assert.deepEqual(store.readView(keys[3]), values[3]);
+        var metrics = store.getMetrics();
+        assert(metrics.blockMisses > 0);
+        assert(metrics.blockHits > metrics.blockMisses);
+        store.readAsync([keys[4], new Buffer('1000')], function (err, arr) {
+          assert.strictEqual(err, null);
+          assert.deepEqual(arr, [values[4], undefined]);
+          var iterator = new binding.Iterator(store, true);
+          var numEntries = 0;
+          (function next() {
+            iterator.next(16, function (err, keyBufs, valueBufs) {
+              assert.strictEqual(err, null);
+              keyBufs.forEach(function (keyBuf, j) {
+                assert.deepEqual(valueBufs[j], values[+keyBuf.toString()]);
+              });
+              numEntries += keyBufs.length;
+              if (keyBufs.length) {
+                next();
+              } else {
+                assert.equal(numEntries, 1000);
+                done();
+              }
+            });
+          })();
+        });
+      });
+    });
+
+    test('sharded store', function (done) {
+      var path = tmp.tmpNameSync();
+      var writer = new binding.Writer(path, {numShards: 3});
+      var keys = [];
+      var values = [];
+      var i;
+      for (i = 0; i < 1000; i++) {
+        keys.push(new Buffer('' + i));
+        values.push(new Buffer([i % 256]));
+      }
+      writer.add(keys, values);
+      writer.close(function (err, stats) {
+        assert.strictEqual(err, null);
+        assert.equal(stats.numKeys, 1000);
+        var store = new binding.Store(path);
+        var storeStats = store.getStatistics();
+        assert.equal(storeStats.numShards, 3);
+        assert.equal(storeStats.numValues, 1000);
+        var buf = new Buffer(2);
+        for (i = 0; i < 1000; i++) {
+          assert.equal(store.read(keys[i], buf), 1);
+          assert.equal(buf[0], i % 256);
+        }
+        assert.equal(store.read(new Buffer('1000'), buf), -1);
+        assert.deepEqual(
+          store.readMany([keys[1], new Buffer('1000'), keys[2]], buf),
+          [1, -1, 1]
+        );
+        assert.deepEqual(buf, new Buffer([1, 2]));
+        assert.deepEqual(store.readView(keys[3]), values[3]);
+        var shards = {};
+        store.getMetrics().partitions.forEach(function (partition) {
+          shards[partition.shard] = true;
+        });
+        assert.deepEqual(Object.keys(shards), ['0', '1', '2']);
+        var ranges = store.getRanges(6);
+        assert(ranges.length >= 6);
+        var numEntries = 0;
+        (function iterate(iterator, rangeIndex) {
+          iterator.next(64, function (err, keyBufs, valueBufs) {
+            assert.strictEqual(err, null);
+            keyBufs.forEach(function (keyBuf, j) {
+              assert.deepEqual(valueBufs[j], values[+keyBuf.toString()]);
+            });
+            numEntries += keyBufs.length;
+            if (keyBufs.length) {
+              iterate(iterator, rangeIndex);
+            } else if (rangeIndex < ranges.length) {
+              iterate(new binding.Iterator(store, false, ranges[rangeIndex]), rangeIndex + 1);
+            } else {
+              assert.equal(numEntries, 2000); // Full iteration, then ranges.
+              done();
+            }
+          });
+        })(new binding.Iterator(store), 0);
+      });
+    });
+
+    test('sharded store in non-empty directory', function () {
+      var path = tmp.tmpNameSync();
+      fs.mkdirSync(path);
+      new binding.Writer(path, {numShards: 2}); // Empty directories are fine.
+      fs.writeFileSync(path + '/2', ''); // E.g. a stale shard.
+      assert.throws(function () {
+        new binding.Writer(path, {numShards: 2});
+      }, /not an empty directory/);
+    });
+
+    test('invalid shard count', function () {
+      assert.throws(function () {
+        new binding.Writer(tmp.tmpNameSync(), {numShards: -1});
+      });
+    });
+
+    test('invalid thread count', function () {
+      assert.throws(function () {
+        new binding.Writer(tmp.tmpNameSync(), {numThreads: -1});
+      }, /invalid thread count/);
+    });
+
+    test('invalid filter bits', function () {
+      assert.throws(function () {
+        new binding.Writer(tmp.tmpNameSync(), {filterBits: -1});
+      });
+    });
+
+    test('invalid batch', function () {
+      var writer = new binding.Writer(tmp.tmpNameSync(), {});
+      assert.throws(function () { writer.add([new Buffer([1])], []); });
+      assert.throws(function () { writer.add([1], [new Buffer([1])]); });
+      assert.throws(function () { writer.add([new Buffer(0)], [undefined]); });
+    });
+
+    test('duplicate key', function (done) {
+      var writer = new binding.Writer(tmp.tmpNameSync(), {});
+      writer.add([new Buffer([1]), new Buffer([1])], [new Buffer(0), undefined]);
+      writer.close(function (err) {
+        assert(/duplicate/.test(err.message));
+        done();
+      });
+    });
+
+  });
+
+  suite('Store swap', function () {
+
+    // Write a store with the given (single byte) keys and values.
+    function writeStore(entries, opts, cb) {
+      var path = tmp.tmpNameSync();
+      var writer = new binding.Writer(path, opts);
+      writer.add(
+        entries.map(function (entry) { return new Buffer([entry[0]]); }),
+        entries.map(function (entry) { return new Buffer([entry[1]]); })
+      );
+      writer.close(function (err) {
+        assert.strictEqual(err, null);
+        cb(path);
+      });
+    }
+
+    test('in flight reads and iterators', function (done) {
+      writeStore([[1, 10], [2, 20]], {}, function (oldPath) {
+        writeStore([[1, 11], [3, 31]], {numShards: 2}, function (newPath) {
+          var store = new binding.Store(oldPath);
+          var iterator = new binding.Iterator(store, true);
+          var view = store.readView(new Buffer([1]));
+          var pending = 2;
+          store.readAsync([new Buffer([2])], function (err, bufs) {
+            assert.strictEqual(err, null);
+            assert.deepEqual(bufs, [new Buffer([20])]); // Old version.
+            if (!--pending) {
+              done();
+            }
+          });
+          store.swap(newPath, function (err) {
+            assert.strictEqual(err, null);
+            var buf = new Buffer(1);
+            assert.equal(store.read(new Buffer([1]), buf), 1);
+            assert.deepEqual(buf, new Buffer([11]));
+            assert.equal(store.read(new Buffer([2]), buf), -1);
+            assert.equal(store.getStatistics().numShards, 2);
+            assert.deepEqual(view, new Buffer([10]));
+            iterator.next(10, function (err, keyBufs, valueBufs) {
+              assert.strictEqual(err, null);
+              assert.equal(keyBufs.length, 2);
+              valueBufs.forEach(function (buf) {
+                assert([10, 20].indexOf(buf[0]) >= 0);
+              });
+              if (!--pending) {
+                done();
+              }
+            });
+          });
+        });
+      });
+    });
+
+    test('missing file', function (done) {
+      writeStore([[1, 10]], {}, function (path) {
+        var store = new binding.Store(path);
+        store.swap(tmp.tmpNameSync(), function (err) {
+          assert(/no such file/.test(err.message));
+          var buf = new Buffer(1);
+          assert.equal(store.read(new Buffer([1]), buf), 1); // Unchanged.
+          done();
+        });
+      });
+    });
+
+    test('invalid arguments', function () {
+      var store = new binding.Store(PATH);
+      assert.throws(function () { store.swap(PATH); });
+      assert.throws(function () { store.swap(1, function () {}); });
+    });
+
+  });
+
 });
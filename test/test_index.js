@@ -25,6 +25,131 @@ suite('index', function () {
       ws.end();
     });
 
+    test('get zero copy', function (done) {
+      var path = tmp.tmpNameSync();
+      var ws = pal.Db.createWriteStream(path, function (err) {
+        assert.strictEqual(err, null);
+        var db = new pal.Db(path, {zeroCopy: true});
+        assert.deepEqual(db.get('hi'), {one: 1});
+        assert.strictEqual(db.get('hey', 3), 3);
+        done();
+      });
+      ws.write({key: 'hi', value: {one: 1}});
+      ws.end();
+    });
+
+    test('get resize', function (done) {
+      var path = tmp.tmpNameSync();
+      var ws = pal.Db.createWriteStream(path, function (err) {
+        assert.strictEqual(err, null);
+        var db = new pal.Db(path, {bufferSize: 1});
+        assert.equal(db.get('hi'), 'hello');
+        done();
+      });
+      ws.write({key: 'hi', value: 'hello'});
+      ws.end();
+    });
+
+    test('getMetrics', function (done) {
+      var path = tmp.tmpNameSync();
+      var ws = pal.Db.createWriteStream(path, function (err) {
+        assert.strictEqual(err, null);
+        var db = new pal.Db(path, {bufferSize: 1, metrics: true});
+        assert.equal(db.get('hi'), 'hello');
+        assert.strictEqual(db.get('hey'), undefined);
+        var metrics = db.getMetrics();
+        assert.equal(metrics.resizes, 1);
+        assert.equal(metrics.hits, 2); // Including the retry.
+        assert.equal(metrics.misses, 1);
+        assert.equal(metrics.bytesCopied, 7);
+        done();
+      });
+      ws.write({key: 'hi', value: 'hello'});
+      ws.end();
+    });
+
+    test('getAsync', function (done) {
+      var path = tmp.tmpNameSync();
+      var ws = pal.Db.createWriteStream(path, function (err) {
+        assert.strictEqual(err, null);
+        var db = new pal.Db(path);
+        var n = 0;
+        db.getAsync('hi', function (err, value) {
+          assert.strictEqual(err, null);
+          assert.equal(value, 2);
+          n++;
+        });
+        db.getAsync('key', function (err, value) {
+          assert.strictEqual(err, null);
+          assert.strictEqual(value, undefined);
+          assert.equal(n, 1);
+          done();
+        });
+      });
+      ws.write({key: 'hi', value: 2});
+      ws.end();
+    });
+
+    test('getAsync invalid key', function (done) {
+      var path = tmp.tmpNameSync();
+      var ws = pal.Db.createWriteStream(path, function (err) {
+        assert.strictEqual(err, null);
+        var db = new pal.Db(path, {codecs: {keyCodec: {
+          encode: function (str) { return new Buffer(str && JSON.stringify(str)); },
+          decode: function (buf) { return JSON.parse(buf); }
+        }}});
+        var n = 0;
+        db.getAsync('', function (err) {
+          assert(/empty key/.test(err.message));
+          n++;
+        });
+        db.getAsync('hi', function (err, value) {
+          assert.strictEqual(err, null); // Same batch, unaffected.
+          assert.equal(value, 2);
+          assert.equal(n, 1);
+          done();
+        });
+      });
+      ws.write({key: 'hi', value: 2});
+      ws.end();
+    });
+
+    test('getMany', function (done) {
+      var path = tmp.tmpNameSync();
+      var ws = pal.Db.createWriteStream(path, function (err) {
+        assert.strictEqual(err, null);
+        var db = new pal.Db(path, {bufferSize: 1});
+        assert.deepEqual(db.getMany(['hi', 'key', 'hey'], 0), [2, 0, 'five']);
+        assert.deepEqual(db.getMany([]), []);
+        done();
+      });
+      ws.write({key: 'hi', value: 2});
+      ws.write({key: 'hey', value: 'five'});
+      ws.end();
+    });
+
+    test('createKeyStream and count', function (done) {
+      var path = tmp.tmpNameSync();
+      var ws = pal.Db.createWriteStream(path, function (err) {
+        assert.strictEqual(err, null);
+        var db = new pal.Db(path);
+        var keys = [];
+        db.createKeyStream()
+          .on('data', function (key) { keys.push(key); })
+          .on('end', function () {
+            assert.deepEqual(keys.sort(), ['hey', 'hi']);
+            db.count(function (err, n) {
+              assert.strictEqual(err, null);
+              assert.equal(n, 2);
+              done();
+            });
+          });
+      });
+      ws.write({key: 'hi', value: 2});
+      ws.write({key: 'hey', value: 'five'});
+      ws.end();
+    });
+
   });
 
   suite('AvroDb', function () {
@@ -46,6 +171,67 @@ suite('index', function () {
       ws.end();
     });
 
+    test('get native', function (done) {
+      var path = tmp.tmpNameSync();
+      var schemas = {
+        keySchema: 'string',
+        valueSchema: {
+          type: 'record',
+          name: 'Person',
+          fields: [
+            {name: 'name', type: 'string'},
+            {name: 'age', type: ['null', 'int']},
+            {name: 'tags', type: {type: 'array', items: 'string'}},
+            {name: 'scores', type: {type: 'map', values: 'double'}},
+            {name: 'kind', type: {type: 'enum', name: 'Kind', symbols: ['A', 'B']}},
+            {name: 'id', type: {type: 'fixed', name: 'Id', size: 2}},
+            {name: 'friend', type: ['null', 'Person']}
+          ]
+        }
+      };
+      var ann = {
+        name: 'Ann',
+        age: {'int': 33},
+        tags: ['a', 'b'],
+        scores: {x: 1.5},
+        kind: 'B',
+        id: new Buffer([1, 2]),
+        friend: null
+      };
+      var bob = {
+        name: 'Bob',
+        age: null,
+        tags: [],
+        scores: {},
+        kind: 'A',
+        id: new Buffer([3, 4]),
+        friend: {Person: ann}
+      };
+      var ws = pal.AvroDb.createWriteStream(path, schemas, function (err) {
+        assert.strictEqual(err, null);
+        var db = new pal.AvroDb(path, {native: true});
+        assert.deepEqual(db.get('bob'), bob);
+        assert.deepEqual(db.get('bob'), new pal.AvroDb(path).get('bob'));
+        assert.strictEqual(db.get('carl'), undefined);
+        var projected = new pal.AvroDb(path, {native: true, fields: ['kind']});
+        assert.deepEqual(projected.get('bob'), {kind: 'A'});
+        projected.getAsync('ann', function (err, value) {
+          assert.strictEqual(err, null);
+          assert.deepEqual(value, {kind: 'B'});
+          assert.throws(function () {
+            new pal.AvroDb(path, {fields: ['name']});
+          }, /native/);
+          assert.throws(function () {
+            new pal.AvroDb(path, {native: true, fields: ['foo']});
+          }, /unknown field/);
+          done();
+        });
+      });
+      ws.write({key: 'ann', value: ann});
+      ws.write({key: 'bob', value: bob});
+      ws.end();
+    });
+
   });
 
 });
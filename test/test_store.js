@@ -40,6 +40,82 @@ suite('index', function () {
         });
     });
 
+    test('createReadStream in small batches', function (done) {
+      var numEntries = 0;
+      store.createReadStream({batchSize: 2})
+        .on('data', function () { numEntries++; })
+        .on('end', function () {
+          assert.equal(numEntries, 3);
+          done();
+        });
+    });
+
+    test('createReadStreams', function (done) {
+      var streams = store.createReadStreams(4);
+      var keys = [];
+      var pending = streams.length;
+      assert(pending >= 2); // At least one per partition.
+      streams.forEach(function (rs) {
+        rs
+          .on('data', function (entry) { keys.push(entry.key.toString('hex')); })
+          .on('end', function () {
+            if (--pending) {
+              return;
+            }
+            assert.deepEqual(
+              keys.sort(),
+              ['67036f6e65', '670374776f', '67057468726565']
+            );
+            done();
+          });
+      });
+    });
+
+    test('createReadStream sequential', function () {
+      assert.throws(function () {
+        store.createReadStream({sequential: true, prefix: new Buffer([1])});
+      }, /whole stores/);
+    });
+
+    test('createKeyStream', function (done) {
+      var keys = [];
+      store.createKeyStream()
+        .on('data', function (key) { keys.push(key.toString('hex')); })
+        .on('end', function () {
+          assert.deepEqual(keys, ['67036f6e65', '670374776f', '67057468726565']);
+          done();
+        });
+    });
+
+    test('createKeyStream with value sizes', function (done) {
+      var entries = [];
+      store.createKeyStream({valueSizes: true})
+        .on('data', function (entry) { entries.push(entry); })
+        .on('end', function () {
+          assert.deepEqual(entries.map(function (entry) {
+            return entry.valueSize;
+          }), [1, 1, 1]);
+          assert.deepEqual(entries[2].key, new Buffer('67057468726565', 'hex'));
+          done();
+        });
+    });
+
+    test('count', function (done) {
+      store.count(function (err, n) {
+        assert.strictEqual(err, null);
+        assert.equal(n, 3);
+        var range = store.getRanges(1)[0];
+        store.count({range: range}, function (err, n) {
+          assert.strictEqual(err, null);
+          assert(n >= 1); // At least one per partition.
+          store.count({prefix: new Buffer([0x67])}, function (err) {
+            assert(/key directory/.test(err.message));
+            done();
+          });
+        });
+      });
+    });
+
     test('getStatistics', function () {
       assert.deepEqual(
         store.getStatistics(),
@@ -56,6 +132,59 @@ suite('index', function () {
       assert.deepEqual(store.getMetadata(), new Buffer(0));
     });
 
+    test('getMetrics', function () {
+      var openTime = store.getMetrics().openTime;
+      assert.equal(typeof openTime, 'number');
+      assert(openTime >= 0);
+    });
+
+    test('getMetrics with counters', function () {
+      var store = new Store('test/dat/numbers.store');
+      var buf = new Buffer(1);
+      var key = new Buffer([0x67, 0x03, 0x6f, 0x6e, 0x65]);
+      store.read(key, buf); // Not counted.
+      // Probe lengths are shared with the other stores open on the same file.
+      var before = store.getMetrics();
+      store.enableMetrics(true);
+      assert.equal(store.read(key, buf), 1);
+      assert.equal(store.read(new Buffer([0x67, 0x03, 0x00, 0x00, 0x00]), buf), -1);
+      assert.equal(store.read(new Buffer([0x67]), buf), -1);
+      store.enableMetrics(false);
+      store.read(key, buf); // Not counted.
+      var metrics = store.getMetrics();
+      assert.equal(metrics.hits, 1);
+      assert.equal(metrics.misses, 2);
+      assert.equal(metrics.bytesCopied, 1);
+      assert.equal(sum(metrics.probeLengths), sum(before.probeLengths) + 2);
+      assert.deepEqual(
+        metrics.partitions.map(function (p) {
+          return [p.keySize, p.numKeys, p.numSlots, p.slotSize];
+        }),
+        [[5, 2, 3, 6], [7, 1, 1, 8]]
+      );
+      assert.equal(metrics.partitions[1].loadFactor, 1);
+      assert.equal(metrics.partitions[1].maxDisplacement, 0);
+    });
+
+    test('getMetrics shared counters', function () {
+      var store = new Store('test/dat/numbers.store');
+      var other = new Store('test/dat/numbers.store');
+      var buf = new Buffer(1);
+      var key = new Buffer([0x67, 0x03, 0x6f, 0x6e, 0x65]);
+      var before = store.getMetrics();
+      store.enableMetrics(true);
+      other.enableMetrics(true);
+      other.enableMetrics(false); // The file's counters stay on for `store`.
+      assert.equal(store.read(key, buf), 1);
+      assert.equal(other.read(key, buf), 1);
+      store.enableMetrics(false);
+      assert.equal(store.read(key, buf), 1); // Not counted.
+      var metrics = store.getMetrics();
+      assert.equal(metrics.hits, 1);
+      assert.equal(sum(metrics.probeLengths), sum(before.probeLengths) + 2);
+      assert.equal(other.getMetrics().hits, 0);
+    });
+
   });
 
   suite('Store.createWriteStream', function () {
@@ -82,6 +211,272 @@ suite('index', function () {
       s.end();
     });
 
+    test('bucketized', function (done) {
+      var path = tmp.tmpNameSync();
+      var s = Store.createWriteStream(path, {bucketized: true}, function () {
+        var store = new Store(path);
+        assert.equal(store.getStatistics().numValues, 2);
+        assert.deepEqual(getValue(store, new Buffer([1])), new Buffer([2]));
+        assert.deepEqual(getValue(store, new Buffer([3, 4])), new Buffer([5]));
+        assert.strictEqual(getValue(store, new Buffer([2])), undefined);
+        done();
+      });
+      s.write({key: new Buffer([1]), value: new Buffer([2])});
+      s.write({key: new Buffer([3, 4]), value: new Buffer([5])});
+      s.end();
+    });
+
+    test('bucketized javascript builder', function () {
+      assert.throws(function () {
+        Store.createWriteStream(tmp.tmpNameSync(), {bucketized: true, native: false});
+      });
+    });
+
+    test('deduplicated values', function (done) {
+      testDeduplicatedValues({}, done);
+    });
+
+    test('deduplicated values javascript builder', function (done) {
+      testDeduplicatedValues({native: false}, done);
+    });
+
+    test('filters', function (done) {
+      var path = tmp.tmpNameSync();
+      var s = Store.createWriteStream(path, {filterBits: 10}, function () {
+        var store = new Store(path);
+        assert.deepEqual(getValue(store, new Buffer([1])), new Buffer([2]));
+        assert.strictEqual(getValue(store, new Buffer([2])), undefined);
+        assert.strictEqual(getValue(store, new Buffer([3, 4])), undefined);
+        done();
+      });
+      s.write({key: new Buffer([1]), value: new Buffer([2])});
+      s.end();
+    });
+
+    test('filters javascript builder', function () {
+      assert.throws(function () {
+        Store.createWriteStream(tmp.tmpNameSync(), {filterBits: 10, native: false});
+      });
+    });
+
+    test('compressed data', function (done) {
+      var path = tmp.tmpNameSync();
+      var entries = [];
+      var i;
+      for (i = 0; i < 100; i++) {
+        entries.push({key: new Buffer('' + i), value: new Buffer('value' + i)});
+      }
+      var s = Store.createWriteStream(path, {blockSize: 64}, function (err) {
+        assert.strictEqual(err, null);
+        var store = new Store(path);
+        assert.deepEqual(getValue(store, new Buffer('12')), new Buffer('value12'));
+        assert.strictEqual(getValue(store, new Buffer('100')), undefined);
+        getEntries(store, function (arr) {
+          arr.sort(function (a, b) { return +a.key.toString() - +b.key.toString(); });
+          assert.deepEqual(arr, entries);
+          var sequential = [];
+          store.createReadStream({sequential: true})
+            .on('data', function (entry) { sequential.push(entry); })
+            .on('end', function () {
+              // Keys have different lengths (so partitions), only the
+              // entries within each are in insertion order.
+              assert.deepEqual(
+                sequential.map(function (entry) { return entry.key.length; }),
+                entries.map(function (entry) { return entry.key.length; }).sort()
+              );
+              [1, 2].forEach(function (len) {
+                assert.deepEqual(
+                  sequential.filter(function (entry) { return entry.key.length == len; }),
+                  entries.filter(function (entry) { return entry.key.length == len; })
+                );
+              });
+              done();
+            });
+        });
+      });
+      entries.forEach(function (entry) { s.write(entry); });
+      s.end();
+    });
+
+    test('sequential order', function (done) {
+      testSequentialOrder({}, done);
+    });
+
+    test('sequential order compressed', function (done) {
+      testSequentialOrder({blockSize: 256}, done);
+    });
+
+    test('compressed data javascript builder', function () {
+      assert.throws(function () {
+        Store.createWriteStream(tmp.tmpNameSync(), {blockSize: 64, native: false});
+      });
+    });
+
+    test('compressed data invalid block', function (done) {
+      var path = tmp.tmpNameSync();
+      var s = Store.createWriteStream(path, {blockSize: 4096}, function (err) {
+        assert.strictEqual(err, null);
+        // Point the partition's only block before its block table.
+        var buf = fs.readFileSync(path);
+        var table = new Buffer([0, 0, 0, 1, 0, 0, 0, 0, 0, 0, 0, 20]);
+        var pos = -1;
+        var i;
+        for (i = 0; i + table.length <= buf.length; i++) {
+          if (!buf.slice(i, i + table.length).compare(table)) {
+            pos = i;
+          }
+        }
+        assert(pos >= 0);
+        buf[pos + table.length - 1] = 0;
+        fs.writeFileSync(path, buf);
+        var numEntries = 0;
+        new Store(path).createReadStream()
+          .on('data', function () { numEntries++; })
+          .on('error', function (err) {
+            assert(/invalid data/.test(err.message));
+            assert.equal(numEntries, 0);
+            done();
+          })
+          .on('end', function () { assert(false); });
+      });
+      var i;
+      for (i = 0; i < 10; i++) {
+        s.write({key: new Buffer('' + i), value: new Buffer('value' + i)});
+      }
+      s.end();
+    });
+
+    test('sharded store', function (done) {
+      var path = tmp.tmpNameSync();
+      var entries = [];
+      var i;
+      for (i = 0; i < 100; i++) {
+        entries.push({key: new Buffer('' + i), value: new Buffer('' + 2 * i)});
+      }
+      var s = Store.createWriteStream(path, {numShards: 4}, function (err) {
+        assert.strictEqual(err, null);
+        var store = new Store(path);
+        assert.equal(store.getStatistics().numShards, 4);
+        assert.deepEqual(getValue(store, new Buffer('12')), new Buffer('24'));
+        assert.strictEqual(getValue(store, new Buffer('100')), undefined);
+        getEntries(store, function (arr) {
+          arr.sort(function (a, b) { return +a.key.toString() - +b.key.toString(); });
+          assert.deepEqual(arr, entries);
+          done();
+        });
+      });
+      entries.forEach(function (entry) { s.write(entry); });
+      s.end();
+    });
+
+    test('sharded store javascript builder', function () {
+      assert.throws(function () {
+        Store.createWriteStream(tmp.tmpNameSync(), {numShards: 2, native: false});
+      });
+    });
+
+    test('ordered store', function (done) {
+      var path = tmp.tmpNameSync();
+      var keys = [];
+      var i;
+      for (i = 0; i < 200; i++) {
+        // Composite keys: tenant byte, then a variable length identifier.
+        keys.push(Buffer.concat([new Buffer([i % 3]), new Buffer('' + i)]));
+      }
+      var opts = {ordered: true, numShards: 2, bucketized: true};
+      var s = Store.createWriteStream(path, opts, function (err) {
+        assert.strictEqual(err, null);
+        var store = new Store(path);
+        var sorted = keys.slice().sort(function (a, b) { return a.compare(b); });
+        readKeys(store, {prefix: new Buffer([1])}, function (arr) {
+          assert.deepEqual(arr, sorted.filter(function (key) {
+            return key[0] === 1;
+          }));
+          readKeys(store, {prefix: new Buffer([2, 0x35])}, function (arr) {
+            assert.deepEqual(arr.map(String), ['\u00025', '\u000250', '\u000253', '\u000256', '\u000259']);
+            var gte = new Buffer([0, 0x35]);
+            var lt = new Buffer([1]);
+            readKeys(store, {gte: gte, lt: lt}, function (arr) {
+              assert.deepEqual(arr, sorted.filter(function (key) {
+                return key.compare(gte) >= 0 && key.compare(lt) < 0;
+              }));
+              store.count({prefix: new Buffer([1])}, function (err, n) {
+                assert.strictEqual(err, null);
+                assert.equal(n, 67);
+                done();
+              });
+            });
+          });
+        });
+      });
+      keys.forEach(function (key) { s.write({key: key, value: key}); });
+      s.end();
+    });
+
+    test('ordered store javascript builder', function () {
+      assert.throws(function () {
+        Store.createWriteStream(tmp.tmpNameSync(), {ordered: true, native: false});
+      });
+    });
+
+    test('memory budget', function (done) {
+      var entries = [];
+      var i;
+      for (i = 0; i < 5000; i++) {
+        entries.push({key: new Buffer('' + i), value: new Buffer('' + (i % 7))});
+      }
+      writeStore(entries, {}, function (store) {
+        writeStore(entries, {memoryBudget: 4096, filterBits: 10}, function (budgeted) {
+          assert.equal(
+            budgeted.getStatistics().indexSize,
+            store.getStatistics().indexSize
+          );
+          assert.deepEqual(getValue(budgeted, new Buffer('12')), new Buffer('5'));
+          getEntries(store, function (arr) {
+            getEntries(budgeted, function (budgetedArr) {
+              assert.deepEqual(budgetedArr, arr); // Same index order.
+              done();
+            });
+          });
+        });
+      });
+    });
+
+    test('threaded build', function (done) {
+      var entries = [];
+      var i;
+      for (i = 0; i < 100000; i++) {
+        // Large enough for its index to be built in ranges.
+        entries.push({key: new Buffer('' + (1e6 + i)), value: new Buffer('' + (i % 7))});
+      }
+      entries.push({key: new Buffer('ab'), value: new Buffer('c')});
+      writeStore(entries, {numThreads: 1}, function (store) {
+        writeStore(entries, {numThreads: 4, filterBits: 10}, function (threaded) {
+          assert.deepEqual(getValue(threaded, new Buffer('ab')), new Buffer('c'));
+          getEntries(store, function (arr) {
+            getEntries(threaded, function (threadedArr) {
+              assert.equal(arr.length, 100001);
+              assert.deepEqual(threadedArr, arr); // Same index order.
+              done();
+            });
+          });
+        });
+      });
+    });
+
+    test('memory budget javascript builder', function () {
+      assert.throws(function () {
+        Store.createWriteStream(tmp.tmpNameSync(), {memoryBudget: 1024, native: false});
+      });
+    });
+
+    test('prefix without key directory', function () {
+      var store = new Store('test/dat/numbers.store');
+      assert.throws(function () {
+        store.createReadStream({prefix: new Buffer([0x67])});
+      }, /key directory/);
+    });
+
     test('single key', function (done) {
       var path = tmp.tmpNameSync();
       var key = new Buffer([1]);
@@ -226,6 +621,38 @@ suite('index', function () {
       s.end();
     });
 
+    test('small batches', function (done) {
+      var path = tmp.fileSync().name;
+      var opts = {batchSize: 2};
+      var keys = [1, 2, 3, 4, 5].map(function (n) { return new Buffer([n]); });
+      var s = Store.createWriteStream(path, opts, function (err) {
+        assert.strictEqual(err, null);
+        var store = new Store(path);
+        assert.equal(store.getStatistics().numValues, keys.length);
+        keys.forEach(function (key) {
+          assert.deepEqual(getValue(store, key), key);
+        });
+        done();
+      });
+      keys.forEach(function (key) { s.write({key: key, value: key}); });
+      s.end();
+    });
+
+    test('javascript builder', function (done) {
+      var path = tmp.fileSync().name;
+      var opts = {native: false};
+      var key = new Buffer([1, 2]);
+      var value = new Buffer([3]);
+      var s = Store.createWriteStream(path, opts, function (err) {
+        assert.strictEqual(err, null);
+        var store = new Store(path);
+        assert.equal(store.getStatistics().numValues, 1);
+        assert.deepEqual(getValue(store, key), value);
+        done();
+      });
+      s.end({key: key, value: value});
+    });
+
   });
 
   function getValue(store, key) {
@@ -242,6 +669,28 @@ suite('index', function () {
     }
   }
 
+  function testDeduplicatedValues(opts, done) {
+    var path = tmp.tmpNameSync();
+    var values = [new Buffer('abc'), new Buffer('de'), new Buffer(0)];
+    var s = Store.createWriteStream(path, opts, function (err) {
+      assert.strictEqual(err, null);
+      var store = new Store(path);
+      var stats = store.getStatistics();
+      assert.equal(stats.numValues, 30);
+      assert.equal(stats.dataSize, 1 + 4 + 3 + 1); // Reserved byte first.
+      var i;
+      for (i = 0; i < 30; i++) {
+        assert.deepEqual(getValue(store, new Buffer([i])), values[i % 3]);
+      }
+      done();
+    });
+    var i;
+    for (i = 0; i < 30; i++) {
+      s.write({key: new Buffer([i]), value: new Buffer(values[i % 3])});
+    }
+    s.end();
+  }
+
   function getEntries(store, cb) {
     var entries = [];
     store.createReadStream()
@@ -249,4 +698,55 @@ suite('index', function () {
       .on('end', function () { cb(entries); });
   }
 
+  function testSequentialOrder(opts, cb) {
+    // Keys of a single length (so a single partition), inserted out of index
+    // order with distinct and undeduplicated values: data offsets follow
+    // insertion order, which sequential streams should reproduce exactly.
+    var entries = [];
+    var i, key;
+    for (i = 0; i < 500; i++) {
+      key = new Buffer(4);
+      key.writeUInt32BE((i * 7919) % 1009, 0);
+      entries.push({key: key, value: new Buffer('value' + i)});
+    }
+    var opts_ = {valueCacheSize: 0};
+    Object.keys(opts).forEach(function (key) { opts_[key] = opts[key]; });
+    writeStore(entries, opts_, function (store) {
+      var sequential = [];
+      store.createReadStream({sequential: true})
+        .on('data', function (entry) { sequential.push(entry); })
+        .on('end', function () {
+          assert.deepEqual(sequential, entries);
+          getEntries(store, function (arr) {
+            assert.notDeepEqual(arr, entries); // Index order differs.
+            cb();
+          });
+        });
+    });
+  }
+
+  function writeStore(entries, opts, cb) {
+    var path = tmp.tmpNameSync();
+    var s = Store.createWriteStream(path, opts, function (err) {
+      assert.strictEqual(err, null);
+      cb(new Store(path));
+    });
+    entries.forEach(function (entry) { s.write(entry); });
+    s.end();
+  }
+
+  function readKeys(store, opts, cb) {
+    var keys = [];
+    store.createReadStream(opts)
+      .on('data', function (data) {
+        assert.deepEqual(data.value, data.key);
+        keys.push(data.key);
+      })
+      .on('end', function () { cb(keys); });
+  }
+
+  function sum(arr) {
+    return arr.reduce(function (a, b) { return a + b; }, 0);
+  }
+
 });